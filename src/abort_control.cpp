@@ -0,0 +1,131 @@
+/**
+ *-----------------------------------------------------------------------------
+ * Copyright (c) 2021-2024 Melbourne Instruments, Australia
+ *-----------------------------------------------------------------------------
+ * @file  abort_control.cpp
+ * @brief Signal handling and cancellation of the transfer.
+ *-----------------------------------------------------------------------------
+ */
+#include <iostream>
+#include <csignal>
+#include <cerrno>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/signalfd.h>
+#include <sys/eventfd.h>
+#include "common.h"
+#include "abort_control.h"
+
+//----------------------------------------------------------------------------
+// start
+// Must be called before any other threads are created, so that they all
+// inherit the blocked signal mask.
+//----------------------------------------------------------------------------
+bool AbortControl::start(std::atomic<bool> &exit_flag, void (*force_safe_state)(), void (*before_exit)(),
+                         std::atomic<bool> *reconfig_flag)
+{
+    sigset_t signals;
+
+    // Create the signalfd and eventfd, then block the signals so they are only
+    // delivered through the signalfd
+    ::sigemptyset(&signals);
+    ::sigaddset(&signals, SIGINT);
+    ::sigaddset(&signals, SIGTERM);
+    if (reconfig_flag)
+    {
+        ::sigaddset(&signals, SIGHUP);
+    }
+    _signal_fd = ::signalfd(-1, &signals, SFD_CLOEXEC);
+    _event_fd = ::eventfd(0, EFD_CLOEXEC);
+    if ((_signal_fd < 0) || (_event_fd < 0) || (::pthread_sigmask(SIG_BLOCK, &signals, nullptr) != 0))
+    {
+        stop();
+        return false;
+    }
+
+    // Start the control thread
+    _exit_flag = &exit_flag;
+    _reconfig_flag = reconfig_flag;
+    _force_safe_state = force_safe_state;
+    _before_exit = before_exit;
+    _thread = std::thread(&AbortControl::_run, this);
+    return true;
+}
+
+//----------------------------------------------------------------------------
+// stop
+// The signals stay blocked, so a signal during shutdown is ignored.
+//----------------------------------------------------------------------------
+void AbortControl::stop()
+{
+    if (_thread.joinable())
+    {
+        uint64_t value = 1;
+        [[maybe_unused]] auto ret = ::write(_event_fd, &value, sizeof(value));
+        _thread.join();
+    }
+    if (_signal_fd >= 0)
+    {
+        ::close(_signal_fd);
+        _signal_fd = -1;
+    }
+    if (_event_fd >= 0)
+    {
+        ::close(_event_fd);
+        _event_fd = -1;
+    }
+}
+
+//----------------------------------------------------------------------------
+// _run
+//----------------------------------------------------------------------------
+void AbortControl::_run()
+{
+    struct pollfd fds[2] = {{_signal_fd, POLLIN, 0}, {_event_fd, POLLIN, 0}};
+    struct signalfd_siginfo info;
+
+    // Wait for an exit signal, or the app to stop us
+    while (true)
+    {
+        while ((::poll(fds, 2, -1) < 0) && (errno == EINTR))
+        {
+        }
+        if (fds[1].revents)
+        {
+            return;
+        }
+        if (::read(_signal_fd, &info, sizeof(info)) != sizeof(info))
+        {
+            break;
+        }
+        if (info.ssi_signo != SIGHUP)
+        {
+            MSG("\nReceived signal " << info.ssi_signo << ", aborting");
+            break;
+        }
+        _reconfig_flag->store(true);
+    }
+
+    // Signal the app to exit, and give it time to shut down cleanly. The
+    // abort is recorded first, so it is not lost if the app clears the exit
+    // flag to retry a timed out phase
+    _aborted = true;
+    _exit_flag->store(true);
+    fds[1].revents = 0;
+    while ((::poll(&fds[1], 1, ABORT_TIMEOUT_MS) < 0) && (errno == EINTR))
+    {
+    }
+    if (!fds[1].revents)
+    {
+        MSG("Abort timed out, forcing a safe state");
+        if (_force_safe_state)
+        {
+            _force_safe_state();
+        }
+        if (_before_exit)
+        {
+            _before_exit();
+        }
+        ::_exit(ABORT_EXIT_CODE);
+    }
+}
@@ -0,0 +1,53 @@
+/**
+ *-----------------------------------------------------------------------------
+ * Copyright (c) 2021-2024 Melbourne Instruments, Australia
+ *-----------------------------------------------------------------------------
+ * @file  abort_control.h
+ * @brief Signal handling and cancellation of the transfer.
+ *
+ * SIGINT/SIGTERM are blocked and read from a signalfd by a control thread,
+ * so nothing runs in signal context. The control thread sets the exit flag,
+ * which the transfer kernels check once per chunk, and then waits for the
+ * app to shut down. If that does not happen within ABORT_TIMEOUT_MS it puts
+ * the pins into a safe state itself, calls the before exit callback (to
+ * restore any system settings) and exits, which bounds the abort latency
+ * whatever the kernel is doing. If a reconfigure flag is given,
+ * SIGHUP sets it instead, as a request to reconfigure the FPGAs.
+ *-----------------------------------------------------------------------------
+ */
+#ifndef _ABORT_CONTROL_H
+#define _ABORT_CONTROL_H
+
+#include <atomic>
+#include <thread>
+
+// Constants
+constexpr int ABORT_TIMEOUT_MS = 100;
+constexpr int ABORT_EXIT_CODE  = 2;
+
+// Abort control
+class AbortControl
+{
+public:
+    AbortControl() = default;
+    ~AbortControl() { stop(); }
+
+    bool start(std::atomic<bool> &exit_flag, void (*force_safe_state)(), void (*before_exit)()=nullptr,
+               std::atomic<bool> *reconfig_flag=nullptr);
+    void stop();
+    bool aborted() const { return _aborted; }
+
+private:
+    int _signal_fd = -1;
+    int _event_fd = -1;
+    std::atomic<bool> *_exit_flag = nullptr;
+    std::atomic<bool> *_reconfig_flag = nullptr;
+    std::atomic<bool> _aborted{false};
+    void (*_force_safe_state)() = nullptr;
+    void (*_before_exit)() = nullptr;
+    std::thread _thread;
+
+    void _run();
+};
+
+#endif  // _ABORT_CONTROL_H
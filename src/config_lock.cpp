@@ -0,0 +1,135 @@
+/**
+ *-----------------------------------------------------------------------------
+ * Copyright (c) 2021-2024 Melbourne Instruments, Australia
+ *-----------------------------------------------------------------------------
+ * @file  config_lock.cpp
+ * @brief Lock serialising and coalescing concurrent configurations.
+ *-----------------------------------------------------------------------------
+ */
+#include <cerrno>
+#include <thread>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/file.h>
+#include "hash.h"
+#include "config_lock.h"
+
+// Local functions
+uint64_t _record_checksum(ConfigLockRecord record);
+
+//----------------------------------------------------------------------------
+// acquire
+// Waits for the lock, polling so that the wait can be aborted. Only a
+// successful result is reused; if the configuration in flight failed, it
+// is retried by the waiter.
+//----------------------------------------------------------------------------
+LockResult ConfigLock::acquire(const char *path, uint64_t key, const std::atomic<bool> &exit_flag, int &result, uint &owner_pid)
+{
+    ConfigLockRecord record;
+
+    // Open the lock file
+    release(-1);
+    _fd = ::open(path, (O_RDWR|O_CREAT|O_CLOEXEC), 0644);
+    if (_fd < 0)
+    {
+        return LockResult::ERROR;
+    }
+
+    // If the lock is held, check what is in flight and wait for it
+    if (::flock(_fd, (LOCK_EX|LOCK_NB)) != 0)
+    {
+        bool same_key = false;
+        uint64_t generation = 0;
+
+        if (errno != EWOULDBLOCK)
+        {
+            ::close(_fd);
+            _fd = -1;
+            return LockResult::ERROR;
+        }
+        if (_read_record(record) && (record.state == ConfigState::IN_PROGRESS) && (record.key == key))
+        {
+            same_key = true;
+            generation = record.generation;
+            owner_pid = record.pid;
+        }
+        while (::flock(_fd, (LOCK_EX|LOCK_NB)) != 0)
+        {
+            if (exit_flag)
+            {
+                ::close(_fd);
+                _fd = -1;
+                return LockResult::ABORTED;
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(CONFIG_LOCK_POLL_MS));
+        }
+
+        // Reuse the result if the same images were configured successfully
+        if (same_key && _read_record(record) && (record.generation == generation) &&
+            (record.state == ConfigState::DONE) && (record.key == key) && (record.result == 0))
+        {
+            result = record.result;
+            ::flock(_fd, LOCK_UN);
+            ::close(_fd);
+            _fd = -1;
+            return LockResult::COALESCED;
+        }
+    }
+
+    // We now own the configuration, record what is in flight
+    uint64_t generation = _read_record(record) ? record.generation : 0;
+    _record = { CONFIG_LOCK_MAGIC, ConfigState::IN_PROGRESS, key, (generation + 1), 0, static_cast<uint32_t>(::getpid()), 0 };
+    _write_record(_record);
+    return LockResult::ACQUIRED;
+}
+
+//----------------------------------------------------------------------------
+// release
+//----------------------------------------------------------------------------
+void ConfigLock::release(int result)
+{
+    if (_fd >= 0)
+    {
+        _record.state = ConfigState::DONE;
+        _record.result = result;
+        _write_record(_record);
+        ::flock(_fd, LOCK_UN);
+        ::close(_fd);
+        _fd = -1;
+    }
+}
+
+//----------------------------------------------------------------------------
+// _read_record
+// The record is read without the lock while waiting, so it is checksummed
+// to catch a torn read.
+//----------------------------------------------------------------------------
+bool ConfigLock::_read_record(ConfigLockRecord &record)
+{
+    if (::pread(_fd, &record, sizeof(record), 0) != sizeof(record))
+    {
+        return false;
+    }
+    return (record.magic == CONFIG_LOCK_MAGIC) && (record.checksum == _record_checksum(record));
+}
+
+//----------------------------------------------------------------------------
+// _write_record
+// Written from a copy of the whole record, as GCC otherwise takes the
+// source to be its first member when inlined (-Wstringop-overread).
+//----------------------------------------------------------------------------
+bool ConfigLock::_write_record(ConfigLockRecord &record)
+{
+    record.checksum = _record_checksum(record);
+    const ConfigLockRecord copy = record;
+    return ::pwrite(_fd, static_cast<const void *>(&copy), sizeof(copy), 0) == sizeof(copy);
+}
+
+//----------------------------------------------------------------------------
+// _record_checksum
+//----------------------------------------------------------------------------
+uint64_t _record_checksum(ConfigLockRecord record)
+{
+    record.checksum = 0;
+    return hash_bytes(&record, sizeof(record));
+}
@@ -0,0 +1,77 @@
+/**
+ *-----------------------------------------------------------------------------
+ * Copyright (c) 2021-2024 Melbourne Instruments, Australia
+ *-----------------------------------------------------------------------------
+ * @file  config_lock.h
+ * @brief Lock serialising and coalescing concurrent configurations.
+ *
+ * The invocation configuring the FPGAs holds an exclusive flock on the lock
+ * file for the whole configuration, and keeps a small record in the file of
+ * the images being configured, keyed by the name, size, mtime, device and
+ * inode of each image file, so no image is read to take the lock. Another
+ * invocation waits for the lock; if it asked for the same images as the one
+ * in flight and that configuration succeeded, the result is reused instead
+ * of configuring again. Invocations for different images simply queue on
+ * the lock.
+ *-----------------------------------------------------------------------------
+ */
+#ifndef _CONFIG_LOCK_H
+#define _CONFIG_LOCK_H
+
+#include <cstdint>
+#include <atomic>
+#include <sys/types.h>
+
+// Constants
+constexpr char DEFAULT_LOCK_FILE_PATH[] = "/run/fpga_config.lock";
+constexpr uint32_t CONFIG_LOCK_MAGIC    = 0x4B4C4746;    // "FGLK"
+constexpr uint CONFIG_LOCK_POLL_MS      = 10;
+
+// Configuration states
+enum class ConfigState : uint32_t
+{
+    IDLE,
+    IN_PROGRESS,
+    DONE
+};
+
+// The record kept in the lock file
+struct ConfigLockRecord
+{
+    uint32_t magic;
+    ConfigState state;
+    uint64_t key;
+    uint64_t generation;
+    int32_t result;
+    uint32_t pid;
+    uint64_t checksum;
+};
+
+// Result of acquiring the lock
+enum class LockResult
+{
+    ACQUIRED,
+    COALESCED,
+    ABORTED,
+    ERROR
+};
+
+// Config lock
+class ConfigLock
+{
+public:
+    ConfigLock() = default;
+    ~ConfigLock() { release(-1); }
+
+    LockResult acquire(const char *path, uint64_t key, const std::atomic<bool> &exit_flag, int &result, uint &owner_pid);
+    void release(int result);
+
+private:
+    int _fd = -1;
+    ConfigLockRecord _record = {};
+
+    bool _read_record(ConfigLockRecord &record);
+    bool _write_record(ConfigLockRecord &record);
+};
+
+#endif  // _CONFIG_LOCK_H
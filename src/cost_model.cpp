@@ -0,0 +1,207 @@
+/**
+ *-----------------------------------------------------------------------------
+ * Copyright (c) 2021-2024 Melbourne Instruments, Australia
+ *-----------------------------------------------------------------------------
+ * @file  cost_model.cpp
+ * @brief Transfer time prediction from kernel activity counts.
+ *-----------------------------------------------------------------------------
+ */
+#include <cstring>
+#include <fstream>
+#include <algorithm>
+#include "cost_model.h"
+#include "transfer.h"
+#include "spi_engine.h"
+#include "protocol.h"
+
+// Constants
+constexpr char DEVICE_TREE_MODEL_PATH[] = "/proc/device-tree/model";
+constexpr char DEFAULT_PLATFORM[]       = "pi4";
+
+// Built-in platform coefficients. Tuning files generated on the target take
+// precedence over these
+const CostCoefficients platform_coefficients[] = {
+    // platform  write  bit   byte  disp  spi_msg rev
+    { "pi4",     3.0,   1.3,  1.0,  9.0,  25.0,   0.10 },
+    { "cm4",     3.0,   1.3,  1.0,  9.0,  25.0,   0.10 },
+    { "pi400",   3.0,   1.1,  0.8,  7.5,  25.0,   0.08 },
+};
+
+//----------------------------------------------------------------------------
+// find_platform_coefficients
+//----------------------------------------------------------------------------
+bool find_platform_coefficients(const char *platform, CostCoefficients &coeffs)
+{
+    for (const CostCoefficients &c : platform_coefficients)
+    {
+        if (c.platform == platform)
+        {
+            coeffs = c;
+            return true;
+        }
+    }
+    return false;
+}
+
+//----------------------------------------------------------------------------
+// detect_platform_coefficients
+// Picks the built-in coefficients from the device tree model, defaulting to
+// the Pi 4 (e.g. when run on a workstation).
+//----------------------------------------------------------------------------
+void detect_platform_coefficients(CostCoefficients &coeffs)
+{
+    std::ifstream file(DEVICE_TREE_MODEL_PATH);
+    std::string model;
+    const char *platform = DEFAULT_PLATFORM;
+
+    std::getline(file, model, '\0');
+    if (model.find("Compute Module 4") != std::string::npos)
+    {
+        platform = "cm4";
+    }
+    else if (model.find("Raspberry Pi 400") != std::string::npos)
+    {
+        platform = "pi400";
+    }
+    find_platform_coefficients(platform, coeffs);
+}
+
+//----------------------------------------------------------------------------
+// load_tuning_file
+// Overrides the coefficients with any values in the tuning file. Unknown
+// keys are ignored so the file can hold values for other consumers.
+//----------------------------------------------------------------------------
+bool load_tuning_file(const char *path, CostCoefficients &coeffs)
+{
+    const struct { const char *key; double CostCoefficients::*value; } keys[] = {
+        { "gpio_write_ns",    &CostCoefficients::gpio_write_ns },
+        { "bit_loop_ns",      &CostCoefficients::bit_loop_ns },
+        { "byte_loop_ns",     &CostCoefficients::byte_loop_ns },
+        { "byte_dispatch_ns", &CostCoefficients::byte_dispatch_ns },
+        { "spi_message_us",   &CostCoefficients::spi_message_us },
+        { "bit_reverse_ns",   &CostCoefficients::bit_reverse_ns },
+    };
+    std::ifstream file(path);
+    std::string line;
+
+    if (!file.is_open())
+    {
+        return false;
+    }
+    while (std::getline(file, line))
+    {
+        // Strip comments, and split into key and value
+        line = line.substr(0, line.find('#'));
+        auto sep = line.find('=');
+        if (sep == std::string::npos)
+        {
+            continue;
+        }
+        auto trim = [](std::string str) {
+            str.erase(0, str.find_first_not_of(" \t"));
+            str.erase(str.find_last_not_of(" \t\r") + 1);
+            return str;
+        };
+        std::string key = trim(line.substr(0, sep));
+        std::string value = trim(line.substr(sep + 1));
+
+        // Set the coefficient
+        if (key == "platform")
+        {
+            coeffs.platform = value;
+            continue;
+        }
+        for (const auto &k : keys)
+        {
+            if (key == k.key)
+            {
+                coeffs.*k.value = std::strtod(value.c_str(), nullptr);
+            }
+        }
+    }
+    return true;
+}
+
+//----------------------------------------------------------------------------
+// count_cpu_kernel
+//----------------------------------------------------------------------------
+bool count_cpu_kernel(const uint8_t *data, uint size, KernelCounts &counts)
+{
+    CountingGpio gpio;
+    std::atomic<bool> no_exit(false);
+
+    transfer_data(gpio, data, size, no_exit);
+    counts.num_bytes = size;
+    counts.num_gpio_writes = gpio.num_writes;
+    return true;
+}
+
+//----------------------------------------------------------------------------
+// count_spi_kernel
+//----------------------------------------------------------------------------
+bool count_spi_kernel(const uint8_t *data, uint size, KernelCounts &counts)
+{
+    SpiRecordDevice spi_record(SPI_TRANSFER_LEN);
+    SpiEngine spi_engine(spi_record);
+    std::atomic<bool> no_exit(false);
+
+    if (!spi_engine.transfer(data, size, no_exit))
+    {
+        return false;
+    }
+    counts.num_bytes = size;
+    counts.num_spi_messages = spi_record.num_messages();
+    counts.num_spi_bytes = spi_record.bytes().size();
+    return true;
+}
+
+//----------------------------------------------------------------------------
+// count_table_kernel
+//----------------------------------------------------------------------------
+bool count_table_kernel(const uint8_t *data, uint size, KernelCounts &counts)
+{
+    CountingGpio gpio;
+    std::atomic<bool> no_exit(false);
+
+    transfer_data_table(gpio, data, size, no_exit);
+    counts.num_bytes = size;
+    counts.num_gpio_writes = gpio.num_writes;
+    return true;
+}
+
+//----------------------------------------------------------------------------
+// predict_cpu_transfer_us
+// Every register store plus the per bit and per byte loop overhead.
+//----------------------------------------------------------------------------
+double predict_cpu_transfer_us(const KernelCounts &counts, const CostCoefficients &coeffs)
+{
+    double ns = (counts.num_gpio_writes * coeffs.gpio_write_ns) +
+                (counts.num_bytes * 8 * coeffs.bit_loop_ns) +
+                (counts.num_bytes * coeffs.byte_loop_ns);
+    return ns / 1000.0;
+}
+
+//----------------------------------------------------------------------------
+// predict_table_transfer_us
+// Every register store plus the dispatch of each byte, which includes the
+// I-cache misses of the handlers.
+//----------------------------------------------------------------------------
+double predict_table_transfer_us(const KernelCounts &counts, const CostCoefficients &coeffs)
+{
+    double ns = (counts.num_gpio_writes * coeffs.gpio_write_ns) + (counts.num_bytes * coeffs.byte_dispatch_ns);
+    return ns / 1000.0;
+}
+
+//----------------------------------------------------------------------------
+// predict_spi_transfer_us
+// Wire time plus the ioctl overhead of each message. Bit reversal (LSB
+// first protocols only) overlaps with sending, except for the first
+// message.
+//----------------------------------------------------------------------------
+double predict_spi_transfer_us(const KernelCounts &counts, const CostCoefficients &coeffs, uint speed_hz)
+{
+    double wire_us = (counts.num_spi_bytes * 8 * 1000000.0) / speed_hz;
+    double first_message_bytes = ConfigProtocol::MSB_FIRST ? 0 : std::min<double>(counts.num_bytes, SPI_TRANSFER_LEN);
+    return wire_us + (counts.num_spi_messages * coeffs.spi_message_us) +
+           ((first_message_bytes * coeffs.bit_reverse_ns) / 1000.0);
+}
@@ -0,0 +1,56 @@
+/**
+ *-----------------------------------------------------------------------------
+ * Copyright (c) 2021-2024 Melbourne Instruments, Australia
+ *-----------------------------------------------------------------------------
+ * @file  cost_model.h
+ * @brief Transfer time prediction from kernel activity counts.
+ *
+ * Each kernel is run against a counting backend, and the counts are turned
+ * into a predicted transfer time using per-platform coefficients. The
+ * built-in coefficients can be overridden by a tuning file, which uses a
+ * simple "key = value" format with '#' comments.
+ *-----------------------------------------------------------------------------
+ */
+#ifndef _COST_MODEL_H
+#define _COST_MODEL_H
+
+#include <cstdint>
+#include <string>
+#include <sys/types.h>
+
+// Constants
+constexpr char TUNING_FILE_PATH[] = "/etc/fpga_config/tuning.conf";
+
+// Cost model coefficients for a platform
+struct CostCoefficients
+{
+    std::string platform;
+    double gpio_write_ns;       // CPU store to GPSET0/GPCLR0
+    double bit_loop_ns;         // CPU kernel loop overhead per bit
+    double byte_loop_ns;        // CPU kernel loop overhead per byte
+    double byte_dispatch_ns;    // Table kernel handler dispatch per byte
+    double spi_message_us;      // spidev ioctl overhead per message
+    double bit_reverse_ns;      // Bit reversal per byte
+};
+
+// Kernel activity counts for an image
+struct KernelCounts
+{
+    uint64_t num_bytes = 0;
+    uint64_t num_gpio_writes = 0;
+    uint64_t num_spi_messages = 0;
+    uint64_t num_spi_bytes = 0;
+};
+
+// Functions
+bool find_platform_coefficients(const char *platform, CostCoefficients &coeffs);
+void detect_platform_coefficients(CostCoefficients &coeffs);
+bool load_tuning_file(const char *path, CostCoefficients &coeffs);
+bool count_cpu_kernel(const uint8_t *data, uint size, KernelCounts &counts);
+bool count_spi_kernel(const uint8_t *data, uint size, KernelCounts &counts);
+bool count_table_kernel(const uint8_t *data, uint size, KernelCounts &counts);
+double predict_cpu_transfer_us(const KernelCounts &counts, const CostCoefficients &coeffs);
+double predict_spi_transfer_us(const KernelCounts &counts, const CostCoefficients &coeffs, uint speed_hz);
+double predict_table_transfer_us(const KernelCounts &counts, const CostCoefficients &coeffs);
+
+#endif  // _COST_MODEL_H
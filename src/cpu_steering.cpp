@@ -0,0 +1,249 @@
+/**
+ *-----------------------------------------------------------------------------
+ * Copyright (c) 2021-2024 Melbourne Instruments, Australia
+ *-----------------------------------------------------------------------------
+ * @file  cpu_steering.cpp
+ * @brief IRQ affinity and CPU frequency steering for the transfer window.
+ *-----------------------------------------------------------------------------
+ */
+#include <iostream>
+#include <fstream>
+#include <cstdio>
+#include <cstdlib>
+#include <cctype>
+#include <sched.h>
+#include <dirent.h>
+#include "common.h"
+#include "cpu_steering.h"
+
+// Constants
+constexpr char PERFORMANCE_GOVERNOR[] = "performance";
+constexpr uint IRQ_MASK_GROUP_BITS    = 32;
+
+// Local functions
+bool _read_setting(const std::string &path, std::string &value);
+bool _clear_mask_cpu(const std::string &mask, uint cpu, std::string &new_mask);
+
+//----------------------------------------------------------------------------
+// set_roots
+//----------------------------------------------------------------------------
+void CpuSteering::set_roots(const std::string &sysfs_root, const std::string &procfs_root)
+{
+    _sysfs_root = sysfs_root;
+    _procfs_root = procfs_root;
+}
+
+//----------------------------------------------------------------------------
+// apply
+// Any setting that cannot be changed is left alone, only failing to pin the
+// process to the CPU is an error. The IRQs and frequency are still steered
+// in that case.
+//----------------------------------------------------------------------------
+bool CpuSteering::apply(uint cpu)
+{
+    cpu_set_t cpu_set;
+    bool pinned = true;
+
+    // Pin the process to the transfer CPU
+    restore();
+    if (::sched_getaffinity(0, sizeof(_affinity), &_affinity) == 0)
+    {
+        _affinity_saved = true;
+    }
+    CPU_ZERO(&cpu_set);
+    CPU_SET(cpu, &cpu_set);
+    if (::sched_setaffinity(0, sizeof(cpu_set), &cpu_set) != 0)
+    {
+        MSG("Could not pin to CPU " << cpu);
+        pinned = false;
+    }
+
+    // Move the IRQs off the CPU, and raise its frequency
+    _move_irqs(cpu);
+    _raise_frequency(cpu);
+    return pinned;
+}
+
+//----------------------------------------------------------------------------
+// restore
+// Settings are restored in the reverse order they were changed.
+//----------------------------------------------------------------------------
+void CpuSteering::restore()
+{
+    while (!_saved.empty())
+    {
+        const SavedSetting &setting = _saved.back();
+        std::ofstream file(setting.path);
+        file << setting.value << std::endl;
+        if (!file.good())
+        {
+            DEBUG_MSG("Could not restore " << setting.path);
+        }
+        _saved.pop_back();
+    }
+    if (_affinity_saved)
+    {
+        ::sched_setaffinity(0, sizeof(_affinity), &_affinity);
+        _affinity_saved = false;
+    }
+}
+
+//----------------------------------------------------------------------------
+// _move_irqs
+// IRQs that are only routed to the CPU (per-CPU timers, IPIs) are left on
+// it, and the kernel refuses to move some others.
+//----------------------------------------------------------------------------
+void CpuSteering::_move_irqs(uint cpu)
+{
+    std::string irq_dir = _procfs_root + "/irq/";
+    std::vector<std::string> paths = { irq_dir + "default_smp_affinity" };
+    uint num_moved = 0;
+    uint num_irqs = 0;
+
+    // Find each IRQ
+    DIR *d = ::opendir(irq_dir.c_str());
+    if (!d)
+    {
+        MSG("Could not open " << irq_dir);
+        return;
+    }
+    struct dirent *entry;
+    while ((entry = ::readdir(d)) != nullptr)
+    {
+        if (std::isdigit(static_cast<unsigned char>(entry->d_name[0])))
+        {
+            paths.push_back(irq_dir + entry->d_name + "/smp_affinity");
+        }
+    }
+    ::closedir(d);
+
+    // Clear the CPU from each affinity mask
+    for (const std::string &path : paths)
+    {
+        std::string mask;
+        std::string new_mask;
+        if (_read_setting(path, mask) && _clear_mask_cpu(mask, cpu, new_mask))
+        {
+            num_irqs++;
+            if ((new_mask != mask) && _change_setting(path, new_mask))
+            {
+                num_moved++;
+            }
+        }
+    }
+    MSG("Moved " << num_moved << " of " << num_irqs << " IRQ affinities off CPU " << cpu);
+}
+
+//----------------------------------------------------------------------------
+// _raise_frequency
+//----------------------------------------------------------------------------
+void CpuSteering::_raise_frequency(uint cpu)
+{
+    std::string cpufreq_dir = _sysfs_root + "/devices/system/cpu/cpu" + std::to_string(cpu) + "/cpufreq/";
+    std::string governors;
+    std::string max_freq;
+
+    // Use the performance governor if available, otherwise raise the minimum
+    // frequency to the maximum
+    if (_read_setting((cpufreq_dir + "scaling_available_governors"), governors) &&
+        (governors.find(PERFORMANCE_GOVERNOR) != std::string::npos) &&
+        _change_setting((cpufreq_dir + "scaling_governor"), PERFORMANCE_GOVERNOR))
+    {
+        MSG("CPU " << cpu << " governor: " << PERFORMANCE_GOVERNOR);
+    }
+    else if (_read_setting((cpufreq_dir + "cpuinfo_max_freq"), max_freq) &&
+             _change_setting((cpufreq_dir + "scaling_min_freq"), max_freq))
+    {
+        MSG("CPU " << cpu << " minimum frequency: " << max_freq << "kHz");
+    }
+    else
+    {
+        MSG("Could not raise the CPU " << cpu << " frequency");
+    }
+}
+
+//----------------------------------------------------------------------------
+// _change_setting
+// The previous value is saved so it can be restored.
+//----------------------------------------------------------------------------
+bool CpuSteering::_change_setting(const std::string &path, const std::string &value)
+{
+    std::string old_value;
+
+    if (!_read_setting(path, old_value))
+    {
+        return false;
+    }
+    if (old_value == value)
+    {
+        return true;
+    }
+    std::ofstream file(path);
+    file << value << std::endl;
+    if (!file.good())
+    {
+        return false;
+    }
+    _saved.push_back({path, old_value});
+    return true;
+}
+
+//----------------------------------------------------------------------------
+// _read_setting
+//----------------------------------------------------------------------------
+bool _read_setting(const std::string &path, std::string &value)
+{
+    std::ifstream file(path);
+    if (!file.is_open() || !std::getline(file, value))
+    {
+        return false;
+    }
+    value.erase(value.find_last_not_of(" \t\r\n") + 1);
+    return true;
+}
+
+//----------------------------------------------------------------------------
+// _clear_mask_cpu
+// Affinity masks are comma separated groups of 32 bit hex words, most
+// significant first. The width of each group is kept, so an unchanged mask
+// reads back the same. Fails if the mask is not valid, or the CPU is the only
+// one in it.
+//----------------------------------------------------------------------------
+bool _clear_mask_cpu(const std::string &mask, uint cpu, std::string &new_mask)
+{
+    std::vector<uint32_t> groups;
+    std::vector<int> widths;
+    std::string::size_type pos = 0;
+    bool empty = true;
+
+    // Split the mask into its groups
+    while (pos <= mask.size())
+    {
+        auto sep = mask.find(',', pos);
+        std::string group = mask.substr(pos, (sep == std::string::npos) ? std::string::npos : (sep - pos));
+        char *end;
+        groups.push_back(std::strtoul(group.c_str(), &end, 16));
+        widths.push_back(group.size());
+        if (group.empty() || (*end != '\0'))
+        {
+            return false;
+        }
+        pos = (sep == std::string::npos) ? (mask.size() + 1) : (sep + 1);
+    }
+
+    // Clear the CPU bit, the last group holds CPUs 0-31
+    uint group_index = cpu / IRQ_MASK_GROUP_BITS;
+    if (group_index < groups.size())
+    {
+        groups[groups.size() - 1 - group_index] &= ~(1u << (cpu % IRQ_MASK_GROUP_BITS));
+    }
+    new_mask.clear();
+    for (uint i=0; i<groups.size(); i++)
+    {
+        char group[16];
+        std::snprintf(group, sizeof(group), ((i == 0) ? "%0*x" : ",%0*x"), widths[i], groups[i]);
+        new_mask += group;
+        empty &= (groups[i] == 0);
+    }
+    return !empty;
+}
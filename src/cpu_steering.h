@@ -0,0 +1,58 @@
+/**
+ *-----------------------------------------------------------------------------
+ * Copyright (c) 2021-2024 Melbourne Instruments, Australia
+ *-----------------------------------------------------------------------------
+ * @file  cpu_steering.h
+ * @brief IRQ affinity and CPU frequency steering for the transfer window.
+ *
+ * While the FPGAs are being configured the process is pinned to the transfer
+ * core, every movable IRQ is moved off that core, and the core is asked to
+ * run flat out (performance governor, or the minimum frequency raised to the
+ * maximum if that governor is not available). The previous settings are
+ * restored afterwards. The sysfs and procfs roots can be changed so this can
+ * be run against a fake tree.
+ *-----------------------------------------------------------------------------
+ */
+#ifndef _CPU_STEERING_H
+#define _CPU_STEERING_H
+
+#include <string>
+#include <vector>
+#include <sched.h>
+#include <sys/types.h>
+
+// Constants
+constexpr char DEFAULT_SYSFS_ROOT[]  = "/sys";
+constexpr char DEFAULT_PROCFS_ROOT[] = "/proc";
+
+// CPU steering
+class CpuSteering
+{
+public:
+    CpuSteering() = default;
+    ~CpuSteering() { restore(); }
+
+    void set_roots(const std::string &sysfs_root, const std::string &procfs_root);
+    bool apply(uint cpu);
+    void restore();
+
+private:
+    // A sysfs/procfs setting changed by apply, and its previous value
+    struct SavedSetting
+    {
+        std::string path;
+        std::string value;
+    };
+
+    std::string _sysfs_root = DEFAULT_SYSFS_ROOT;
+    std::string _procfs_root = DEFAULT_PROCFS_ROOT;
+    std::vector<SavedSetting> _saved;
+    bool _affinity_saved = false;
+    cpu_set_t _affinity;
+
+    void _move_irqs(uint cpu);
+    void _raise_frequency(uint cpu);
+    bool _change_setting(const std::string &path, const std::string &value);
+};
+
+#endif  // _CPU_STEERING_H
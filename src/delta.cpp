@@ -0,0 +1,330 @@
+/**
+ *-----------------------------------------------------------------------------
+ * Copyright (c) 2021-2024 Melbourne Instruments, Australia
+ *-----------------------------------------------------------------------------
+ * @file  delta.cpp
+ * @brief Binary-delta FPGA images, applied while the image is transferred.
+ *-----------------------------------------------------------------------------
+ */
+#include <algorithm>
+#include <cstring>
+#include <unordered_map>
+#include "hash.h"
+#include "delta.h"
+#include "image_slots.h"
+
+// Constants
+constexpr uint DELTA_PIECE_SIZE = 16384;    // Bytes built between progress updates
+constexpr uint DELTA_BLOCK_SIZE = 32;       // Shortest match copied from the base
+constexpr uint DELTA_MIN_RUN    = 32;       // Shortest run of one byte encoded as a run
+
+// Local functions
+uint64_t _header_checksum(DeltaHeader header);
+void _emit_op(std::vector<uint8_t> &delta, DeltaOp op, uint32_t len);
+void _emit_add(std::vector<uint8_t> &delta, const uint8_t *data, uint32_t len);
+void _emit_u32(std::vector<uint8_t> &delta, uint32_t value);
+uint _run_length(const std::vector<uint8_t> &data, uint pos);
+
+//----------------------------------------------------------------------------
+// start
+// Checks the delta and loads its base, then sizes the target and starts
+// building it. The base is copied from the resident image if it is the
+// one the delta was made against, otherwise it is read from its file.
+//----------------------------------------------------------------------------
+bool DeltaApplier::start(const std::string &dir, const std::string &filename, std::vector<uint8_t> &target, uint64_t &target_hash,
+                         const std::vector<uint8_t> *resident_base, uint64_t resident_hash)
+{
+    DeltaHeader header;
+
+    // Open the delta and check its header
+    _file.open((dir + filename), (std::ios::in|std::ios::binary));
+    if (!_file.is_open() || !_file.read(reinterpret_cast<char *>(&header), sizeof(header)) ||
+        (header.magic != DELTA_MAGIC) || (header.version != DELTA_VERSION) || (header.checksum != _header_checksum(header)) ||
+        (header.target_size == 0) || !std::memchr(header.base_filename, 0, sizeof(header.base_filename)) ||
+        std::strchr(header.base_filename, '/'))
+    {
+        return false;
+    }
+
+    // Get the base, which must be the image the delta was made against
+    if (resident_base && (resident_hash == header.base_hash) && (resident_base->size() == header.base_size))
+    {
+        _base = *resident_base;
+    }
+    else
+    {
+        if (!read_image_file((dir + header.base_filename), _base) ||
+            (_base.size() != header.base_size) || (hash_bytes(_base.data(), _base.size()) != header.base_hash))
+        {
+            return false;
+        }
+    }
+
+    // Start building the target
+    target.resize(header.target_size);
+    _target = target.data();
+    _target_size = header.target_size;
+    _target_hash = header.target_hash;
+    target_hash = header.target_hash;
+    _thread = std::thread(&DeltaApplier::_apply, this);
+    return true;
+}
+
+//----------------------------------------------------------------------------
+// wait_for
+// Sleeps until the first bytes of the target are built, waking to check
+// the exit flag. Returns false if the delta could not be applied, in which
+// case the rest of the target is zeros, or if the exit flag was set.
+//----------------------------------------------------------------------------
+bool DeltaApplier::wait_for(uint num_bytes, const std::atomic<bool> &exit_flag) const
+{
+    std::unique_lock<std::mutex> lock(_ready_mutex);
+
+    num_bytes = std::min(num_bytes, _target_size);
+    while (_num_ready.load(std::memory_order_acquire) < num_bytes)
+    {
+        if (exit_flag.load(std::memory_order_relaxed))
+        {
+            return false;
+        }
+        _ready.wait_for(lock, std::chrono::milliseconds(DELTA_WAIT_POLL_MS));
+    }
+    return !_failed.load(std::memory_order_acquire);
+}
+
+//----------------------------------------------------------------------------
+// finish
+// Waits until the target is built, and returns true if it matches the
+// target hash.
+//----------------------------------------------------------------------------
+bool DeltaApplier::finish()
+{
+    if (_thread.joinable())
+    {
+        _thread.join();
+    }
+    return !_failed;
+}
+
+//----------------------------------------------------------------------------
+// _apply
+// Builds the target from the instructions, publishing the number of bytes
+// built after each piece so the transfer can follow it.
+//----------------------------------------------------------------------------
+void DeltaApplier::_apply()
+{
+    uint64_t hash = FNV_OFFSET_BASIS;
+    uint pos = 0;
+    bool ok = false;
+
+    while (true)
+    {
+        // Get the next instruction and check it stays within the images
+        uint8_t op;
+        uint32_t len;
+        uint32_t offset = 0;
+        uint8_t byte = 0;
+        if (!_file.read(reinterpret_cast<char *>(&op), sizeof(op)))
+        {
+            break;
+        }
+        if (op == DELTA_OP_END)
+        {
+            ok = (pos == _target_size) && (hash == _target_hash);
+            break;
+        }
+        if (!_file.read(reinterpret_cast<char *>(&len), sizeof(len)) || (len > (_target_size - pos)) ||
+            ((op == DELTA_OP_COPY) && (!_file.read(reinterpret_cast<char *>(&offset), sizeof(offset)) ||
+                                       (offset > _base.size()) || (len > (_base.size() - offset)))) ||
+            ((op == DELTA_OP_RUN) && !_file.read(reinterpret_cast<char *>(&byte), sizeof(byte))) ||
+            (op > DELTA_OP_RUN))
+        {
+            break;
+        }
+
+        // Build its bytes in pieces
+        uint end = pos + len;
+        while (pos < end)
+        {
+            uint n = std::min((end - pos), DELTA_PIECE_SIZE);
+            uint8_t *dst = _target + pos;
+            if (op == DELTA_OP_ADD)
+            {
+                if (!_file.read(reinterpret_cast<char *>(dst), n))
+                {
+                    break;
+                }
+            }
+            else if (op == DELTA_OP_COPY)
+            {
+                std::memcpy(dst, (_base.data() + offset), n);
+                offset += n;
+            }
+            else
+            {
+                std::memset(dst, byte, n);
+            }
+            hash = hash_bytes(dst, n, hash);
+            pos += n;
+            _publish(pos);
+        }
+        if (pos < end)
+        {
+            break;
+        }
+    }
+
+    // If the delta could not be applied, zero the rest of the target so it
+    // fails the FPGA CRC check if it is being transferred
+    if (!ok)
+    {
+        std::memset((_target + pos), 0, (_target_size - pos));
+        _failed.store(true, std::memory_order_release);
+    }
+    _publish(_target_size);
+    _file.close();
+    _base.clear();
+    _base.shrink_to_fit();
+}
+
+//----------------------------------------------------------------------------
+// _publish
+// Publishes the number of bytes built, and wakes the transfer waiting for
+// them.
+//----------------------------------------------------------------------------
+void DeltaApplier::_publish(uint num_ready)
+{
+    {
+        std::lock_guard<std::mutex> lock(_ready_mutex);
+        _num_ready.store(num_ready, std::memory_order_release);
+    }
+    _ready.notify_all();
+}
+
+//----------------------------------------------------------------------------
+// make_delta
+// Copies blocks of the target found in the base, extended as far as they
+// match, encodes runs of one byte, and adds the rest as literals. The base
+// is indexed at block boundaries and the target searched at every offset.
+//----------------------------------------------------------------------------
+void make_delta(const std::vector<uint8_t> &base, const std::string &base_filename, const std::vector<uint8_t> &target,
+                std::vector<uint8_t> &delta)
+{
+    std::unordered_map<uint64_t, uint32_t> index;
+    DeltaHeader header = {};
+
+    // Write the header
+    header.magic = DELTA_MAGIC;
+    header.version = DELTA_VERSION;
+    header.base_hash = hash_bytes(base.data(), base.size());
+    header.target_hash = hash_bytes(target.data(), target.size());
+    header.base_size = base.size();
+    header.target_size = target.size();
+    std::strncpy(header.base_filename, base_filename.c_str(), (sizeof(header.base_filename) - 1));
+    header.checksum = _header_checksum(header);
+    delta.assign(reinterpret_cast<const uint8_t *>(&header), (reinterpret_cast<const uint8_t *>(&header) + sizeof(header)));
+
+    // Index the blocks of the base, keeping the first of any duplicates
+    index.reserve(base.size() / DELTA_BLOCK_SIZE);
+    for (uint i=0; (i + DELTA_BLOCK_SIZE)<=base.size(); i+=DELTA_BLOCK_SIZE)
+    {
+        index.emplace(hash_bytes((base.data() + i), DELTA_BLOCK_SIZE), i);
+    }
+
+    // Encode the target
+    uint literal = 0;
+    uint pos = 0;
+    while ((pos + DELTA_BLOCK_SIZE) <= target.size())
+    {
+        // Copy a matching block of the base, extended both ways
+        auto match = index.find(hash_bytes((target.data() + pos), DELTA_BLOCK_SIZE));
+        if ((match != index.end()) && (std::memcmp((target.data() + pos), (base.data() + match->second), DELTA_BLOCK_SIZE) == 0))
+        {
+            uint offset = match->second;
+            while ((pos > literal) && (offset > 0) && (target[pos - 1] == base[offset - 1]))
+            {
+                pos--;
+                offset--;
+            }
+            uint len = 0;
+            while (((pos + len) < target.size()) && ((offset + len) < base.size()) && (target[pos + len] == base[offset + len]))
+            {
+                len++;
+            }
+            _emit_add(delta, (target.data() + literal), (pos - literal));
+            _emit_op(delta, DELTA_OP_COPY, len);
+            _emit_u32(delta, offset);
+            pos += len;
+            literal = pos;
+            continue;
+        }
+
+        // Encode a run of one byte, e.g. unused blocks
+        uint run = _run_length(target, pos);
+        if (run >= DELTA_MIN_RUN)
+        {
+            _emit_add(delta, (target.data() + literal), (pos - literal));
+            _emit_op(delta, DELTA_OP_RUN, run);
+            delta.push_back(target[pos]);
+            pos += run;
+            literal = pos;
+            continue;
+        }
+        pos++;
+    }
+    _emit_add(delta, (target.data() + literal), (target.size() - literal));
+    delta.push_back(DELTA_OP_END);
+}
+
+//----------------------------------------------------------------------------
+// _header_checksum
+//----------------------------------------------------------------------------
+uint64_t _header_checksum(DeltaHeader header)
+{
+    header.checksum = 0;
+    return hash_bytes(&header, sizeof(header));
+}
+
+//----------------------------------------------------------------------------
+// _emit_op
+//----------------------------------------------------------------------------
+void _emit_op(std::vector<uint8_t> &delta, DeltaOp op, uint32_t len)
+{
+    delta.push_back(op);
+    _emit_u32(delta, len);
+}
+
+//----------------------------------------------------------------------------
+// _emit_add
+//----------------------------------------------------------------------------
+void _emit_add(std::vector<uint8_t> &delta, const uint8_t *data, uint32_t len)
+{
+    if (len)
+    {
+        _emit_op(delta, DELTA_OP_ADD, len);
+        delta.insert(delta.end(), data, (data + len));
+    }
+}
+
+//----------------------------------------------------------------------------
+// _emit_u32
+// Little-endian, as the delta is applied on the Pi.
+//----------------------------------------------------------------------------
+void _emit_u32(std::vector<uint8_t> &delta, uint32_t value)
+{
+    const uint8_t *bytes = reinterpret_cast<const uint8_t *>(&value);
+    delta.insert(delta.end(), bytes, (bytes + sizeof(value)));
+}
+
+//----------------------------------------------------------------------------
+// _run_length
+//----------------------------------------------------------------------------
+uint _run_length(const std::vector<uint8_t> &data, uint pos)
+{
+    uint end = pos + 1;
+    while ((end < data.size()) && (data[end] == data[pos]))
+    {
+        end++;
+    }
+    return end - pos;
+}
@@ -0,0 +1,94 @@
+/**
+ *-----------------------------------------------------------------------------
+ * Copyright (c) 2021-2024 Melbourne Instruments, Australia
+ *-----------------------------------------------------------------------------
+ * @file  delta.h
+ * @brief Binary-delta FPGA images, applied while the image is transferred.
+ *
+ * An image can be stored as a delta against an image already on the
+ * device, e.g. synthia_fpga_1.b.rbf.delta against synthia_fpga_1.a.rbf, so
+ * an update only ships and writes the changed bytes. A delta is a
+ * checksummed header naming the base image and the hashes of the base and
+ * target, followed by VCDIFF-style ADD, COPY and RUN instructions. It is
+ * applied by a thread that reads the instructions through a small buffer
+ * and publishes how much of the target has been built, so the transfer can
+ * start as soon as the first chunk is ready. The result is verified
+ * against the target hash once it is complete.
+ *-----------------------------------------------------------------------------
+ */
+#ifndef _DELTA_H
+#define _DELTA_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <fstream>
+#include <sys/types.h>
+
+// Constants
+constexpr char DELTA_SUFFIX[]        = ".delta";
+constexpr uint32_t DELTA_MAGIC       = 0x4C445046;    // "FPDL"
+constexpr uint32_t DELTA_VERSION     = 1;
+constexpr uint DELTA_BASE_NAME_SIZE  = 64;
+constexpr uint DELTA_WAIT_POLL_MS    = 1;     // Exit flag poll while waiting for the target
+
+// Delta instructions, each an opcode byte and a 32-bit length, followed by
+// the literal bytes (ADD), the base offset (COPY) or the byte (RUN)
+enum DeltaOp : uint8_t
+{
+    DELTA_OP_END = 0,
+    DELTA_OP_ADD,
+    DELTA_OP_COPY,
+    DELTA_OP_RUN
+};
+
+// The header of a delta, followed by the instructions
+struct DeltaHeader
+{
+    uint32_t magic;
+    uint32_t version;
+    uint64_t base_hash;
+    uint64_t target_hash;
+    uint32_t base_size;
+    uint32_t target_size;
+    char base_filename[DELTA_BASE_NAME_SIZE];
+    uint64_t checksum;
+};
+
+// Delta applier
+class DeltaApplier
+{
+public:
+    DeltaApplier() = default;
+    ~DeltaApplier() { finish(); }
+
+    bool start(const std::string &dir, const std::string &filename, std::vector<uint8_t> &target, uint64_t &target_hash,
+               const std::vector<uint8_t> *resident_base=nullptr, uint64_t resident_hash=0);
+    bool wait_for(uint num_bytes, const std::atomic<bool> &exit_flag) const;
+    bool finish();
+
+private:
+    std::ifstream _file;
+    std::vector<uint8_t> _base;
+    uint8_t *_target = nullptr;
+    uint _target_size = 0;
+    uint64_t _target_hash = 0;
+    std::atomic<uint> _num_ready{0};
+    std::atomic<bool> _failed{false};
+    mutable std::mutex _ready_mutex;
+    mutable std::condition_variable _ready;
+    std::thread _thread;
+
+    void _apply();
+    void _publish(uint num_ready);
+};
+
+// Functions
+void make_delta(const std::vector<uint8_t> &base, const std::string &base_filename, const std::vector<uint8_t> &target,
+                std::vector<uint8_t> &delta);
+
+#endif  // _DELTA_H
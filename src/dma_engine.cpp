@@ -0,0 +1,343 @@
+/**
+ *-----------------------------------------------------------------------------
+ * Copyright (c) 2021-2024 Melbourne Instruments, Australia
+ *-----------------------------------------------------------------------------
+ * @file  dma_engine.cpp
+ * @brief DMA passive serial waveform chain for the BCM2711, and its model.
+ *-----------------------------------------------------------------------------
+ */
+#include <cstring>
+#include <cstdlib>
+#include "dma_engine.h"
+#include "protocol.h"
+
+// Constants
+constexpr uint32_t DMA_MODEL_BUS_BASE       = 0xC0000000;
+constexpr uint DMA_POOL_DATA0               = 0;
+constexpr uint DMA_POOL_DCLK                = 1;
+constexpr uint DMA_POOL_PACE                = (NUM_CONSECUTIVE_GPIO_WRITES + 2);
+constexpr uint32_t DMA_GPIO_TI              = (DMA_TI_SRC_INC | DMA_TI_WAIT_RESP | DMA_TI_NO_WIDE_BURSTS);
+constexpr uint32_t DMA_PACE_TI              = (DMA_TI_PERMAP(DMA_PERMAP_PWM) | DMA_TI_DEST_DREQ |
+                                               DMA_TI_WAIT_RESP | DMA_TI_NO_WIDE_BURSTS);
+constexpr uint32_t DMA_MARKER_TI            = DMA_TI_WAIT_RESP;
+
+// Local functions
+bool _run_dma_ring(DmaChannel &channel, const DmaMemory &mem, const uint8_t *data, uint size, const std::atomic<bool> &exit_flag);
+void _init_dma_pool(const DmaMemory &mem);
+void _dma_memory_barrier();
+
+//----------------------------------------------------------------------------
+// DmaChainBuilder
+//----------------------------------------------------------------------------
+DmaChainBuilder::DmaChainBuilder(const DmaMemory &mem, const uint8_t *data, uint size) :
+    _mem(mem),
+    _data(data),
+    _num_bits(size * 8)
+{
+}
+
+//----------------------------------------------------------------------------
+// fill_block
+// Writes the next control blocks of the waveform into the specified ring
+// block. The first control block is a marker that records the block
+// sequence number in the pool status word when the DMA reaches it. The
+// block is always left terminated, the caller links it to the next block.
+//----------------------------------------------------------------------------
+uint DmaChainBuilder::fill_block(uint block, uint32_t seq)
+{
+    DmaPool *pool = _mem.pool();
+    DmaControlBlock *cb = _mem.block(block);
+    uint num_cbs = 0;
+    Op op;
+
+    // Add the block marker
+    pool->block_seq[block] = seq + 1;
+    cb[num_cbs++] = { DMA_MARKER_TI, _mem.to_bus(&pool->block_seq[block]), _mem.to_bus(&pool->status),
+                      sizeof(uint32_t), 0, 0, {0, 0} };
+
+    // Add the waveform control blocks until the block is full
+    while ((num_cbs < DMA_BLOCK_NUM_CBS) && _next_op(op))
+    {
+        DmaControlBlock &next = cb[num_cbs];
+        if (op.type == OpType::PACE)
+        {
+            next = { DMA_PACE_TI, _mem.to_bus(&pool->words[DMA_POOL_PACE]), PHYSICAL_PWM_FIF1_BUS,
+                     sizeof(uint32_t), 0, 0, {0, 0} };
+        }
+        else
+        {
+            uint32_t reg = PHYSICAL_GPIO_BUS + ((op.type == OpType::SET) ? gpio_set_offset(op.bank) : gpio_clr_offset(op.bank));
+            next = { DMA_GPIO_TI, _mem.to_bus(&pool->words[op.word]), reg,
+                     static_cast<uint32_t>(op.num_words * sizeof(uint32_t)), 0, 0, {0, 0} };
+        }
+        cb[num_cbs - 1].nextconbk = _mem.to_bus(&next);
+        num_cbs++;
+    }
+    return num_cbs;
+}
+
+//----------------------------------------------------------------------------
+// _next_op
+//----------------------------------------------------------------------------
+bool DmaChainBuilder::_next_op(Op &op)
+{
+    // Generate the ops for the next bit if needed
+    if (_pending_pos == _num_pending)
+    {
+        _num_pending = 0;
+        _pending_pos = 0;
+        _queue_next_ops();
+        if (_num_pending == 0)
+        {
+            return false;
+        }
+    }
+    op = _pending[_pending_pos++];
+    return true;
+}
+
+//----------------------------------------------------------------------------
+// _queue_next_ops
+// Queues the ops for the next data bit or trailing DCLK. If DATA0 and DCLK
+// are in the same bank, the DATA0 write of a zero bit is merged into the
+// preceding DCLK falling edge run, which gives the exact register write
+// sequence of the CPU kernel with fewer control blocks.
+//----------------------------------------------------------------------------
+void DmaChainBuilder::_queue_next_ops()
+{
+    if (_bit_pos < _num_bits)
+    {
+        bool bit = (_data[_bit_pos / 8] >> protocol_bit_shift(_bit_pos % 8)) & 0x01;
+        if (_bit_pos == 0)
+        {
+            _queue((bit ? OpType::SET : OpType::CLR), DATA0_GPIO_BANK, DMA_POOL_DATA0);
+        }
+        else if (bit || (DATA0_GPIO_BANK != DCLK_GPIO_BANK))
+        {
+            _queue(OpType::CLR, DCLK_GPIO_BANK, DMA_POOL_DCLK, NUM_CONSECUTIVE_GPIO_WRITES);
+            _queue((bit ? OpType::SET : OpType::CLR), DATA0_GPIO_BANK, DMA_POOL_DATA0);
+        }
+        else
+        {
+            _queue(OpType::CLR, DCLK_GPIO_BANK, DMA_POOL_DCLK, NUM_CONSECUTIVE_GPIO_WRITES + 1);
+        }
+        _queue(OpType::PACE);
+        _queue(OpType::SET, DCLK_GPIO_BANK, DMA_POOL_DCLK, NUM_CONSECUTIVE_GPIO_WRITES);
+        _queue(OpType::PACE);
+        _bit_pos++;
+    }
+    else if (_trailing_pos <= ConfigProtocol::NUM_TRAILING_DCLKS)
+    {
+        // Falling edge of the previous DCLK, followed by the next trailing DCLK
+        if ((_num_bits > 0) || (_trailing_pos > 0))
+        {
+            _queue(OpType::CLR, DCLK_GPIO_BANK, DMA_POOL_DCLK, NUM_CONSECUTIVE_GPIO_WRITES);
+            _queue(OpType::PACE);
+        }
+        if (_trailing_pos < ConfigProtocol::NUM_TRAILING_DCLKS)
+        {
+            _queue(OpType::SET, DCLK_GPIO_BANK, DMA_POOL_DCLK, NUM_CONSECUTIVE_GPIO_WRITES);
+            _queue(OpType::PACE);
+        }
+        _trailing_pos++;
+    }
+    else
+    {
+        _done = true;
+    }
+}
+
+//----------------------------------------------------------------------------
+// _queue
+//----------------------------------------------------------------------------
+void DmaChainBuilder::_queue(OpType type, uint bank, uint word, uint num_words)
+{
+    _pending[_num_pending++] = { type, bank, word, num_words };
+}
+
+//----------------------------------------------------------------------------
+// DmaModelChannel::start
+// Executes the chain starting at the passed control block until it ends.
+// GPIO register writes are counted and optionally recorded, writes to the
+// PWM FIFO are counted as pacing, and any other access must be to the DMA
+// memory.
+//----------------------------------------------------------------------------
+void DmaModelChannel::start(uint32_t cb_addr)
+{
+    while (cb_addr && !_error)
+    {
+        // Get the control block
+        auto cb = static_cast<const DmaControlBlock *>(_mem.to_virt(cb_addr, sizeof(DmaControlBlock)));
+        if (!cb || (cb_addr % sizeof(DmaControlBlock)))
+        {
+            _error = true;
+            break;
+        }
+
+        // Perform each word of the transfer
+        for (uint i=0; i<(cb->txfr_len / sizeof(uint32_t)); i++)
+        {
+            uint32_t src = cb->source_ad + ((cb->ti & DMA_TI_SRC_INC) ? (i * sizeof(uint32_t)) : 0);
+            uint32_t dest = cb->dest_ad + ((cb->ti & DMA_TI_DEST_INC) ? (i * sizeof(uint32_t)) : 0);
+            auto src_word = static_cast<const uint32_t *>(_mem.to_virt(src, sizeof(uint32_t)));
+            if (!src_word)
+            {
+                _error = true;
+                break;
+            }
+            if ((dest >= PHYSICAL_GPIO_BUS) && (dest < (PHYSICAL_GPIO_BUS + PAGE_SIZE)))
+            {
+                if (_record_writes)
+                {
+                    _writes.push_back({(dest - PHYSICAL_GPIO_BUS), *src_word});
+                }
+                _num_writes++;
+            }
+            else if (dest == PHYSICAL_PWM_FIF1_BUS)
+            {
+                // Pacing writes must be gated by the PWM DREQ
+                if (!(cb->ti & DMA_TI_DEST_DREQ) ||
+                    ((cb->ti & DMA_TI_PERMAP_MASK) != DMA_TI_PERMAP(DMA_PERMAP_PWM)))
+                {
+                    _error = true;
+                    break;
+                }
+                _num_paces++;
+            }
+            else
+            {
+                auto dest_word = static_cast<uint32_t *>(_mem.to_virt(dest, sizeof(uint32_t)));
+                if (!dest_word)
+                {
+                    _error = true;
+                    break;
+                }
+                *dest_word = *src_word;
+            }
+        }
+        cb_addr = cb->nextconbk;
+        _num_cbs++;
+    }
+}
+
+//----------------------------------------------------------------------------
+// DmaModel
+//----------------------------------------------------------------------------
+DmaModel::DmaModel(bool record_writes) :
+    _buffer(static_cast<uint8_t *>(std::aligned_alloc(PAGE_SIZE, DMA_MEMORY_SIZE))),
+    _mem{_buffer, DMA_MODEL_BUS_BASE, (_buffer ? DMA_MEMORY_SIZE : 0)},
+    _channel(_mem, record_writes)
+{
+}
+
+//----------------------------------------------------------------------------
+// ~DmaModel
+//----------------------------------------------------------------------------
+DmaModel::~DmaModel()
+{
+    std::free(_buffer);
+}
+
+//----------------------------------------------------------------------------
+// DmaModel::transfer
+//----------------------------------------------------------------------------
+bool DmaModel::transfer(const uint8_t *data, uint size, const std::atomic<bool> &exit_flag)
+{
+    if (!_buffer)
+    {
+        return false;
+    }
+    return _run_dma_ring(_channel, _mem, data, size, exit_flag) && !_channel.error();
+}
+
+//----------------------------------------------------------------------------
+// _run_dma_ring
+// Streams the waveform for the image through the ring of blocks. Each block
+// is terminated when filled, and then linked from its predecessor. If the
+// DMA reaches a terminated block before it is linked it simply stops, and
+// is restarted at the next block; DCLK just pauses, which passive serial
+// allows.
+//----------------------------------------------------------------------------
+bool _run_dma_ring(DmaChannel &channel, const DmaMemory &mem, const uint8_t *data, uint size, const std::atomic<bool> &exit_flag)
+{
+    DmaChainBuilder builder(mem, data, size);
+    volatile uint32_t *status = &mem.pool()->status;
+    uint last_cb[DMA_NUM_BLOCKS] = {};
+    uint32_t filled = 0;
+
+    _init_dma_pool(mem);
+    while (true)
+    {
+        if (exit_flag)
+        {
+            channel.abort();
+            return false;
+        }
+
+        // Blocks before the one the DMA is running are complete, and if the DMA
+        // has stopped so is that one
+        bool active = channel.active();
+        uint32_t started = *status;
+        uint32_t complete = active ? (started ? (started - 1) : 0) : started;
+
+        // Refill any free blocks and link them into the chain
+        while (!builder.finished() && ((filled < DMA_NUM_BLOCKS) || ((filled - DMA_NUM_BLOCKS) < complete)))
+        {
+            uint block = filled % DMA_NUM_BLOCKS;
+            last_cb[block] = builder.fill_block(block, filled) - 1;
+            _dma_memory_barrier();
+            if (filled > 0)
+            {
+                uint prev = (filled - 1) % DMA_NUM_BLOCKS;
+                mem.block(prev)[last_cb[prev]].nextconbk = mem.to_bus(mem.block(block));
+            }
+            filled++;
+        }
+
+        // Restart the DMA if it has stopped
+        if (!active)
+        {
+            if (started == filled)
+            {
+                if (builder.finished())
+                {
+                    return true;
+                }
+                continue;
+            }
+            _dma_memory_barrier();
+            channel.start(mem.to_bus(mem.block(started % DMA_NUM_BLOCKS)));
+            continue;
+        }
+        channel.wait();
+    }
+}
+
+//----------------------------------------------------------------------------
+// _init_dma_pool
+//----------------------------------------------------------------------------
+void _init_dma_pool(const DmaMemory &mem)
+{
+    DmaPool *pool = mem.pool();
+
+    std::memset(pool, 0, sizeof(DmaPool));
+    pool->words[DMA_POOL_DATA0] = DATA0_GPIO_MASK;
+    for (uint i=0; i<NUM_CONSECUTIVE_GPIO_WRITES; i++)
+    {
+        pool->words[DMA_POOL_DCLK + i] = DCLK_GPIO_MASK;
+    }
+    pool->words[DMA_POOL_DCLK + NUM_CONSECUTIVE_GPIO_WRITES] = DATA0_GPIO_MASK;
+    pool->words[DMA_POOL_PACE] = 0;
+}
+
+//----------------------------------------------------------------------------
+// _dma_memory_barrier
+//----------------------------------------------------------------------------
+void _dma_memory_barrier()
+{
+#if defined(__aarch64__)
+    asm volatile("dsb sy" ::: "memory");
+#else
+    __sync_synchronize();
+#endif
+}
@@ -0,0 +1,185 @@
+/**
+ *-----------------------------------------------------------------------------
+ * Copyright (c) 2021-2024 Melbourne Instruments, Australia
+ *-----------------------------------------------------------------------------
+ * @file  dma_engine.h
+ * @brief DMA passive serial waveform chain for the BCM2711, and its model.
+ *
+ * The image is turned into a chain of DMA control blocks that write
+ * precomputed GPSET0/GPCLR0 words, with pacing control blocks that write to
+ * the PWM FIFO and are therefore throttled by the PWM DREQ. The chain is
+ * generated into a small ring of blocks which is refilled as it runs, so
+ * memory use does not depend on the image size.
+ *
+ * Only the chain builder and a software model of the DMA channel are built,
+ * and --verify checks the waveform of the chain against the CPU kernel.
+ * There is no hardware transfer kernel: one control block per register
+ * write, each paced by a DREQ, is far slower than the CPU kernel, and a
+ * hardware engine would have to get its channel from the firmware and leave
+ * the PWM (used for audio) alone.
+ *-----------------------------------------------------------------------------
+ */
+#ifndef _DMA_ENGINE_H
+#define _DMA_ENGINE_H
+
+#include <cstdint>
+#include <vector>
+#include <atomic>
+#include "gpio.h"
+
+// DMA constants
+constexpr uint DMA_NUM_BLOCKS          = 4;
+constexpr uint DMA_BLOCK_NUM_CBS       = 2048;
+constexpr uint PWM_REGISTER_BASE       = 0x20C000;
+constexpr uint PWM_FIF1_OFFSET         = 0x18;
+constexpr uint PHYSICAL_PWM_FIF1_BUS   = (BCM2711_PERIPHERAL_BUS_BASE + PWM_REGISTER_BASE + PWM_FIF1_OFFSET);
+constexpr uint DMA_PERMAP_PWM          = 5;
+
+// DMA transfer information bits
+constexpr uint32_t DMA_TI_WAIT_RESP      = (1 << 3);
+constexpr uint32_t DMA_TI_DEST_INC       = (1 << 4);
+constexpr uint32_t DMA_TI_DEST_DREQ      = (1 << 6);
+constexpr uint32_t DMA_TI_SRC_INC        = (1 << 8);
+constexpr uint32_t DMA_TI_NO_WIDE_BURSTS = (1 << 26);
+constexpr uint32_t DMA_TI_PERMAP(uint32_t p) { return (p << 16); }
+constexpr uint32_t DMA_TI_PERMAP_MASK    = (0x1F << 16);
+
+// BCM2711 (legacy channel) DMA control block, must be 32-byte aligned
+struct DmaControlBlock
+{
+    uint32_t ti;
+    uint32_t source_ad;
+    uint32_t dest_ad;
+    uint32_t txfr_len;
+    uint32_t stride;
+    uint32_t nextconbk;
+    uint32_t reserved[2];
+};
+static_assert(sizeof(DmaControlBlock) == 32, "DMA control blocks must be 32 bytes");
+
+// Source words and status shared by all blocks of a chain
+struct DmaPool
+{
+    uint32_t words[NUM_CONSECUTIVE_GPIO_WRITES + 3];
+    uint32_t block_seq[DMA_NUM_BLOCKS];
+    uint32_t status;
+};
+constexpr uint DMA_POOL_SIZE   = 256;
+constexpr uint DMA_MEMORY_SIZE = (DMA_POOL_SIZE + (DMA_NUM_BLOCKS * DMA_BLOCK_NUM_CBS * sizeof(DmaControlBlock)) +
+                                  PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+static_assert(sizeof(DmaPool) <= DMA_POOL_SIZE, "DMA pool does not fit");
+
+// A region of memory visible to both the CPU and the DMA engine
+struct DmaMemory
+{
+    uint8_t *virt;
+    uint32_t bus;
+    uint size;
+
+    uint32_t to_bus(const void *ptr) const
+    {
+        return bus + static_cast<uint32_t>(reinterpret_cast<const uint8_t *>(ptr) - virt);
+    }
+    void *to_virt(uint32_t addr, uint len) const
+    {
+        return ((addr >= bus) && ((addr - bus) + len <= size)) ? (virt + (addr - bus)) : nullptr;
+    }
+    DmaPool *pool() const { return reinterpret_cast<DmaPool *>(virt); }
+    DmaControlBlock *block(uint index) const
+    {
+        return reinterpret_cast<DmaControlBlock *>(virt + DMA_POOL_SIZE) + (index * DMA_BLOCK_NUM_CBS);
+    }
+};
+
+// Generates the control blocks for an image, one ring block at a time
+class DmaChainBuilder
+{
+public:
+    DmaChainBuilder(const DmaMemory &mem, const uint8_t *data, uint size);
+
+    uint fill_block(uint block, uint32_t seq);
+    bool finished() const { return _num_pending == 0 && _done; }
+
+private:
+    enum class OpType { SET, CLR, PACE };
+    struct Op
+    {
+        OpType type;
+        uint bank;
+        uint word;
+        uint num_words;
+    };
+
+    const DmaMemory &_mem;
+    const uint8_t *_data;
+    uint _num_bits;
+    uint _bit_pos = 0;
+    uint _trailing_pos = 0;
+    bool _done = false;
+    Op _pending[6];
+    uint _num_pending = 0;
+    uint _pending_pos = 0;
+
+    bool _next_op(Op &op);
+    void _queue_next_ops();
+    void _queue(OpType type, uint bank=0, uint word=0, uint num_words=1);
+};
+
+// DMA channel abstraction, so the ring can drive the hardware or the model
+class DmaChannel
+{
+public:
+    virtual ~DmaChannel() = default;
+    virtual bool active() = 0;
+    virtual void start(uint32_t cb_addr) = 0;
+    virtual void abort() = 0;
+    virtual void wait() = 0;
+};
+
+// Software model of a BCM2711 DMA channel
+class DmaModelChannel : public DmaChannel
+{
+public:
+    DmaModelChannel(const DmaMemory &mem, bool record_writes) : _mem(mem), _record_writes(record_writes) {}
+
+    bool active() override { return false; }
+    void start(uint32_t cb_addr) override;
+    void abort() override {}
+    void wait() override {}
+
+    const std::vector<GpioRegWrite> &writes() const { return _writes; }
+    uint num_writes() const { return _num_writes; }
+    uint num_paces() const { return _num_paces; }
+    uint num_cbs() const { return _num_cbs; }
+    bool error() const { return _error; }
+
+private:
+    const DmaMemory &_mem;
+    bool _record_writes;
+    std::vector<GpioRegWrite> _writes;
+    uint _num_writes = 0;
+    uint _num_paces = 0;
+    uint _num_cbs = 0;
+    bool _error = false;
+};
+
+// Runs the DMA waveform for an image on a software model of the DMA engine
+class DmaModel
+{
+public:
+    DmaModel(bool record_writes=true);
+    ~DmaModel();
+
+    bool transfer(const uint8_t *data, uint size, const std::atomic<bool> &exit_flag);
+    const std::vector<GpioRegWrite> &writes() const { return _channel.writes(); }
+    uint num_writes() const { return _channel.num_writes(); }
+    uint num_paces() const { return _channel.num_paces(); }
+    uint num_cbs() const { return _channel.num_cbs(); }
+
+private:
+    uint8_t *_buffer;
+    DmaMemory _mem;
+    DmaModelChannel _channel;
+};
+
+#endif  // _DMA_ENGINE_H
@@ -0,0 +1,49 @@
+/**
+ *-----------------------------------------------------------------------------
+ * Copyright (c) 2021-2024 Melbourne Instruments, Australia
+ *-----------------------------------------------------------------------------
+ * @file  gpio.cpp
+ * @brief BCM2711 register mapping.
+ *-----------------------------------------------------------------------------
+ */
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include "gpio.h"
+
+//----------------------------------------------------------------------------
+// mmap_bcm_register_base
+//----------------------------------------------------------------------------
+void *mmap_bcm_register_base(off_t register_base, size_t size)
+{
+    return mmap_physical_memory((BCM2711_PI4_PERIPHERAL_BASE + register_base), size);
+}
+
+//----------------------------------------------------------------------------
+// mmap_physical_memory
+//----------------------------------------------------------------------------
+void *mmap_physical_memory(off_t phys_addr, size_t size)
+{
+    void *addr = nullptr;
+    int mem_fd;
+
+    // Open the memory device
+    mem_fd = ::open(MEM_DEV_NAME, O_RDWR|O_SYNC);
+    if (mem_fd < 0)
+    {
+        // Error opening the device
+        return nullptr;
+    }
+
+    // Map the physical address range
+    addr = ::mmap(NULL, size, (PROT_READ|PROT_WRITE), MAP_SHARED, mem_fd, phys_addr);
+    ::close(mem_fd);
+
+    // Was the map successful?
+    if (addr == MAP_FAILED)
+    {
+        // Error mapping the physical address range
+        return nullptr;
+    }
+    return addr;
+}
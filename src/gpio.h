@@ -0,0 +1,189 @@
+/**
+ *-----------------------------------------------------------------------------
+ * Copyright (c) 2021-2024 Melbourne Instruments, Australia
+ *-----------------------------------------------------------------------------
+ * @file  gpio.h
+ * @brief BCM2711 GPIO register definitions and register access backends.
+ *
+ * The GPIO block has two banks, GPIO 0-31 and GPIO 32-57, each with its own
+ * set, clear and level registers. Pins are written through the register of
+ * their bank, with the bank and mask of each pin known at compile time, so
+ * a board with all its pins in bank 0 costs exactly what it did before.
+ *-----------------------------------------------------------------------------
+ */
+#ifndef _GPIO_H
+#define _GPIO_H
+
+#include <cstdint>
+#include <vector>
+#include <initializer_list>
+#include <sys/types.h>
+#include "mmio.h"
+
+// Constants
+constexpr uint GPIO_NUM_BANKS              = 2;
+constexpr uint GPIO_BANK_SIZE              = 32;
+constexpr uint NUM_CONSECUTIVE_GPIO_WRITES = 5;
+constexpr char MEM_DEV_NAME[]              = "/dev/mem";
+#if MELBINST_PI_HAT == 0
+constexpr uint FPGA2_NCE_GPIO_PIN          = 2;
+#endif
+constexpr uint DCLK_GPIO_PIN               = 3;
+constexpr uint DATA0_GPIO_PIN              = 16;
+constexpr uint NCONFIG_GPIO_PIN            = 17;
+constexpr uint BOARD_REV_GPIO_PIN_1        = 20;
+constexpr uint BOARD_REV_GPIO_PIN_2        = 21;
+constexpr uint FPGA1_CONF_DONE_GPIO_PIN    = 22;
+constexpr uint FPGA1_NSTATUS_GPIO_PIN      = 23;
+#if MELBINST_PI_HAT == 0
+constexpr uint FPGA2_CONF_DONE_GPIO_PIN    = 24;
+constexpr uint FPGA2_NSTATUS_GPIO_PIN      = 25;
+#endif
+constexpr uint PAGE_SIZE                   = 4096;
+constexpr uint BCM2711_PI4_PERIPHERAL_BASE = 0xFE000000;
+constexpr uint BCM2711_PERIPHERAL_BUS_BASE = 0x7E000000;
+constexpr uint GPIO_REGISTER_BASE          = 0x200000;
+constexpr uint GPIO_SET_OFFSET             = 0x1C;    // GPSET0, followed by GPSET1
+constexpr uint GPIO_CLR_OFFSET             = 0x28;    // GPCLR0, followed by GPCLR1
+constexpr uint GPIO_RD_OFFSET              = 0x34;    // GPLEV0, followed by GPLEV1
+constexpr uint GPIO_PULL_BASE_OFFSET       = 0xE4;
+constexpr uint PHYSICAL_GPIO_BUS           = (BCM2711_PERIPHERAL_BUS_BASE + GPIO_REGISTER_BASE);
+
+//----------------------------------------------------------------------------
+// gpio_bank
+//----------------------------------------------------------------------------
+constexpr uint gpio_bank(uint pin)
+{
+    return pin / GPIO_BANK_SIZE;
+}
+
+//----------------------------------------------------------------------------
+// gpio_mask
+// Returns the mask of the pin within its bank.
+//----------------------------------------------------------------------------
+constexpr uint32_t gpio_mask(uint pin)
+{
+    return 1u << (pin % GPIO_BANK_SIZE);
+}
+
+//----------------------------------------------------------------------------
+// gpio_set_offset
+//----------------------------------------------------------------------------
+constexpr uint gpio_set_offset(uint bank)
+{
+    return GPIO_SET_OFFSET + (bank * sizeof(uint32_t));
+}
+
+//----------------------------------------------------------------------------
+// gpio_clr_offset
+//----------------------------------------------------------------------------
+constexpr uint gpio_clr_offset(uint bank)
+{
+    return GPIO_CLR_OFFSET + (bank * sizeof(uint32_t));
+}
+
+// Bank and mask of the data pins
+constexpr uint DCLK_GPIO_BANK              = gpio_bank(DCLK_GPIO_PIN);
+constexpr uint32_t DCLK_GPIO_MASK          = gpio_mask(DCLK_GPIO_PIN);
+constexpr uint DATA0_GPIO_BANK             = gpio_bank(DATA0_GPIO_PIN);
+constexpr uint32_t DATA0_GPIO_MASK         = gpio_mask(DATA0_GPIO_PIN);
+
+// Per bank masks of a set of pins, so that the pins of a bank can be
+// written with one store
+struct GpioPinMasks
+{
+    uint32_t masks[GPIO_NUM_BANKS] = {};
+
+    constexpr GpioPinMasks(std::initializer_list<uint> pins)
+    {
+        for (uint pin : pins)
+        {
+            masks[gpio_bank(pin)] |= gpio_mask(pin);
+        }
+    }
+};
+
+// A single write to a GPIO register, as seen by the GPIO block
+struct GpioRegWrite
+{
+    uint32_t offset;
+    uint32_t value;
+
+    bool operator==(const GpioRegWrite &other) const
+    {
+        return (offset == other.offset) && (value == other.value);
+    }
+};
+
+// MMIO backend - stores directly to the mapped GPSETn/GPCLRn registers,
+// where the set and clear registers are those of bank 0, ordered by the
+// ordering policy
+template <class Ordering>
+struct OrderedMmioGpio
+{
+    using Policy = Ordering;
+
+    volatile uint32_t *set_reg;
+    volatile uint32_t *clr_reg;
+
+    inline void set(uint bank, uint32_t mask) { mmio_store<Ordering>(&set_reg[bank], mask); }
+    inline void clr(uint bank, uint32_t mask) { mmio_store<Ordering>(&clr_reg[bank], mask); }
+    inline void edge() { Ordering::before_edge(); }
+    inline void set_pins(const GpioPinMasks &pins)
+    {
+        for (uint i=0; i<GPIO_NUM_BANKS; i++)
+        {
+            if (pins.masks[i])
+            {
+                mmio_store<Ordering>(&set_reg[i], pins.masks[i]);
+            }
+        }
+    }
+    inline void clr_pins(const GpioPinMasks &pins)
+    {
+        for (uint i=0; i<GPIO_NUM_BANKS; i++)
+        {
+            if (pins.masks[i])
+            {
+                mmio_store<Ordering>(&clr_reg[i], pins.masks[i]);
+            }
+        }
+    }
+};
+
+// MMIO backend with the ordering of this build
+using MmioGpio = OrderedMmioGpio<GpioOrdering>;
+
+// Trace backend - records each register write instead of performing it, so
+// that a kernel can be run and checked without any hardware, along with the
+// write each edge barrier point comes before
+struct TraceGpio
+{
+    using Policy = GpioOrdering;
+
+    std::vector<GpioRegWrite> writes;
+
+    std::vector<uint> edges;
+
+    inline void set(uint bank, uint32_t mask) { writes.push_back({gpio_set_offset(bank), mask}); }
+    inline void clr(uint bank, uint32_t mask) { writes.push_back({gpio_clr_offset(bank), mask}); }
+    inline void edge() { edges.push_back(writes.size()); }
+};
+
+// Counting backend - counts the register writes a kernel performs
+struct CountingGpio
+{
+    using Policy = GpioOrdering;
+
+    uint64_t num_writes = 0;
+
+    inline void set([[maybe_unused]] uint bank, [[maybe_unused]] uint32_t mask) { num_writes++; }
+    inline void clr([[maybe_unused]] uint bank, [[maybe_unused]] uint32_t mask) { num_writes++; }
+    inline void edge() {}
+};
+
+// Functions
+void *mmap_bcm_register_base(off_t register_base, size_t size=PAGE_SIZE);
+void *mmap_physical_memory(off_t phys_addr, size_t size);
+
+#endif  // _GPIO_H
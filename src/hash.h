@@ -0,0 +1,33 @@
+/**
+ *-----------------------------------------------------------------------------
+ * Copyright (c) 2021-2024 Melbourne Instruments, Australia
+ *-----------------------------------------------------------------------------
+ * @file  hash.h
+ * @brief 64-bit FNV-1a hash, used to identify images and records.
+ *-----------------------------------------------------------------------------
+ */
+#ifndef _HASH_H
+#define _HASH_H
+
+#include <cstdint>
+#include <cstddef>
+
+// Constants
+constexpr uint64_t FNV_OFFSET_BASIS = 0xCBF29CE484222325;
+constexpr uint64_t FNV_PRIME        = 0x00000100000001B3;
+
+//----------------------------------------------------------------------------
+// hash_bytes
+// Pass the previous hash to hash data in pieces.
+//----------------------------------------------------------------------------
+inline uint64_t hash_bytes(const void *data, size_t size, uint64_t hash=FNV_OFFSET_BASIS)
+{
+    const uint8_t *bytes = static_cast<const uint8_t *>(data);
+    for (size_t i=0; i<size; i++)
+    {
+        hash = (hash ^ bytes[i]) * FNV_PRIME;
+    }
+    return hash;
+}
+
+#endif  // _HASH_H
@@ -0,0 +1,332 @@
+/**
+ *-----------------------------------------------------------------------------
+ * Copyright (c) 2021-2024 Melbourne Instruments, Australia
+ *-----------------------------------------------------------------------------
+ * @file  history.cpp
+ * @brief Persistent history of configuration runs.
+ *-----------------------------------------------------------------------------
+ */
+#include <iostream>
+#include <fstream>
+#include <iomanip>
+#include <sstream>
+#include <algorithm>
+#include <map>
+#include <set>
+#include <cmath>
+#include <ctime>
+#include <cstring>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "common.h"
+#include "hash.h"
+#include "history.h"
+
+// Constants
+constexpr size_t HISTORY_RECORDS_OFFSET = 64;
+constexpr size_t HISTORY_FILE_SIZE      = HISTORY_RECORDS_OFFSET + (HISTORY_NUM_RECORDS * sizeof(HistoryRecord));
+constexpr char BOOT_ID_PATH[]           = "/proc/sys/kernel/random/boot_id";
+constexpr uint NUM_USAGE_COUNTERS       = 4;
+const char *phase_names[NUM_HISTORY_PHASES] = { "Lock wait", "Load", "FPGA1", "FPGA2", "Total" };
+
+// Local functions
+uint64_t _record_checksum(HistoryRecord record);
+double _percentile(std::vector<double> values, double percent);
+
+//----------------------------------------------------------------------------
+// open
+// A new file, or one written by a different version, is reinitialised
+// unless opened read-only.
+//----------------------------------------------------------------------------
+bool History::open(const std::string &path, bool read_only)
+{
+    struct stat st;
+
+    // Open the file, creating it at its full size
+    close();
+    if (!read_only)
+    {
+        ::mkdir(path.substr(0, path.find_last_of('/')).c_str(), 0755);
+    }
+    _fd = ::open(path.c_str(), ((read_only ? O_RDONLY : (O_RDWR|O_CREAT))|O_CLOEXEC), 0644);
+    if ((_fd < 0) || (::fstat(_fd, &st) != 0) ||
+        (!read_only && (static_cast<size_t>(st.st_size) < HISTORY_FILE_SIZE) && (::ftruncate(_fd, HISTORY_FILE_SIZE) != 0)) ||
+        (read_only && (static_cast<size_t>(st.st_size) < HISTORY_FILE_SIZE)))
+    {
+        close();
+        return false;
+    }
+
+    // Map it
+    void *mem = ::mmap(nullptr, HISTORY_FILE_SIZE, (read_only ? PROT_READ : (PROT_READ|PROT_WRITE)), MAP_SHARED, _fd, 0);
+    if (mem == MAP_FAILED)
+    {
+        close();
+        return false;
+    }
+    _size = HISTORY_FILE_SIZE;
+    _header = static_cast<HistoryHeader *>(mem);
+    _records = reinterpret_cast<HistoryRecord *>(static_cast<uint8_t *>(mem) + HISTORY_RECORDS_OFFSET);
+
+    // Check the header
+    if ((_header->magic != HISTORY_MAGIC) || (_header->version != HISTORY_VERSION) ||
+        (_header->record_size != sizeof(HistoryRecord)) || (_header->num_records != HISTORY_NUM_RECORDS))
+    {
+        if (read_only)
+        {
+            close();
+            return false;
+        }
+        std::memset(mem, 0, _size);
+        *_header = { HISTORY_MAGIC, HISTORY_VERSION, sizeof(HistoryRecord), HISTORY_NUM_RECORDS };
+        ::msync(mem, _size, MS_SYNC);
+    }
+    return true;
+}
+
+//----------------------------------------------------------------------------
+// close
+//----------------------------------------------------------------------------
+void History::close()
+{
+    if (_header)
+    {
+        ::munmap(_header, _size);
+        _header = nullptr;
+        _records = nullptr;
+        _size = 0;
+    }
+    if (_fd >= 0)
+    {
+        ::close(_fd);
+        _fd = -1;
+    }
+}
+
+//----------------------------------------------------------------------------
+// append
+// The record goes in the slot after the newest valid record, and is synced
+// to the file before returning.
+//----------------------------------------------------------------------------
+bool History::append(HistoryRecord &record)
+{
+    if (!_records || (::flock(_fd, LOCK_EX) != 0))
+    {
+        return false;
+    }
+
+    // Find the next sequence number
+    uint64_t seq = 0;
+    for (uint i=0; i<HISTORY_NUM_RECORDS; i++)
+    {
+        if (_records[i].seq && (_records[i].checksum == _record_checksum(_records[i])))
+        {
+            seq = std::max(seq, _records[i].seq);
+        }
+    }
+
+    // Write the record and sync the page(s) it is in
+    record.seq = seq + 1;
+    record.checksum = _record_checksum(record);
+    HistoryRecord *slot = &_records[record.seq % HISTORY_NUM_RECORDS];
+    std::memcpy(slot, &record, sizeof(record));
+    uintptr_t page_mask = ~(static_cast<uintptr_t>(::sysconf(_SC_PAGESIZE)) - 1);
+    uintptr_t start = reinterpret_cast<uintptr_t>(slot) & page_mask;
+    bool ok = ::msync(reinterpret_cast<void *>(start), (reinterpret_cast<uintptr_t>(slot + 1) - start), MS_SYNC) == 0;
+    ::flock(_fd, LOCK_UN);
+    return ok;
+}
+
+//----------------------------------------------------------------------------
+// records
+// Returns the valid records, oldest first.
+//----------------------------------------------------------------------------
+std::vector<HistoryRecord> History::records() const
+{
+    std::vector<HistoryRecord> records;
+
+    if (_records)
+    {
+        for (uint i=0; i<HISTORY_NUM_RECORDS; i++)
+        {
+            if (_records[i].seq && (_records[i].checksum == _record_checksum(_records[i])))
+            {
+                records.push_back(_records[i]);
+            }
+        }
+        std::sort(records.begin(), records.end(), [](const HistoryRecord &a, const HistoryRecord &b){ return a.seq < b.seq; });
+    }
+    return records;
+}
+
+//----------------------------------------------------------------------------
+// read_boot_id
+//----------------------------------------------------------------------------
+bool read_boot_id(uint8_t boot_id[16])
+{
+    std::ifstream file(BOOT_ID_PATH);
+    std::string id;
+    uint num_bytes = 0;
+
+    std::memset(boot_id, 0, 16);
+    if (!(file >> id))
+    {
+        return false;
+    }
+    id.erase(std::remove(id.begin(), id.end(), '-'), id.end());
+    for (uint i=0; ((i + 1) < id.size()) && (num_bytes < 16); i+=2)
+    {
+        boot_id[num_bytes++] = std::stoul(id.substr(i, 2), nullptr, 16);
+    }
+    return num_bytes == 16;
+}
+
+//----------------------------------------------------------------------------
+// print_history
+// Shows the phase time and resource usage percentiles over the whole
+// history, then the trend month by month.
+//----------------------------------------------------------------------------
+void print_history(const std::vector<HistoryRecord> &records)
+{
+    std::set<std::string> boot_ids;
+    std::set<std::pair<uint64_t, uint64_t>> image_sets;
+    std::vector<double> phase_ms[NUM_HISTORY_PHASES];
+    std::vector<double> phase_usage[NUM_HISTORY_PHASES][NUM_USAGE_COUNTERS];
+    std::vector<double> max_rss_kb;
+    std::map<std::string, std::vector<const HistoryRecord *>> months;
+    uint num_failed = 0;
+    uint num_aborted = 0;
+    char date[32];
+
+    if (records.empty())
+    {
+        MSG("No configuration history");
+        return;
+    }
+
+    // Gather the phase times of the successful runs, and group the runs by month
+    for (const HistoryRecord &r : records)
+    {
+        std::time_t time = r.timestamp;
+        boot_ids.insert(std::string(reinterpret_cast<const char *>(r.boot_id), sizeof(r.boot_id)));
+        image_sets.insert({r.image_hashes[0], r.image_hashes[1]});
+        num_failed += ((r.result != 0) && (r.result != 2));
+        num_aborted += (r.result == 2);
+        if (r.result == 0)
+        {
+            for (uint i=0; i<NUM_HISTORY_PHASES; i++)
+            {
+                if (r.phase_us[i])
+                {
+                    const ResourceUsage &u = r.usage[i];
+                    const uint32_t counters[NUM_USAGE_COUNTERS] = { u.major_faults, u.minor_faults, u.vol_switches, u.invol_switches };
+                    phase_ms[i].push_back(r.phase_us[i] / 1000.0);
+                    for (uint j=0; j<NUM_USAGE_COUNTERS; j++)
+                    {
+                        phase_usage[i][j].push_back(counters[j]);
+                    }
+                }
+            }
+            max_rss_kb.push_back(r.usage[HISTORY_PHASE_TOTAL].max_rss_kb);
+        }
+        std::strftime(date, sizeof(date), "%Y-%m", std::localtime(&time));
+        months[date].push_back(&r);
+    }
+
+    // Show the summary
+    std::time_t first = records.front().timestamp;
+    std::time_t last = records.back().timestamp;
+    std::strftime(date, sizeof(date), "%F", std::localtime(&first));
+    std::string first_date = date;
+    std::strftime(date, sizeof(date), "%F", std::localtime(&last));
+    MSG(records.size() << " runs from " << first_date << " to " << date << ", " << num_failed << " failed, " <<
+        num_aborted << " aborted, " << boot_ids.size() << " boots, " << image_sets.size() << " image sets");
+
+    // Show the phase time percentiles
+    MSG("\nPhase (ms)         p50        p90        p99        max");
+    std::cout << std::fixed << std::setprecision(2);
+    for (uint i=0; i<NUM_HISTORY_PHASES; i++)
+    {
+        if (!phase_ms[i].empty())
+        {
+            MSG(std::left << std::setw(12) << phase_names[i] << std::right <<
+                std::setw(11) << _percentile(phase_ms[i], 50) << std::setw(11) << _percentile(phase_ms[i], 90) <<
+                std::setw(11) << _percentile(phase_ms[i], 99) << std::setw(11) << _percentile(phase_ms[i], 100));
+        }
+    }
+
+    // Show the page faults and context switches of each phase, as p50/max
+    MSG("\nPhase         Major faults  Minor faults  Vol switches  Invol switches");
+    for (uint i=0; i<NUM_HISTORY_PHASES; i++)
+    {
+        if (!phase_ms[i].empty())
+        {
+            std::cout << std::left << std::setw(12) << phase_names[i] << std::right;
+            for (uint j=0; j<NUM_USAGE_COUNTERS; j++)
+            {
+                std::ostringstream counter;
+                counter << static_cast<uint64_t>(_percentile(phase_usage[i][j], 50)) << "/" <<
+                           static_cast<uint64_t>(_percentile(phase_usage[i][j], 100));
+                std::cout << std::setw((j < (NUM_USAGE_COUNTERS - 1)) ? 14 : 16) << counter.str();
+            }
+            std::cout << std::endl;
+        }
+    }
+    if (!max_rss_kb.empty())
+    {
+        MSG("Peak RSS p50 " << static_cast<uint64_t>(_percentile(max_rss_kb, 50)) << "kB, max " <<
+            static_cast<uint64_t>(_percentile(max_rss_kb, 100)) << "kB");
+    }
+
+    // Show the trend by month
+    MSG("\nMonth      Runs  Failed  Total p50  Total p90  FPGA1 p50  Stalls  Kernel");
+    for (const auto &month : months)
+    {
+        std::vector<double> total_ms;
+        std::vector<double> fpga1_ms;
+        std::map<std::string, uint> kernels;
+        uint failed = 0;
+        uint stalls = 0;
+        for (const HistoryRecord *r : month.second)
+        {
+            failed += ((r->result != 0) && (r->result != 2));
+            stalls += r->num_stalls;
+            kernels[std::string(r->kernel, strnlen(r->kernel, sizeof(r->kernel)))]++;
+            if (r->result == 0)
+            {
+                total_ms.push_back(r->phase_us[HISTORY_PHASE_TOTAL] / 1000.0);
+                fpga1_ms.push_back(r->phase_us[HISTORY_PHASE_FPGA1] / 1000.0);
+            }
+        }
+        auto kernel = std::max_element(kernels.begin(), kernels.end(), [](const auto &a, const auto &b){ return a.second < b.second; });
+        MSG(month.first << std::setw(9) << month.second.size() << std::setw(8) << failed <<
+            std::setw(11) << (total_ms.empty() ? 0.0 : _percentile(total_ms, 50)) <<
+            std::setw(11) << (total_ms.empty() ? 0.0 : _percentile(total_ms, 90)) <<
+            std::setw(11) << (fpga1_ms.empty() ? 0.0 : _percentile(fpga1_ms, 50)) <<
+            std::setw(8) << stalls << "  " << kernel->first);
+    }
+    std::cout << std::defaultfloat;
+}
+
+//----------------------------------------------------------------------------
+// _record_checksum
+//----------------------------------------------------------------------------
+uint64_t _record_checksum(HistoryRecord record)
+{
+    record.checksum = 0;
+    return hash_bytes(&record, sizeof(record));
+}
+
+//----------------------------------------------------------------------------
+// _percentile
+// Nearest rank.
+//----------------------------------------------------------------------------
+double _percentile(std::vector<double> values, double percent)
+{
+    std::sort(values.begin(), values.end());
+    size_t rank = static_cast<size_t>(std::ceil((percent / 100.0) * values.size()));
+    return values[(rank > 0) ? (rank - 1) : 0];
+}
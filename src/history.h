@@ -0,0 +1,97 @@
+/**
+ *-----------------------------------------------------------------------------
+ * Copyright (c) 2021-2024 Melbourne Instruments, Australia
+ *-----------------------------------------------------------------------------
+ * @file  history.h
+ * @brief Persistent history of configuration runs.
+ *
+ * Each configuration appends a fixed-size record to a ring of records in a
+ * file in the state directory, which is mapped into memory. A record is
+ * identified by a sequence number and checksummed as a whole, so a record
+ * torn by a power cut is ignored when the history is read, and the older
+ * records in the other slots are never touched. Appends are serialised with
+ * an flock on the file.
+ *-----------------------------------------------------------------------------
+ */
+#ifndef _HISTORY_H
+#define _HISTORY_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <sys/types.h>
+#include "resource_usage.h"
+
+// Constants
+constexpr char HISTORY_FILENAME[]     = "history.bin";
+constexpr uint32_t HISTORY_MAGIC      = 0x54534846;    // "FHST"
+constexpr uint32_t HISTORY_VERSION    = 2;
+constexpr uint HISTORY_NUM_RECORDS    = 1024;
+constexpr uint HISTORY_MAX_FPGAS      = 2;
+
+// Phases timed in each record
+enum HistoryPhase
+{
+    HISTORY_PHASE_LOCK_WAIT,
+    HISTORY_PHASE_LOAD,
+    HISTORY_PHASE_FPGA1,
+    HISTORY_PHASE_FPGA2,
+    HISTORY_PHASE_TOTAL,
+    NUM_HISTORY_PHASES
+};
+
+// A configuration run, as laid out in the history file
+struct HistoryRecord
+{
+    uint64_t seq;
+    uint64_t timestamp;
+    uint8_t boot_id[16];
+    uint64_t image_hashes[HISTORY_MAX_FPGAS];
+    uint32_t phase_us[NUM_HISTORY_PHASES];
+    char kernel[8];
+    char board_rev;
+    uint8_t num_retries;
+    uint8_t reserved[2];
+    int32_t result;
+    uint32_t num_stalls;
+    uint32_t worst_stall_us;
+    uint32_t num_fallbacks;
+    ResourceUsage usage[NUM_HISTORY_PHASES];
+    uint32_t reserved2;
+    uint64_t checksum;
+};
+static_assert(sizeof(HistoryRecord) == 208, "History records must be 208 bytes");
+
+// The history file header
+struct HistoryHeader
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t record_size;
+    uint32_t num_records;
+};
+
+// Configuration history
+class History
+{
+public:
+    History() = default;
+    ~History() { close(); }
+
+    bool open(const std::string &path, bool read_only);
+    void close();
+    bool append(HistoryRecord &record);
+    std::vector<HistoryRecord> records() const;
+
+private:
+    int _fd = -1;
+    HistoryHeader *_header = nullptr;
+    HistoryRecord *_records = nullptr;
+    size_t _size = 0;
+};
+
+// Functions
+bool read_boot_id(uint8_t boot_id[16]);
+void print_history(const std::vector<HistoryRecord> &records);
+
+#endif  // _HISTORY_H
@@ -0,0 +1,312 @@
+/**
+ *-----------------------------------------------------------------------------
+ * Copyright (c) 2021-2024 Melbourne Instruments, Australia
+ *-----------------------------------------------------------------------------
+ * @file  image_slots.cpp
+ * @brief A/B image slots with a last-known-good record.
+ *-----------------------------------------------------------------------------
+ */
+#include <fstream>
+#include <sstream>
+#include <cstdio>
+#include <cstdlib>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include "hash.h"
+#include "image_slots.h"
+
+// Local functions
+bool _load_slot_image(const std::string &dir, const std::string &filename, char slot, SlotImage &image);
+bool _load_delta_image(const std::string &dir, const std::string &filename, char slot, SlotImage &image, const SlotImage *resident);
+bool _file_mtime(const std::string &path, struct timespec &mtime);
+
+//----------------------------------------------------------------------------
+// load_record
+// The record is "fpgaN.key = value" lines. A missing record just means no
+// slot has configured yet.
+//----------------------------------------------------------------------------
+bool ImageSlots::load_record(const std::string &path)
+{
+    std::ifstream file(path);
+    std::string line;
+
+    if (!file.is_open())
+    {
+        return false;
+    }
+    while (std::getline(file, line))
+    {
+        // Split into the FPGA, key and value
+        uint fpga;
+        char key[32];
+        char value[32];
+        if ((std::sscanf(line.c_str(), "fpga%u.%31s = %31s", &fpga, key, value) != 3) ||
+            (fpga < 1) || (fpga > MAX_SLOT_FPGAS))
+        {
+            continue;
+        }
+
+        // Set the record field
+        SlotRecord &record = _records[fpga - 1];
+        std::string k = key;
+        if (k == "good_slot")
+        {
+            record.good_slot = ((value[0] == 'a') || (value[0] == 'b')) ? value[0] : 0;
+        }
+        else if (k == "good_hash")
+        {
+            record.good_hash = std::strtoull(value, nullptr, 16);
+        }
+        else if (k == "previous_hash")
+        {
+            record.previous_hash = std::strtoull(value, nullptr, 16);
+        }
+        else if (k == "bad_hash")
+        {
+            record.bad_hash = std::strtoull(value, nullptr, 16);
+        }
+        else if (k == "num_configs")
+        {
+            record.num_configs = std::strtoul(value, nullptr, 10);
+        }
+        else if (k == "num_fallbacks")
+        {
+            record.num_fallbacks = std::strtoul(value, nullptr, 10);
+        }
+    }
+    return true;
+}
+
+//----------------------------------------------------------------------------
+// save_record
+// Written to a temporary file and renamed over the record, so a power cut
+// leaves either the old or the new record.
+//----------------------------------------------------------------------------
+bool ImageSlots::save_record(const std::string &path) const
+{
+    std::string tmp_path = path + ".tmp";
+    std::ostringstream record;
+
+    for (uint i=0; i<MAX_SLOT_FPGAS; i++)
+    {
+        const SlotRecord &r = _records[i];
+        char hash[32];
+        record << "fpga" << (i + 1) << ".good_slot = " << (r.good_slot ? r.good_slot : '-') << "\n";
+        std::snprintf(hash, sizeof(hash), "%016llx", static_cast<unsigned long long>(r.good_hash));
+        record << "fpga" << (i + 1) << ".good_hash = " << hash << "\n";
+        std::snprintf(hash, sizeof(hash), "%016llx", static_cast<unsigned long long>(r.previous_hash));
+        record << "fpga" << (i + 1) << ".previous_hash = " << hash << "\n";
+        std::snprintf(hash, sizeof(hash), "%016llx", static_cast<unsigned long long>(r.bad_hash));
+        record << "fpga" << (i + 1) << ".bad_hash = " << hash << "\n";
+        record << "fpga" << (i + 1) << ".num_configs = " << r.num_configs << "\n";
+        record << "fpga" << (i + 1) << ".num_fallbacks = " << r.num_fallbacks << "\n";
+    }
+
+    // Write and sync the temporary file, then rename it over the record
+    std::string str = record.str();
+    ::mkdir(path.substr(0, path.find_last_of('/')).c_str(), 0755);
+    int fd = ::open(tmp_path.c_str(), (O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC), 0644);
+    if (fd < 0)
+    {
+        return false;
+    }
+    bool ok = (::write(fd, str.data(), str.size()) == static_cast<ssize_t>(str.size())) && (::fsync(fd) == 0);
+    ::close(fd);
+    return ok && (::rename(tmp_path.c_str(), path.c_str()) == 0);
+}
+
+//----------------------------------------------------------------------------
+// select
+// Loads the image to configure, and the fallback if there is one. A slot
+// stored as a delta is loaded after the other slot, which is usually its
+// base. If the last-known-good slot is intact, the other slot is tried
+// first only if it holds a new image. Otherwise the newer slot is tried
+// first, unless it has already failed.
+//----------------------------------------------------------------------------
+bool ImageSlots::select(uint fpga, const std::string &dir, const char *filename, SlotImage &primary, SlotImage &fallback) const
+{
+    const SlotRecord &record = _records[fpga];
+    SlotImage slots[2];
+    bool has_slot[2];
+    struct timespec mtime[2] = {};
+
+    primary = {};
+    fallback = {};
+
+    // Load each slot, using the plain image if there are none
+    for (uint i=0; i<2; i++)
+    {
+        char slot = 'a' + i;
+        has_slot[i] = _file_mtime((dir + slot_filename(filename, slot)), mtime[i]) &&
+                      _load_slot_image(dir, slot_filename(filename, slot), slot, slots[i]);
+    }
+    for (uint i=0; i<2; i++)
+    {
+        char slot = 'a' + i;
+        has_slot[i] = has_slot[i] ||
+                      (_file_mtime((dir + slot_filename(filename, slot) + DELTA_SUFFIX), mtime[i]) &&
+                       _load_delta_image(dir, slot_filename(filename, slot), slot, slots[i], ((has_slot[i ^ 1] && !slots[i ^ 1].delta) ? &slots[i ^ 1] : nullptr)));
+    }
+    if (!has_slot[0] && !has_slot[1])
+    {
+        return _load_slot_image(dir, filename, 0, primary) || _load_delta_image(dir, filename, 0, primary, nullptr);
+    }
+    if (!has_slot[0] || !has_slot[1])
+    {
+        primary = std::move(slots[has_slot[0] ? 0 : 1]);
+        return true;
+    }
+
+    // Pick the slot to try first
+    uint first;
+    if (record.good_slot && (slots[record.good_slot - 'a'].hash == record.good_hash))
+    {
+        uint good = record.good_slot - 'a';
+        uint64_t other_hash = slots[good ^ 1].hash;
+        bool is_new = (other_hash != record.good_hash) && (other_hash != record.previous_hash) && (other_hash != record.bad_hash);
+        first = is_new ? (good ^ 1) : good;
+    }
+    else
+    {
+        first = ((mtime[1].tv_sec > mtime[0].tv_sec) ||
+                 ((mtime[1].tv_sec == mtime[0].tv_sec) && (mtime[1].tv_nsec > mtime[0].tv_nsec))) ? 1 : 0;
+        if (record.bad_hash && (slots[first].hash == record.bad_hash))
+        {
+            first ^= 1;
+        }
+    }
+
+    // The other slot is the fallback, unless it has already failed
+    primary = std::move(slots[first]);
+    if (!record.bad_hash || (slots[first ^ 1].hash != record.bad_hash))
+    {
+        fallback = std::move(slots[first ^ 1]);
+    }
+    return true;
+}
+
+//----------------------------------------------------------------------------
+// record_config
+//----------------------------------------------------------------------------
+void ImageSlots::record_config(uint fpga, const SlotImage &image)
+{
+    SlotRecord &record = _records[fpga];
+
+    if (image.hash != record.good_hash)
+    {
+        record.previous_hash = record.good_hash;
+    }
+    record.good_slot = image.slot;
+    record.good_hash = image.hash;
+    record.num_configs++;
+}
+
+//----------------------------------------------------------------------------
+// record_failure
+//----------------------------------------------------------------------------
+void ImageSlots::record_failure(uint fpga, const SlotImage &image)
+{
+    SlotRecord &record = _records[fpga];
+
+    record.bad_hash = image.hash;
+    record.num_fallbacks++;
+}
+
+//----------------------------------------------------------------------------
+// slot_filename
+// e.g. synthia_fpga_1.rbf -> synthia_fpga_1.a.rbf
+//----------------------------------------------------------------------------
+std::string slot_filename(const char *filename, char slot)
+{
+    std::string name = filename;
+    auto ext = name.find_last_of('.');
+    if (ext == std::string::npos)
+    {
+        ext = name.size();
+    }
+    return name.insert(ext, std::string(".") + slot);
+}
+
+//----------------------------------------------------------------------------
+// read_image_file
+// Reads the file with one allocation and a read() per chunk the kernel
+// returns, rather than through iostreams.
+//----------------------------------------------------------------------------
+bool read_image_file(const std::string &path, std::vector<uint8_t> &data)
+{
+    struct stat st;
+    int fd = ::open(path.c_str(), (O_RDONLY|O_CLOEXEC));
+    if (fd < 0)
+    {
+        return false;
+    }
+    bool ok = (::fstat(fd, &st) == 0);
+    if (ok)
+    {
+        data.resize(st.st_size);
+        size_t pos = 0;
+        while (pos < data.size())
+        {
+            ssize_t n = ::read(fd, (data.data() + pos), (data.size() - pos));
+            if (n <= 0)
+            {
+                ok = (n == 0);
+                break;
+            }
+            pos += n;
+        }
+        data.resize(pos);
+    }
+    ::close(fd);
+    return ok;
+}
+
+//----------------------------------------------------------------------------
+// _load_slot_image
+//----------------------------------------------------------------------------
+bool _load_slot_image(const std::string &dir, const std::string &filename, char slot, SlotImage &image)
+{
+    if (!read_image_file((dir + filename), image.data))
+    {
+        return false;
+    }
+    image.slot = slot;
+    image.filename = filename;
+    image.hash = hash_bytes(image.data.data(), image.data.size());
+    return true;
+}
+
+//----------------------------------------------------------------------------
+// _load_delta_image
+// Starts building the image from its delta, e.g. synthia_fpga_1.b.rbf.delta.
+// The image hash is the target hash of the delta, so it can be selected
+// before it is built.
+//----------------------------------------------------------------------------
+bool _load_delta_image(const std::string &dir, const std::string &filename, char slot, SlotImage &image, const SlotImage *resident)
+{
+    image.delta = std::make_unique<DeltaApplier>();
+    if (!image.delta->start(dir, (filename + DELTA_SUFFIX), image.data, image.hash,
+                            (resident ? &resident->data : nullptr), (resident ? resident->hash : 0)))
+    {
+        image = {};
+        return false;
+    }
+    image.slot = slot;
+    image.filename = filename + DELTA_SUFFIX;
+    return true;
+}
+
+//----------------------------------------------------------------------------
+// _file_mtime
+//----------------------------------------------------------------------------
+bool _file_mtime(const std::string &path, struct timespec &mtime)
+{
+    struct stat st;
+    if (::stat(path.c_str(), &st) != 0)
+    {
+        return false;
+    }
+    mtime = st.st_mtim;
+    return true;
+}
@@ -0,0 +1,77 @@
+/**
+ *-----------------------------------------------------------------------------
+ * Copyright (c) 2021-2024 Melbourne Instruments, Australia
+ *-----------------------------------------------------------------------------
+ * @file  image_slots.h
+ * @brief A/B image slots with a last-known-good record.
+ *
+ * Each FPGA image can have two slots next to it, e.g. synthia_fpga_1.a.rbf
+ * and synthia_fpga_1.b.rbf. An update writes the slot that is not the
+ * last-known-good one. A new image is tried first and the last-known-good
+ * one is preloaded as the fallback, so a bad update costs one extra
+ * transfer. Images are identified by content hash in a small record in the
+ * state directory, which holds the last-known-good image, the one before it,
+ * and any image that failed. Without slot files the plain image is used as
+ * before. Any of these files can instead be stored as a binary delta (see
+ * delta.h), which is applied while the image is transferred.
+ *-----------------------------------------------------------------------------
+ */
+#ifndef _IMAGE_SLOTS_H
+#define _IMAGE_SLOTS_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <memory>
+#include <sys/types.h>
+#include "delta.h"
+
+// Constants
+constexpr char DEFAULT_STATE_DIR[]    = "/var/lib/fpga_config/";
+constexpr char SLOT_RECORD_FILENAME[] = "slots.conf";
+constexpr uint MAX_SLOT_FPGAS         = 2;
+
+// An FPGA image, from a slot ('a' or 'b') or the plain image file (slot 0).
+// If it is built from a delta, the data is only complete once the delta
+// has finished.
+struct SlotImage
+{
+    char slot = 0;
+    std::string filename;
+    std::vector<uint8_t> data;
+    uint64_t hash = 0;
+    std::unique_ptr<DeltaApplier> delta;
+};
+
+// The last-known-good record of an FPGA
+struct SlotRecord
+{
+    char good_slot = 0;
+    uint64_t good_hash = 0;
+    uint64_t previous_hash = 0;
+    uint64_t bad_hash = 0;
+    uint num_configs = 0;
+    uint num_fallbacks = 0;
+};
+
+// Image slots
+class ImageSlots
+{
+public:
+    ImageSlots() = default;
+
+    bool load_record(const std::string &path);
+    bool save_record(const std::string &path) const;
+    bool select(uint fpga, const std::string &dir, const char *filename, SlotImage &primary, SlotImage &fallback) const;
+    void record_config(uint fpga, const SlotImage &image);
+    void record_failure(uint fpga, const SlotImage &image);
+
+private:
+    SlotRecord _records[MAX_SLOT_FPGAS];
+};
+
+// Functions
+std::string slot_filename(const char *filename, char slot);
+bool read_image_file(const std::string &path, std::vector<uint8_t> &data);
+
+#endif  // _IMAGE_SLOTS_H
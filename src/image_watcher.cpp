@@ -0,0 +1,126 @@
+/**
+ *-----------------------------------------------------------------------------
+ * Copyright (c) 2021-2024 Melbourne Instruments, Australia
+ *-----------------------------------------------------------------------------
+ * @file  image_watcher.cpp
+ * @brief Watches the firmware directory for replaced FPGA images.
+ *-----------------------------------------------------------------------------
+ */
+#include <algorithm>
+#include <cerrno>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/inotify.h>
+#include <sys/eventfd.h>
+#include "image_watcher.h"
+
+//----------------------------------------------------------------------------
+// start
+//----------------------------------------------------------------------------
+bool ImageWatcher::start(const std::string &dir, const std::vector<std::string> &filenames, void (*refresh)())
+{
+    // Watch the directory for files written or moved into it
+    stop();
+    _inotify_fd = ::inotify_init1(IN_NONBLOCK|IN_CLOEXEC);
+    _event_fd = ::eventfd(0, EFD_CLOEXEC);
+    if ((_inotify_fd < 0) || (_event_fd < 0) ||
+        (::inotify_add_watch(_inotify_fd, dir.c_str(), (IN_CLOSE_WRITE|IN_MOVED_TO)) < 0))
+    {
+        stop();
+        return false;
+    }
+
+    // Start the watcher thread
+    _filenames = filenames;
+    _refresh = refresh;
+    _thread = std::thread(&ImageWatcher::_run, this);
+    return true;
+}
+
+//----------------------------------------------------------------------------
+// stop
+// Waits for any refresh in progress to finish.
+//----------------------------------------------------------------------------
+void ImageWatcher::stop()
+{
+    if (_thread.joinable())
+    {
+        uint64_t value = 1;
+        [[maybe_unused]] auto ret = ::write(_event_fd, &value, sizeof(value));
+        _thread.join();
+    }
+    if (_inotify_fd >= 0)
+    {
+        ::close(_inotify_fd);
+        _inotify_fd = -1;
+    }
+    if (_event_fd >= 0)
+    {
+        ::close(_event_fd);
+        _event_fd = -1;
+    }
+}
+
+//----------------------------------------------------------------------------
+// _run
+//----------------------------------------------------------------------------
+void ImageWatcher::_run()
+{
+    struct pollfd fds[2] = {{_inotify_fd, POLLIN, 0}, {_event_fd, POLLIN, 0}};
+    bool pending = false;
+
+    while (true)
+    {
+        // Wait for an event, timing out once a burst of events is over
+        int ret = ::poll(fds, 2, (pending ? IMAGE_WATCH_DEBOUNCE_MS : -1));
+        if (ret < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            break;
+        }
+        if (fds[1].revents)
+        {
+            break;
+        }
+        if (ret == 0)
+        {
+            pending = false;
+            _refresh();
+            continue;
+        }
+        if (_read_events())
+        {
+            pending = true;
+        }
+    }
+}
+
+//----------------------------------------------------------------------------
+// _read_events
+// Returns true if any of the events were for a watched file.
+//----------------------------------------------------------------------------
+bool ImageWatcher::_read_events()
+{
+    alignas(struct inotify_event) char buf[4096];
+    bool watched = false;
+    ssize_t len;
+
+    while ((len = ::read(_inotify_fd, buf, sizeof(buf))) > 0)
+    {
+        for (char *ptr = buf; ptr < (buf + len); ptr += (sizeof(struct inotify_event) + reinterpret_cast<struct inotify_event *>(ptr)->len))
+        {
+            auto event = reinterpret_cast<const struct inotify_event *>(ptr);
+
+            // If events were lost, assume a watched file changed
+            if ((event->mask & IN_Q_OVERFLOW) ||
+                ((event->len > 0) && (std::find(_filenames.begin(), _filenames.end(), event->name) != _filenames.end())))
+            {
+                watched = true;
+            }
+        }
+    }
+    return watched;
+}
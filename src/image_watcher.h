@@ -0,0 +1,48 @@
+/**
+ *-----------------------------------------------------------------------------
+ * Copyright (c) 2021-2024 Melbourne Instruments, Australia
+ *-----------------------------------------------------------------------------
+ * @file  image_watcher.h
+ * @brief Watches the firmware directory for replaced FPGA images.
+ *
+ * Only IN_CLOSE_WRITE and IN_MOVED_TO are watched, so an image is never
+ * picked up part way through being written: an in-place write is seen when
+ * the writer closes the file, and an atomic replace (write a temporary file,
+ * then rename it over the image) when it is renamed. Events for other files
+ * are ignored. A burst of events (e.g. both images, or both slots, being
+ * updated) is debounced into one refresh, called from the watcher thread
+ * once the directory has been quiet for IMAGE_WATCH_DEBOUNCE_MS.
+ *-----------------------------------------------------------------------------
+ */
+#ifndef _IMAGE_WATCHER_H
+#define _IMAGE_WATCHER_H
+
+#include <string>
+#include <vector>
+#include <thread>
+
+// Constants
+constexpr int IMAGE_WATCH_DEBOUNCE_MS = 500;
+
+// Image watcher
+class ImageWatcher
+{
+public:
+    ImageWatcher() = default;
+    ~ImageWatcher() { stop(); }
+
+    bool start(const std::string &dir, const std::vector<std::string> &filenames, void (*refresh)());
+    void stop();
+
+private:
+    int _inotify_fd = -1;
+    int _event_fd = -1;
+    std::vector<std::string> _filenames;
+    void (*_refresh)() = nullptr;
+    std::thread _thread;
+
+    void _run();
+    bool _read_events();
+};
+
+#endif  // _IMAGE_WATCHER_H
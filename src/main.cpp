@@ -9,126 +9,679 @@
 #include <iostream>
 #include <cstring>
 #include <csignal>
-#include <condition_variable>
 #include <sys/ioctl.h>
 #include <sys/sysinfo.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <fstream>
+#include <iomanip>
+#include <algorithm>
+#include <ctime>
 #include <thread>
+#include <mutex>
+#include <getopt.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 #include "common.h"
 #include "version.h"
+#include "gpio.h"
+#include "transfer.h"
+#include "spi_engine.h"
+#include "cost_model.h"
+#include "verify.h"
+#include "stall_detector.h"
+#include "cpu_steering.h"
+#include "abort_control.h"
+#include "progress.h"
+#include "config_lock.h"
+#include "hash.h"
+#include "image_slots.h"
+#include "image_watcher.h"
+#include "history.h"
+#include "metrics.h"
+#include "trace.h"
+#include "stream_cache.h"
+#include "delta.h"
+#include "phase_watchdog.h"
+#include "resource_usage.h"
+#include "protocol.h"
 #include <sys/mman.h>
 
 // Constants
-constexpr uint NUM_CONSECUTIVE_GPIO_WRITES = 5;
-constexpr char MEM_DEV_NAME[]              = "/dev/mem";
 #if MELBINST_PI_HAT == 0
 constexpr char FPGA1_BINARY_FILENAME[]     = "synthia_fpga_1.rbf";
 constexpr char FPGA2_BINARY_FILENAME[]     = "synthia_fpga_2.rbf";
-constexpr uint FPGA2_NCE_GPIO_PIN          = 2;
+constexpr uint NUM_FPGAS                   = 2;
 #elif MELBINST_PI_HAT == 1
 constexpr char FPGA1_BINARY_FILENAME[]      = "monique.rbf";
+constexpr uint NUM_FPGAS                    = 1;
 #endif
-constexpr uint DCLK_GPIO_PIN               = 3;
-constexpr uint DATA0_GPIO_PIN              = 16;
-constexpr uint NCONFIG_GPIO_PIN            = 17;
-constexpr uint BOARD_REV_GPIO_PIN_1        = 20;
-constexpr uint BOARD_REV_GPIO_PIN_2        = 21;
-constexpr uint PAGE_SIZE                   = 4096;
-constexpr uint BCM2711_PI4_PERIPHERAL_BASE = 0xFE000000;
-constexpr uint GPIO_REGISTER_BASE          = 0x200000;
-constexpr uint GPIO_SET_OFFSET             = 0x1C;
-constexpr uint GPIO_CLR_OFFSET             = 0x28;
-constexpr uint GPIO_RD_OFFSET              = 0x34;
-constexpr uint GPIO_PULL_BASE_OFFSET       = 0xE4;
-constexpr uint PHYSICAL_GPIO_BUS           = (0x7E000000 + GPIO_REGISTER_BASE);
-
-// MACROs
-#define RD_GPIO_PIN(pin)    (((*gpio_rd_reg) >> pin) & 0x01)
-#define SET_GPIO_PIN(pin)   *gpio_set_reg = (1 << pin)
-#define CLR_GPIO_PIN(pin)   *gpio_clr_reg = (1 << pin)
-#define SET_DCLK_PIN()      { for (uint volatile i=0; i<NUM_CONSECUTIVE_GPIO_WRITES; i++) \
-                                  SET_GPIO_PIN(DCLK_GPIO_PIN); }
-#define CLR_DCLK_PIN()      { for (uint volatile i=0; i<NUM_CONSECUTIVE_GPIO_WRITES; i++) \
-                                  CLR_GPIO_PIN(DCLK_GPIO_PIN); }
+constexpr uint MONITOR_POLL_MS              = 20;
+constexpr uint MONITOR_CONFIRM_MS           = 1;
+constexpr uint CONF_DONE_TIMEOUT_US         = 1000;
+constexpr uint NCONFIG_RESET_US             = 1000;
+constexpr uint WATCHDOG_NUM_RETRIES         = 1;
+
+// CONF_DONE/nSTATUS pins of each FPGA
+#if MELBINST_PI_HAT == 0
+const char *fpga_filenames[NUM_FPGAS]       = { FPGA1_BINARY_FILENAME, FPGA2_BINARY_FILENAME };
+constexpr uint conf_done_pins[NUM_FPGAS]    = { FPGA1_CONF_DONE_GPIO_PIN, FPGA2_CONF_DONE_GPIO_PIN };
+constexpr uint nstatus_pins[NUM_FPGAS]      = { FPGA1_NSTATUS_GPIO_PIN, FPGA2_NSTATUS_GPIO_PIN };
+#elif MELBINST_PI_HAT == 1
+const char *fpga_filenames[NUM_FPGAS]       = { FPGA1_BINARY_FILENAME };
+constexpr uint conf_done_pins[NUM_FPGAS]    = { FPGA1_CONF_DONE_GPIO_PIN };
+constexpr uint nstatus_pins[NUM_FPGAS]      = { FPGA1_NSTATUS_GPIO_PIN };
+#endif
+
+// Pins cleared together for the safe state, and the status pins sampled by
+// the monitor
+constexpr GpioPinMasks safe_state_clr_pins  = { DCLK_GPIO_PIN, DATA0_GPIO_PIN, NCONFIG_GPIO_PIN };
+constexpr GpioPinMasks idle_clr_pins        = { DCLK_GPIO_PIN, DATA0_GPIO_PIN };
+#if MELBINST_PI_HAT == 0
+constexpr GpioPinMasks status_pins          = { FPGA1_CONF_DONE_GPIO_PIN, FPGA1_NSTATUS_GPIO_PIN,
+                                                FPGA2_CONF_DONE_GPIO_PIN, FPGA2_NSTATUS_GPIO_PIN };
+#elif MELBINST_PI_HAT == 1
+constexpr GpioPinMasks status_pins          = { FPGA1_CONF_DONE_GPIO_PIN, FPGA1_NSTATUS_GPIO_PIN };
+#endif
+
+// MACROs, for pins in either bank
+#define RD_GPIO_PIN(pin)    ((gpio_rd_reg[gpio_bank(pin)] >> ((pin) % GPIO_BANK_SIZE)) & 0x01)
+#define SET_GPIO_PIN(pin)   gpio_set_reg[gpio_bank(pin)] = gpio_mask(pin)
+#define CLR_GPIO_PIN(pin)   gpio_clr_reg[gpio_bank(pin)] = gpio_mask(pin)
+
+// Run modes
+enum class RunMode
+{
+    CONFIG,
+    MONITOR,
+    VERIFY,
+    DRY_RUN,
+    HISTORY,
+    MAKE_DELTA
+};
+
+// Transfer kernels
+enum class TransferKernel
+{
+    CPU,
+    SPI,
+    TABLE
+};
+
+// Long only command line options
+enum LongOption
+{
+    OPT_PLATFORM = 256,
+    OPT_TUNING_FILE,
+    OPT_STEER_CPU,
+    OPT_SYSFS_ROOT,
+    OPT_PROCFS_ROOT,
+    OPT_PROGRESS,
+    OPT_LOCK_FILE,
+    OPT_STATE_DIR,
+    OPT_HISTORY,
+    OPT_METRICS_FILE,
+    OPT_TRACE_FILE,
+    OPT_CACHE_DIR,
+    OPT_MAKE_DELTA,
+    OPT_CHECK_NSTATUS
+};
 
 // Global variables
-bool exit_flag = false;
-bool exit_condition() {return exit_flag;}
-std::condition_variable exit_notifier;
+std::atomic<bool> exit_flag(false);
+std::atomic<bool> reconfig_flag(false);
+AbortControl abort_control;
+PhaseWatchdog watchdog;
 uint32_t *gpio_port;
 volatile uint32_t *gpio_set_reg;
 volatile uint32_t *gpio_clr_reg;
 volatile uint32_t *gpio_rd_reg;
+std::chrono::steady_clock::time_point nconfig_time;
+bool nconfig_raised = false;
 uint8_t *binary_data = 0;
 uint binary_data_size = 0;
+SlotImage fpga_images[NUM_FPGAS];
+SlotImage fallback_images[NUM_FPGAS];
+ImageSlots image_slots;
+bool check_conf_done = false;
+bool check_nstatus = false;
+uint64_t images_key = 0;
+std::string state_dir = DEFAULT_STATE_DIR;
+ImageWatcher image_watcher;
+std::mutex images_mutex;
+SlotImage refreshed_images[NUM_FPGAS];
+SlotImage refreshed_fallbacks[NUM_FPGAS];
+uint64_t refreshed_key = 0;
+bool images_refreshed = false;
+History history;
+HistoryRecord history_record = {};
+std::chrono::steady_clock::time_point history_start;
+ResourceUsage history_usage_start = {};
+bool history_pending = false;
+std::string metrics_file = DEFAULT_METRICS_FILE_PATH;
+TraceRecorder trace;
+std::string trace_file;
+StreamCache stream_cache;
+std::string cache_dir = DEFAULT_CACHE_DIR;
+bool stream_missed[NUM_FPGAS] = {};
+RunMode run_mode = RunMode::CONFIG;
+TransferKernel transfer_kernel = TransferKernel::CPU;
+SpidevDevice spi_device;
+#if FPGA_CONFIG_STALL_DETECTOR
+StallDetector stall_detector;
+#endif
+CpuSteering cpu_steering;
+int steer_cpu = -1;
+ProgressSegment progress_segment;
+ProgressReporter progress_reporter;
+bool show_progress = false;
+ConfigLock config_lock;
+std::string lock_file = DEFAULT_LOCK_FILE_PATH;
+std::string firmware_dir = FPGA_BINARIES_DIR;
+std::string platform_name;
+std::string tuning_file;
+std::vector<std::string> verify_files;
+std::string delta_base_file;
+std::string delta_target_file;
+
+// Sampler called by the CPU kernel once per chunk
+struct CpuKernelSampler
+{
+    TransferProgress *progress;
+    const DeltaApplier *delta;
+
+    inline void sample(uint num_bytes_sent)
+    {
+        // Wait for the next chunk if the image is still being built from a
+        // delta, unless aborted (the kernel then stops at the next chunk)
+        if (delta)
+        {
+            delta->wait_for((num_bytes_sent + TRANSFER_CHUNK_SIZE), exit_flag);
+        }
+        progress->publish(num_bytes_sent);
+#if FPGA_CONFIG_STALL_DETECTOR
+        stall_detector.sample();
+#endif
+    }
+};
 
 // Local functions
+bool _parse_args(int argc, char *argv[]);
 void _open_and_setup_gpio();
-void *_mmap_bcm_register_base(off_t register_base);
-void _init_gpio_pin(int pin, bool output);
+void _init_gpio_pin(int pin, bool output, bool pull_up=false);
+void _init_status_pins();
+void _raise_nconfig();
 void _close_gpio();
-void _config_fpga1();
+bool _load_binary_file(const char *filename, const char *name);
+void _load_fpga_images();
+bool _get_fpga_image(uint fpga, const char *name);
+void _free_binary_file();
+void _free_fpga_images();
+void _pin_image(uint fpga, const SlotImage &image);
+std::vector<std::string> _image_filenames();
+uint64_t _hash_images();
+void _refresh_images();
+bool _check_image(const SlotImage &image);
+void _adopt_refreshed_images();
+bool _config_fpgas();
+int _config_fpga_chain();
+bool _config_fpga1();
 #if MELBINST_PI_HAT == 0
-void _config_fpga2();
+bool _config_fpga2();
 #endif
-void _transfer_data();
+bool _fpga_configured(uint fpga);
+bool _finish_delta(uint fpga);
+std::string _image_name(const SlotImage &image);
+void _transfer_data(uint fpga_num);
+void _print_stall_stats(const char *name);
+void _print_fault_stats(const char *name, HistoryPhase phase);
+void _begin_history_record();
+void _record_transfer(uint fpga, std::chrono::system_clock::duration time, const ResourceUsage &usage_start);
+void _append_history_record(int result);
+int _exit_code(bool ok);
+bool _retry_overrun(uint &num_retries);
+uint32_t _elapsed_us(std::chrono::steady_clock::time_point start);
+int _show_history();
+int _make_delta();
+void _notify_ready();
+void _write_metrics();
+void _write_trace();
+uint64_t _stream_profile();
+void _store_streams();
+void _monitor();
+int _find_lost_fpga();
+bool _reconfigure_fpgas();
+int _verify_kernels();
+int _dry_run();
+bool _predict_image(const char *filename, const char *name, const CostCoefficients &coeffs, double &total_us);
+const char *_kernel_name(TransferKernel kernel);
 void _print_app_info();
+void _print_usage();
 void _print_board_rev_info();
-void _sigint_handler([[maybe_unused]] int sig);
+char _board_rev();
+void _set_safe_pin_state();
+void _force_safe_state();
+void _before_forced_exit();
 
 //----------------------------------------------------------------------------
 // main
 //----------------------------------------------------------------------------
-int main(void)
+int main(int argc, char *argv[])
 {
-    // Setup the exit signal handler (e.g. ctrl-c, kill)
-    ::signal(SIGINT, _sigint_handler);
-    ::signal(SIGTERM, _sigint_handler);
+    // Handle the exit signals (e.g. ctrl-c, kill) and reconfigure requests
+    // (SIGHUP) in the abort control thread
+    if (!abort_control.start(exit_flag, _force_safe_state, _before_forced_exit, &reconfig_flag))
+    {
+        MSG("Abort control setup error, the transfer cannot be cancelled cleanly");
+    }
+
+    // Parse the command line arguments
+    if (!_parse_args(argc, argv))
+    {
+        _print_app_info();
+        _print_usage();
+        return 1;
+    }
+
+    // Show the app info, unless configuring the FPGAs where it is deferred
+    // until they are configured
+    if ((run_mode != RunMode::CONFIG) && (run_mode != RunMode::MONITOR))
+    {
+        _print_app_info();
+    }
 
-    // Show the app info
-    _print_app_info();
+    // Verifying the transfer kernels and dry runs do not need any hardware
+    if (run_mode == RunMode::VERIFY)
+    {
+        return _verify_kernels();
+    }
+    if (run_mode == RunMode::DRY_RUN)
+    {
+        return _dry_run();
+    }
+    if (run_mode == RunMode::HISTORY)
+    {
+        return _show_history();
+    }
+    if (run_mode == RunMode::MAKE_DELTA)
+    {
+        return _make_delta();
+    }
+
+    // Wait for any other configuration in flight, and reuse its result if it
+    // was for the same images
+    int result = 0;
+    bool configured = false;
+    bool monitored = false;
+    uint owner_pid = 0;
+    if (!trace_file.empty())
+    {
+        trace.enable();
+    }
+    _begin_history_record();
+    uint64_t lock_start = TraceRecorder::now_ns();
+    images_key = _hash_images();
+    switch (config_lock.acquire(lock_file.c_str(), images_key, exit_flag, result, owner_pid))
+    {
+        case LockResult::COALESCED:
+            MSG("FPGAs configured with the same images by fpga_config (pid " << owner_pid << "), reusing the result");
+            return result;
+
+        case LockResult::ABORTED:
+            MSG("\nFPGA Config aborted");
+            return ABORT_EXIT_CODE;
+
+        case LockResult::ERROR:
+            MSG("Could not open the lock file " << lock_file << ", configuring without it");
+            break;
+
+        default:
+            break;
+    }
+    history_record.phase_us[HISTORY_PHASE_LOCK_WAIT] = _elapsed_us(history_start);
+    history_record.usage[HISTORY_PHASE_LOCK_WAIT] = usage_since(history_usage_start, false);
+    trace.slice(TraceTrack::CONTROL, "lock wait", lock_start, TraceRecorder::now_ns());
+
+    // Bound each phase of the configuration with a deadline
+    if (!watchdog.start(exit_flag, _force_safe_state, _before_forced_exit))
+    {
+        MSG("Watchdog setup error, the configuration phases have no deadlines");
+    }
+
+    // Load the images, with the fallback images of any A/B slots, while the
+    // GPIO and transfer engines are set up and the FPGAs reset
+    watchdog.arm(WatchdogPhase::LOAD);
+    std::thread loader([]() {
+        auto load_start = std::chrono::steady_clock::now();
+        ResourceUsage usage_start = sample_usage(true);
+        _load_fpga_images();
+        history_record.phase_us[HISTORY_PHASE_LOAD] = _elapsed_us(load_start);
+        history_record.usage[HISTORY_PHASE_LOAD] = usage_since(usage_start, true);
+    });
+
+    // Open the configuration history
+    if (!history.open((state_dir + HISTORY_FILENAME), false))
+    {
+        DEBUG_MSG("Could not open the configuration history in " << state_dir);
+    }
 
     // Open and setup the GPIO
+    uint64_t gpio_start = TraceRecorder::now_ns();
     _open_and_setup_gpio();
-    
-    // Show the board rev info
-    _print_board_rev_info();
+    trace.slice(TraceTrack::CONTROL, "open GPIO", gpio_start, TraceRecorder::now_ns());
 
     // Was the GPIO open and setup setup ok?
     if (gpio_port)
     {
-        // Configure FPGA1
-        _config_fpga1();
+        // Setup the SPI device if selected, otherwise fall back to the CPU
+        if ((transfer_kernel == TransferKernel::SPI) && !spi_device.open(SPI_DEV_NAME, SPI_SPEED_HZ))
+        {
+            MSG("SPI device setup error, using the CPU kernel");
+            transfer_kernel = TransferKernel::CPU;
+        }
 
-#if MELBINST_PI_HAT == 0
-        // Free any allocated memory
-        if (binary_data)
+        // Publish the transfer progress, and show it if selected
+        if (!progress_segment.open(PROGRESS_SEGMENT_PATH))
+        {
+            DEBUG_MSG("Could not create the progress segment, progress is not shared");
+        }
+        if (show_progress)
         {
-            // Free it
-            delete [] binary_data;
+            progress_reporter.start(progress_segment.progress());
         }
-        binary_data = 0;
+        stream_cache.set_dir(cache_dir);
 
-        // Configure FPGA2
-        _config_fpga2();
-#endif
+        // Put the FPGAs into config mode, then wait for the images
+        _raise_nconfig();
+        uint64_t load_wait_start = TraceRecorder::now_ns();
+        loader.join();
+        watchdog.disarm();
+        trace.slice(TraceTrack::CONTROL, "wait for images", load_wait_start, TraceRecorder::now_ns());
+
+        // The status pins are only set up if they are read, which is known
+        // once the images are loaded
+        if (check_conf_done || check_nstatus)
+        {
+            _init_status_pins();
+        }
+
+        // Steer the IRQs and CPU frequency for the transfer window if selected
+        uint64_t steer_start = TraceRecorder::now_ns();
+        if ((steer_cpu >= 0) && !cpu_steering.apply(steer_cpu))
+        {
+            MSG("CPU steering error, continuing without it");
+        }
+        trace.slice(TraceTrack::CONTROL, "steer CPU", steer_start, TraceRecorder::now_ns());
+
+        // Configure the FPGAs, unless the images could not be loaded in time
+        configured = !exit_flag && _config_fpgas();
+
+        // Restore the IRQ and CPU frequency settings
+        steer_start = TraceRecorder::now_ns();
+        cpu_steering.restore();
+        progress_reporter.stop();
+        trace.slice(TraceTrack::CONTROL, "restore CPU", steer_start, TraceRecorder::now_ns());
+
+        // Signal readiness to systemd, then record the run and write the
+        // metrics and trace off the boot path. An aborted run is only
+        // recorded once the abort control has stopped, so no file I/O delays
+        // the abort
+        if (configured && !exit_flag)
+        {
+            _notify_ready();
+            trace.instant(TraceTrack::CONTROL, "ready");
+        }
+        history_pending = exit_flag;
+        if (!exit_flag)
+        {
+            _append_history_record(_exit_code(configured));
+        }
+
+        // Show the deferred app and board info
+        _print_app_info();
+        _print_board_rev_info();
+        if (!exit_flag)
+        {
+            _write_metrics();
+            _store_streams();
+            _write_trace();
+        }
+
+        // Monitor the configuration if selected, letting other invocations
+        // run while monitoring, and keep the images up to date
+        if ((run_mode == RunMode::MONITOR) && !exit_flag)
+        {
+            if (!image_watcher.start(firmware_dir, _image_filenames(), _refresh_images))
+            {
+                MSG("Could not watch " << firmware_dir << ", updated images need a restart");
+            }
+            config_lock.release(_exit_code(configured));
+            _monitor();
+            image_watcher.stop();
+            monitored = true;
+        }
+        progress_segment.close();
+
+        // If aborted, hold the FPGAs in reset so no partial config is left
+        if (exit_flag)
+        {
+            _set_safe_pin_state();
+        }
+    }
+    else
+    {
+        // The images are not needed without the GPIO
+        loader.join();
+        watchdog.disarm();
+        _print_app_info();
     }
 
-    // Free any allocated memory
-    if (binary_data)
+    // Stop the abort control and watchdog, nothing after this needs to be
+    // cancelled
+    abort_control.stop();
+    watchdog.stop();
+
+    // Record an aborted run, and write the trace of the monitoring (which
+    // ends with a signal), now that they cannot hold up the abort
+    if (history_pending)
     {
-        // Free it
-        delete [] binary_data;
+        _append_history_record(_exit_code(configured));
+    }
+    if (monitored)
+    {
+        _write_trace();
     }
 
+    // Free any allocated memory
+    _free_binary_file();
+    _free_fpga_images();
+    stream_cache.close();
+    spi_device.close();
+
     // Close the GPIO port
     _close_gpio();
 
-    // FPGA Config finished
-    MSG("\nFPGA Config completed");
-    return 0;
+    // FPGA Config finished, let any waiting invocation know the result
+    result = _exit_code(configured);
+    config_lock.release(result);
+    MSG(((watchdog.expired() != WatchdogPhase::NONE) ? "\nFPGA Config timed out" :
+         (exit_flag ? "\nFPGA Config aborted" : (configured ? "\nFPGA Config completed" : "\nFPGA Config failed"))));
+    return result;
+}
+
+//----------------------------------------------------------------------------
+// _parse_args
+//----------------------------------------------------------------------------
+bool _parse_args(int argc, char *argv[])
+{
+    static const struct option long_options[] = {
+        {"kernel",       required_argument, nullptr, 'k'},
+        {"verify",       no_argument,       nullptr, 'v'},
+        {"monitor",      no_argument,       nullptr, 'm'},
+        {"dry-run",      no_argument,       nullptr, 'n'},
+        {"firmware-dir", required_argument, nullptr, 'd'},
+        {"platform",     required_argument, nullptr, OPT_PLATFORM},
+        {"tuning-file",  required_argument, nullptr, OPT_TUNING_FILE},
+        {"steer-cpu",    required_argument, nullptr, OPT_STEER_CPU},
+        {"sysfs-root",   required_argument, nullptr, OPT_SYSFS_ROOT},
+        {"procfs-root",  required_argument, nullptr, OPT_PROCFS_ROOT},
+        {"progress",     no_argument,       nullptr, OPT_PROGRESS},
+        {"lock-file",    required_argument, nullptr, OPT_LOCK_FILE},
+        {"state-dir",    required_argument, nullptr, OPT_STATE_DIR},
+        {"history",      no_argument,       nullptr, OPT_HISTORY},
+        {"metrics-file", required_argument, nullptr, OPT_METRICS_FILE},
+        {"trace-file",   required_argument, nullptr, OPT_TRACE_FILE},
+        {"cache-dir",    required_argument, nullptr, OPT_CACHE_DIR},
+        {"make-delta",   required_argument, nullptr, OPT_MAKE_DELTA},
+        {"check-nstatus", no_argument,      nullptr, OPT_CHECK_NSTATUS},
+        {"help",         no_argument,       nullptr, 'h'},
+        {nullptr,        0,                 nullptr, 0}
+    };
+    std::string sysfs_root = DEFAULT_SYSFS_ROOT;
+    std::string procfs_root = DEFAULT_PROCFS_ROOT;
+    int opt;
+
+    while ((opt = ::getopt_long(argc, argv, "k:vmnd:h", long_options, nullptr)) != -1)
+    {
+        switch (opt)
+        {
+            case 'k':
+                if (std::strcmp(optarg, "cpu") == 0)
+                {
+                    transfer_kernel = TransferKernel::CPU;
+                }
+                else if (std::strcmp(optarg, "spi") == 0)
+                {
+                    transfer_kernel = TransferKernel::SPI;
+                }
+                else if (std::strcmp(optarg, "table") == 0)
+                {
+                    transfer_kernel = TransferKernel::TABLE;
+                }
+                else
+                {
+                    MSG("Unknown transfer kernel: " << optarg);
+                    return false;
+                }
+                break;
+
+            case 'v':
+                run_mode = RunMode::VERIFY;
+                break;
+
+            case 'm':
+                run_mode = RunMode::MONITOR;
+                break;
+
+            case 'n':
+                run_mode = RunMode::DRY_RUN;
+                break;
+
+            case 'd':
+                firmware_dir = optarg;
+                if (!firmware_dir.empty() && (firmware_dir.back() != '/'))
+                {
+                    firmware_dir += '/';
+                }
+                break;
+
+            case OPT_PLATFORM:
+                platform_name = optarg;
+                break;
+
+            case OPT_TUNING_FILE:
+                tuning_file = optarg;
+                break;
+
+            case OPT_STEER_CPU:
+            {
+                char *end;
+                steer_cpu = std::strtol(optarg, &end, 10);
+                if ((*end != '\0') || (steer_cpu < 0) || (steer_cpu >= ::get_nprocs_conf()))
+                {
+                    MSG("Invalid CPU: " << optarg);
+                    return false;
+                }
+                break;
+            }
+
+            case OPT_SYSFS_ROOT:
+                sysfs_root = optarg;
+                break;
+
+            case OPT_PROCFS_ROOT:
+                procfs_root = optarg;
+                break;
+
+            case OPT_PROGRESS:
+                show_progress = true;
+                break;
+
+            case OPT_HISTORY:
+                run_mode = RunMode::HISTORY;
+                break;
+
+            case OPT_METRICS_FILE:
+                metrics_file = optarg;
+                break;
+
+            case OPT_TRACE_FILE:
+                trace_file = optarg;
+                break;
+
+            case OPT_CACHE_DIR:
+                cache_dir = optarg;
+                if (!cache_dir.empty() && (cache_dir.back() != '/'))
+                {
+                    cache_dir += '/';
+                }
+                break;
+
+            case OPT_MAKE_DELTA:
+                run_mode = RunMode::MAKE_DELTA;
+                delta_base_file = optarg;
+                break;
+
+            case OPT_CHECK_NSTATUS:
+                check_nstatus = true;
+                break;
+
+            case OPT_LOCK_FILE:
+                lock_file = optarg;
+                break;
+
+            case OPT_STATE_DIR:
+                state_dir = optarg;
+                if (!state_dir.empty() && (state_dir.back() != '/'))
+                {
+                    state_dir += '/';
+                }
+                break;
+
+            default:
+                return false;
+        }
+    }
+
+    cpu_steering.set_roots(sysfs_root, procfs_root);
+
+    // Any extra image files are added to the verification corpus
+    while ((run_mode == RunMode::VERIFY) && (optind < argc))
+    {
+        verify_files.push_back(argv[optind++]);
+    }
+
+    // Making a delta needs the target image
+    if (run_mode == RunMode::MAKE_DELTA)
+    {
+        if (optind == argc)
+        {
+            return false;
+        }
+        delta_target_file = argv[optind++];
+    }
+    return (optind == argc);
 }
 
 //----------------------------------------------------------------------------
@@ -137,7 +690,7 @@ int main(void)
 void _open_and_setup_gpio()
 {
     // Get a pointer to the GPIO registers
-    gpio_port = reinterpret_cast<uint32_t *>(_mmap_bcm_register_base(GPIO_REGISTER_BASE));
+    gpio_port = reinterpret_cast<uint32_t *>(mmap_bcm_register_base(GPIO_REGISTER_BASE));
     if (gpio_port)
     {
         // Set the set/clr registers pointers
@@ -155,14 +708,12 @@ void _open_and_setup_gpio()
         _init_gpio_pin(BOARD_REV_GPIO_PIN_2, false);
 
         // Set the initial state of each pin
+        MmioGpio gpio = {gpio_set_reg, gpio_clr_reg};
 #if MELBINST_PI_HAT == 0
         SET_GPIO_PIN(FPGA2_NCE_GPIO_PIN);
 #endif
-        CLR_GPIO_PIN(DCLK_GPIO_PIN);
-        CLR_GPIO_PIN(DATA0_GPIO_PIN);
-        CLR_GPIO_PIN(NCONFIG_GPIO_PIN);
-        std::this_thread::sleep_for(std::chrono::milliseconds(1));  
-        MSG("GPIO open and setup");
+        gpio.clr_pins(safe_state_clr_pins);
+        nconfig_time = std::chrono::steady_clock::now();
     }
     else
     {
@@ -171,41 +722,13 @@ void _open_and_setup_gpio()
     }
 }
 
-//----------------------------------------------------------------------------
-// _mmap_bcm_register_base
-//----------------------------------------------------------------------------
-void *_mmap_bcm_register_base(off_t register_base)
-{
-    uint32_t *addr = nullptr;
-    int mem_fd;
-
-    // Open the memory device
-    mem_fd = ::open(MEM_DEV_NAME, O_RDWR|O_SYNC);
-    if (mem_fd < 0)
-    {
-        // Error opening the device
-        return nullptr;
-    }
-
-    // Map the register base
-    addr = reinterpret_cast<uint32_t *>(::mmap(NULL, PAGE_SIZE, (PROT_READ|PROT_WRITE),
-                                MAP_SHARED, mem_fd,
-                                (BCM2711_PI4_PERIPHERAL_BASE + register_base)));
-    ::close(mem_fd);
-
-    // Was the map successful?    
-    if (addr == MAP_FAILED)
-    {
-        // Error mapping the register base
-        return nullptr;
-    }
-    return addr;
-}
-
 //----------------------------------------------------------------------------
 // _init_gpio_pin
+// An input keeps its pull unless a pull-up is requested. The board rev
+// pins rely on their default pulls (pull-down on the BCM2711), so an
+// unfitted strap reads as 0.
 //----------------------------------------------------------------------------
-void _init_gpio_pin(int pin, bool output) 
+void _init_gpio_pin(int pin, bool output, bool pull_up)
 {
     // Set as an output or input pin
     if (output)
@@ -215,68 +738,59 @@ void _init_gpio_pin(int pin, bool output)
     }
     else
     {
-        // Set the pin as an input with pull-up
+        // Set the pin as an input
         *(gpio_port + (pin / 10)) &= ~(7 << ((pin % 10) * 3));
-        uint32_t pull_reg_offset = (GPIO_PULL_BASE_OFFSET / sizeof(uint32_t)) + ((pin / 16) * 4);
-        uint32_t pull_bits_offset = (pin % 16) * 2;
-        *(gpio_port + pull_reg_offset) &= ~(3 << pull_bits_offset);
-        *(gpio_port + pull_reg_offset) |= (1 << pull_bits_offset);
+        if (pull_up)
+        {
+            // Each GPIO_PUP_PDN_CNTRL_REGn holds the pulls of 16 pins
+            uint32_t pull_reg_offset = (GPIO_PULL_BASE_OFFSET / sizeof(uint32_t)) + (pin / 16);
+            uint32_t pull_bits_offset = (pin % 16) * 2;
+            *(gpio_port + pull_reg_offset) &= ~(3 << pull_bits_offset);
+            *(gpio_port + pull_reg_offset) |= (1 << pull_bits_offset);
+        }
     }
 }
 
 //----------------------------------------------------------------------------
-// _config_fpga1
+// _init_status_pins
+// The CONF_DONE and nSTATUS pins are provisional, so they are left alone
+// unless the configuration is checked (monitor mode or A/B slots) or the
+// nSTATUS wait is selected. Both are open-drain, so they are pulled up.
 //----------------------------------------------------------------------------
-void _config_fpga1()
+void _init_status_pins()
 {
-    // Open the FPGA1 binary image
-    std::ifstream file (FPGA_BINARY_FILE_PATH(FPGA1_BINARY_FILENAME), (std::ios::in|std::ios::binary|std::ios::ate));
-    if (!file.is_open())
-    {
-        MSG("Could not open the FPGA1 binary file");
-        return;           
-    }
-
-    // Allocate memory to read the image into
-    // Note: due to the file size of ~200kB, the entire file is read into RAM
-    auto file_size = file.tellg();
-    binary_data = new uint8_t[file_size];
-    if (!binary_data)
+    for (uint i=0; i<NUM_FPGAS; i++)
     {
-        MSG("Could not allocate memory to read the FPGA1 binary file");
-        return;          
+        _init_gpio_pin(conf_done_pins[i], false, true);
+        _init_gpio_pin(nstatus_pins[i], false, true);
     }
-    binary_data_size = file_size;
-    MSG("FPGA1 binary file size: "<< binary_data_size << " bytes");
-
-    // Read the binary image into memory
-    file.seekg (0, std::ios::beg);
-    file.read (reinterpret_cast<char *>(binary_data), file_size);
-    file.close();
+}
 
-    // Set nCONFIG high to put the FPGAs into config mode, and wait 1ms
+//----------------------------------------------------------------------------
+// _raise_nconfig
+// Holds nCONFIG low (reset) for 1ms since the GPIO was set up, then sets it
+// high to put the FPGAs into config mode. Called during startup so the
+// reset and config mode waits overlap loading the images.
+//----------------------------------------------------------------------------
+void _raise_nconfig()
+{
+    std::this_thread::sleep_until(nconfig_time + std::chrono::microseconds(NCONFIG_RESET_US));
     SET_GPIO_PIN(NCONFIG_GPIO_PIN);
-    std::this_thread::sleep_for(std::chrono::milliseconds(1));
-
-    // Transfer the data
-    auto start = std::chrono::system_clock::now();
-    _transfer_data();
-    auto end = std::chrono::system_clock::now();
-    std::cout << "FPGA1 configured, " << std::chrono::duration_cast<std::chrono::milliseconds>(end - start).count() << "ms" << std::endl;
+    nconfig_time = std::chrono::steady_clock::now();
+    nconfig_raised = true;
 }
 
-#if MELBINST_PI_HAT == 0
 //----------------------------------------------------------------------------
-// _config_fpga2
+// _load_binary_file
 //----------------------------------------------------------------------------
-void _config_fpga2()
+bool _load_binary_file(const char *filename, const char *name)
 {
-    // Open the FPGA2 binary image
-    std::ifstream file (FPGA_BINARY_FILE_PATH(FPGA2_BINARY_FILENAME), (std::ios::in|std::ios::binary|std::ios::ate));
+    // Open the binary image
+    std::ifstream file (firmware_dir + filename, (std::ios::in|std::ios::binary|std::ios::ate));
     if (!file.is_open())
     {
-        MSG("Could not open the FPGA2 binary file");
-        return;           
+        MSG("Could not open the " << name << " binary file");
+        return false;
     }
 
     // Allocate memory to read the image into
@@ -285,141 +799,1317 @@ void _config_fpga2()
     binary_data = new uint8_t[file_size];
     if (!binary_data)
     {
-        MSG("Could not allocate memory to read the FPGA2 binary file");
-        return;          
+        MSG("Could not allocate memory to read the " << name << " binary file");
+        return false;
     }
     binary_data_size = file_size;
-    MSG("FPGA2 binary file size: "<< binary_data_size << " bytes");
+    MSG(name << " binary file size: "<< binary_data_size << " bytes");
 
     // Read the binary image into memory
     file.seekg (0, std::ios::beg);
     file.read (reinterpret_cast<char *>(binary_data), file_size);
     file.close();
-
-    // Set FPGA2 nCE low to select the second FPGA, and wait 1ms
-    CLR_GPIO_PIN(FPGA2_NCE_GPIO_PIN);
-    std::this_thread::sleep_for(std::chrono::milliseconds(1));
-
-    // Transfer the data
-    auto start = std::chrono::system_clock::now();
-    _transfer_data();
-    auto end = std::chrono::system_clock::now();
-    std::cout << "FPGA2 configured, " << std::chrono::duration_cast<std::chrono::milliseconds>(end - start).count() << "ms" << std::endl;
+    return true;
 }
-#endif
 
 //----------------------------------------------------------------------------
-// _transfer_data
+// _load_fpga_images
+// Loads the image of each FPGA, and if it has A/B slots the fallback image,
+// so that falling back costs only the transfer. The images are kept for the
+// whole run, and locked in RAM when monitoring.
 //----------------------------------------------------------------------------
-void _transfer_data()
+void _load_fpga_images()
 {
-    uint8_t *data = binary_data;
-
-    // Do until all file data has been processed, or the program exited
-    while (!exit_flag && (data < (binary_data + binary_data_size)))
+    image_slots.load_record(state_dir + SLOT_RECORD_FILENAME);
+    check_conf_done = (run_mode == RunMode::MONITOR);
+    for (uint i=0; i<NUM_FPGAS; i++)
     {
-        uint8_t byte = *data++;
-
-        // Send each bit in the byte, LS bit first
-        for (int i=0; i<8; i++)
+        TraceSlice slice(trace, TraceTrack::LOADER, "load image");
+        slice.args = trace_arg("fpga", (i + 1));
+        if (!image_slots.select(i, firmware_dir, fpga_filenames[i], fpga_images[i], fallback_images[i]))
         {
-            // Get the bit and either set/clear the GPIO pin
-            uint8_t bit = (byte >> i) & 0x01;
-            if (bit)
-            {
-                SET_GPIO_PIN(DATA0_GPIO_PIN);
-            }
-            else
-            {
-                CLR_GPIO_PIN(DATA0_GPIO_PIN);
-            }
-
-            // Set the DCLK rising edge
-            SET_DCLK_PIN();
-
-            // Set the DCLK falling edge
-            CLR_DCLK_PIN();
+            continue;
+        }
+        slice.args += "," + trace_arg("file", fpga_images[i].filename) + "," + trace_arg("bytes", fpga_images[i].data.size());
+        if (!fallback_images[i].data.empty())
+        {
+            MSG("FPGA" << (i + 1) << " image: " << _image_name(fpga_images[i]) << ", fallback " << _image_name(fallback_images[i]));
+            check_conf_done = true;
+        }
+        if (run_mode == RunMode::MONITOR)
+        {
+            _pin_image(i, fpga_images[i]);
+            _pin_image(i, fallback_images[i]);
         }
     }
+}
 
-    // We need to keep clocking DCLK once the FPGA has accepted the data and set
-    // CONF_DONE high. It needs "at least" 2 falling DCLK edges after setting CONF_DONE, 
-    // but to be safe lets send 10
-    int dclk_count = 10;
-    while (!exit_flag && dclk_count--)
-    {
-        // Set the DCLK rising edge
-        SET_DCLK_PIN();
+//----------------------------------------------------------------------------
+// _get_fpga_image
+//----------------------------------------------------------------------------
+bool _get_fpga_image(uint fpga, const char *name)
+{
+    SlotImage &image = fpga_images[fpga];
 
-        // Set the DCLK falling edge
-        CLR_DCLK_PIN();
+    if (image.data.empty())
+    {
+        MSG("Could not open the " << name << " binary file");
+        return false;
     }
+    binary_data = image.data.data();
+    binary_data_size = image.data.size();
+    MSG(name << " binary file: " << _image_name(image) << ", " << binary_data_size << " bytes");
+    return true;
 }
 
 //----------------------------------------------------------------------------
-// _close_gpio
+// _free_binary_file
 //----------------------------------------------------------------------------
-void _close_gpio()
+void _free_binary_file()
 {
-    // Ummap the GPIO device if open
-    if (gpio_port)
+    // Free any allocated memory, unless it is an FPGA image
+    if (binary_data && (std::find_if(std::begin(fpga_images), std::end(fpga_images),
+                                     [](const SlotImage &i){ return i.data.data() == binary_data; }) == std::end(fpga_images)))
     {
-        // Set the default GPIO values
-        CLR_GPIO_PIN(DCLK_GPIO_PIN);
-        CLR_GPIO_PIN(DATA0_GPIO_PIN);
-
-        // Unmap it
-        ::munmap(gpio_port, PAGE_SIZE);
-        gpio_port = nullptr;
-        MSG("GPIO port closed");
+        // Free it
+        delete [] binary_data;
     }
+    binary_data = 0;
+    binary_data_size = 0;
 }
 
 //----------------------------------------------------------------------------
-// _print_app_info
+// _pin_image
 //----------------------------------------------------------------------------
-void _print_app_info()
+void _pin_image(uint fpga, const SlotImage &image)
 {
-    MSG("FPGA CONFIG - Copyright (c) 2023-2024 Melbourne Instruments, Australia");
-    MSG("Version " << FPGA_CONFIG_MAJOR_VERSION << "." << FPGA_CONFIG_MINOR_VERSION << "." << FPGA_CONFIG_PATCH_VERSION);
-    MSG("");
+    if (!image.data.empty() && (::mlock(image.data.data(), image.data.size()) != 0))
+    {
+        MSG("Could not lock the FPGA" << (fpga + 1) << " image in RAM");
+    }
 }
 
 //----------------------------------------------------------------------------
-// _print_board_rev_info
+// _free_fpga_images
 //----------------------------------------------------------------------------
-void _print_board_rev_info()
+void _free_fpga_images()
 {
-    uint rev = RD_GPIO_PIN(BOARD_REV_GPIO_PIN_1) + (RD_GPIO_PIN(BOARD_REV_GPIO_PIN_2) << 1);
-    switch(rev)
+    for (uint i=0; i<NUM_FPGAS; i++)
     {
-        case 0:
-            MSG("Detected Board Rev D");
-            break;
-        
-        case 1:
-            MSG("Detected Board Rev B");
-            break;
-
-        case 2:
-            MSG("Detected Board Rev C");
-            break;
+        fpga_images[i] = {};
+        fallback_images[i] = {};
+    }
+}
 
-        case 3:
-            MSG("Detected Board Rev A");
-            break;
+//----------------------------------------------------------------------------
+// _image_filenames
+// Returns the files each FPGA image can be loaded from: the plain image,
+// its A/B slots, and a delta of each.
+//----------------------------------------------------------------------------
+std::vector<std::string> _image_filenames()
+{
+    std::vector<std::string> filenames;
 
-        default:
-            break;
+    for (const char *filename : fpga_filenames)
+    {
+        for (const std::string &name : {std::string(filename), slot_filename(filename, 'a'), slot_filename(filename, 'b')})
+        {
+            filenames.insert(filenames.end(), {name, (name + DELTA_SUFFIX)});
+        }
     }
+    return filenames;
+}
+
+//----------------------------------------------------------------------------
+// _hash_images
+// Hashes the name, size, mtime, device and inode of each FPGA image file,
+// to identify the images a configuration is for without reading them, so
+// the boot path does not read the images twice before the load deadline.
+// An image replaced by a rename gets a new inode, so copying a file with
+// its mtime preserved is still caught, and the device keeps files from
+// different filesystems with the same inode apart.
+//----------------------------------------------------------------------------
+uint64_t _hash_images()
+{
+    uint64_t hash = FNV_OFFSET_BASIS;
+
+    for (const std::string &name : _image_filenames())
+    {
+        struct stat st;
+        hash = hash_bytes(name.data(), name.size(), hash);
+        if (::stat((firmware_dir + name).c_str(), &st) == 0)
+        {
+            const uint64_t id[] = { static_cast<uint64_t>(st.st_size), static_cast<uint64_t>(st.st_mtim.tv_sec),
+                                    static_cast<uint64_t>(st.st_mtim.tv_nsec), static_cast<uint64_t>(st.st_dev),
+                                    static_cast<uint64_t>(st.st_ino) };
+            hash = hash_bytes(id, sizeof(id), hash);
+        }
+    }
+    return hash;
+}
+
+//----------------------------------------------------------------------------
+// _refresh_images
+// Called from the image watcher thread when an image has been replaced.
+// The new images are loaded, checked and pinned in the background, and
+// handed over to the monitor for its next reconfiguration.
+//----------------------------------------------------------------------------
+void _refresh_images()
+{
+    SlotImage images[NUM_FPGAS];
+    SlotImage fallbacks[NUM_FPGAS];
+    ImageSlots slots;
+    uint64_t current_key;
+
+    // Select with a copy of the slot record, as the monitor updates it
+    {
+        std::lock_guard<std::mutex> lock(images_mutex);
+        slots = image_slots;
+        current_key = images_refreshed ? refreshed_key : images_key;
+    }
+    TraceSlice slice(trace, TraceTrack::WATCHER, "refresh images");
+    uint64_t key = _hash_images();
+    if (key == current_key)
+    {
+        return;
+    }
+
+    // Load, check and pin the images
+    for (uint i=0; i<NUM_FPGAS; i++)
+    {
+        if (!slots.select(i, firmware_dir, fpga_filenames[i], images[i], fallbacks[i]) ||
+            !_check_image(images[i]) || (!fallbacks[i].data.empty() && !_check_image(fallbacks[i])))
+        {
+            MSG("FPGA" << (i + 1) << " image refresh FAILED, keeping the resident images");
+            return;
+        }
+        _pin_image(i, images[i]);
+        _pin_image(i, fallbacks[i]);
+    }
+
+    // Hand them over to the monitor
+    {
+        std::lock_guard<std::mutex> lock(images_mutex);
+        for (uint i=0; i<NUM_FPGAS; i++)
+        {
+            refreshed_images[i] = std::move(images[i]);
+            refreshed_fallbacks[i] = std::move(fallbacks[i]);
+            MSG("FPGA" << (i + 1) << " image refreshed: " << _image_name(refreshed_images[i]) << ", " <<
+                refreshed_images[i].data.size() << " bytes");
+        }
+        refreshed_key = key;
+        images_refreshed = true;
+    }
+}
+
+//----------------------------------------------------------------------------
+// _check_image
+// The file must still be the size that was read, in case it was replaced
+// again while being loaded. An image built from a delta is checked against
+// its hash instead, which waits for it to be built.
+//----------------------------------------------------------------------------
+bool _check_image(const SlotImage &image)
+{
+    struct stat st;
+    if (image.delta)
+    {
+        return image.delta->finish();
+    }
+    return !image.data.empty() && (::stat((firmware_dir + image.filename).c_str(), &st) == 0) &&
+           (static_cast<size_t>(st.st_size) == image.data.size());
+}
+
+//----------------------------------------------------------------------------
+// _adopt_refreshed_images
+//----------------------------------------------------------------------------
+void _adopt_refreshed_images()
+{
+    std::lock_guard<std::mutex> lock(images_mutex);
+    if (images_refreshed)
+    {
+        for (uint i=0; i<NUM_FPGAS; i++)
+        {
+            fpga_images[i] = std::move(refreshed_images[i]);
+            fallback_images[i] = std::move(refreshed_fallbacks[i]);
+            refreshed_images[i] = {};
+            refreshed_fallbacks[i] = {};
+        }
+        images_key = refreshed_key;
+        images_refreshed = false;
+    }
+}
+
+//----------------------------------------------------------------------------
+// _config_fpgas
+// If an FPGA with A/B slots does not configure, the chain is reset and
+// configured again with its fallback image. The slot record is only
+// updated once the chain has configured, so an image is not marked bad if
+// its fallback fails too.
+//----------------------------------------------------------------------------
+bool _config_fpgas()
+{
+    SlotImage failed_images[NUM_FPGAS];
+    auto start = std::chrono::system_clock::now();
+    bool fell_back = false;
+    uint num_retries = 0;
+
+    // Configure the FPGAs, falling back on failure, and retrying once if a
+    // phase overran its deadline
+    while (true)
+    {
+        int failed = _config_fpga_chain();
+        if (exit_flag)
+        {
+            if (!_retry_overrun(num_retries))
+            {
+                return false;
+            }
+            continue;
+        }
+        if (failed < 0)
+        {
+            break;
+        }
+        if (fallback_images[failed].data.empty())
+        {
+            MSG("FPGA" << (failed + 1) << " configuration FAILED, no fallback image");
+            return false;
+        }
+        MSG("FPGA" << (failed + 1) << " " << _image_name(fpga_images[failed]) << " did not configure, falling back to " <<
+            _image_name(fallback_images[failed]));
+        failed_images[failed] = std::move(fpga_images[failed]);
+        fpga_images[failed] = std::move(fallback_images[failed]);
+        fallback_images[failed] = {};
+        fell_back = true;
+        trace.instant(TraceTrack::CONTROL, "fallback", trace_arg("fpga", (failed + 1)) + "," + trace_arg("file", fpga_images[failed].filename));
+        history_record.num_fallbacks++;
+
+        // Reset the FPGAs, with FPGA2 deselected
+        _set_safe_pin_state();
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    if (fell_back)
+    {
+        auto end = std::chrono::system_clock::now();
+        MSG("FPGAs configured with the fallback images, " << std::chrono::duration_cast<std::chrono::milliseconds>(end - start).count() << "ms");
+    }
+
+    // Update the slot record if any FPGA has slots
+    if (std::any_of(std::begin(fpga_images), std::end(fpga_images), [](const SlotImage &i){ return i.slot != 0; }))
+    {
+        std::lock_guard<std::mutex> lock(images_mutex);
+        for (uint i=0; i<NUM_FPGAS; i++)
+        {
+            image_slots.record_config(i, fpga_images[i]);
+            if (!failed_images[i].data.empty())
+            {
+                image_slots.record_failure(i, failed_images[i]);
+            }
+        }
+        if (!image_slots.save_record(state_dir + SLOT_RECORD_FILENAME))
+        {
+            MSG("Could not save the slot record in " << state_dir);
+        }
+    }
+    return true;
+}
+
+//----------------------------------------------------------------------------
+// _retry_overrun
+// If the chain was cancelled by a phase overrunning its deadline, resets
+// the FPGAs so the chain can be configured again. Loading the images is
+// not retried, nor is an abort.
+//----------------------------------------------------------------------------
+bool _retry_overrun(uint &num_retries)
+{
+    WatchdogPhase phase = watchdog.expired();
+    if ((phase == WatchdogPhase::NONE) || (phase == WatchdogPhase::LOAD) || (num_retries >= WATCHDOG_NUM_RETRIES) ||
+        abort_control.aborted())
+    {
+        return false;
+    }
+    MSG("Retrying the configuration after the " << watchdog_phase_name(phase) << " timeout");
+    num_retries++;
+    history_record.num_retries++;
+    trace.instant(TraceTrack::CONTROL, "watchdog retry", trace_arg("phase", watchdog_phase_name(phase)) + "," + trace_arg("retry", num_retries));
+    watchdog.clear();
+
+    // Clear the cancel of the watchdog, unless a signal has aborted the app
+    // meanwhile (the abort is set before the exit flag, so it is not missed)
+    exit_flag = false;
+    if (abort_control.aborted())
+    {
+        exit_flag = true;
+        return false;
+    }
+
+    // Reset the FPGAs, with FPGA2 deselected
+    _set_safe_pin_state();
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    return true;
+}
+
+//----------------------------------------------------------------------------
+// _config_fpga_chain
+// Returns the first FPGA that did not configure, or -1 if all did.
+//----------------------------------------------------------------------------
+int _config_fpga_chain()
+{
+    if (!_config_fpga1())
+    {
+        return 0;
+    }
+#if MELBINST_PI_HAT == 0
+    _free_binary_file();
+    if (!_config_fpga2())
+    {
+        return 1;
+    }
+#endif
+    _free_binary_file();
+    return -1;
+}
+
+//----------------------------------------------------------------------------
+// _config_fpga1
+//----------------------------------------------------------------------------
+bool _config_fpga1()
+{
+    // Get the FPGA1 binary image, taking the FPGAs out of config mode if it
+    // was entered during startup
+    if (!_get_fpga_image(0, "FPGA1"))
+    {
+        if (nconfig_raised)
+        {
+            CLR_GPIO_PIN(NCONFIG_GPIO_PIN);
+            nconfig_raised = false;
+        }
+        return false;
+    }
+
+    // Set nCONFIG high to put the FPGAs into config mode, unless it was set
+    // during startup, and wait for the config time of the protocol and, if
+    // selected, until FPGA1 releases nSTATUS
+    uint64_t wait_start = TraceRecorder::now_ns();
+    watchdog.arm(WatchdogPhase::NCONFIG_WAIT);
+    if (!nconfig_raised)
+    {
+        SET_GPIO_PIN(NCONFIG_GPIO_PIN);
+        nconfig_time = std::chrono::steady_clock::now();
+    }
+    nconfig_raised = false;
+    std::this_thread::sleep_until(nconfig_time + std::chrono::microseconds(ConfigProtocol::CONFIG_WAIT_US));
+    while (check_nstatus && !RD_GPIO_PIN(nstatus_pins[0]) && !exit_flag)
+    {
+        std::this_thread::yield();
+    }
+    watchdog.disarm();
+    trace.slice(TraceTrack::CLOCKER, "nCONFIG", wait_start, TraceRecorder::now_ns());
+    if (exit_flag)
+    {
+        MSG("FPGA1 configuration " << ((watchdog.expired() != WatchdogPhase::NONE) ? "timed out" : "aborted"));
+        return false;
+    }
+
+    // Transfer the data
+    ResourceUsage usage_start = sample_usage(true);
+    auto start = std::chrono::system_clock::now();
+    _transfer_data(1);
+    auto end = std::chrono::system_clock::now();
+    _record_transfer(0, (end - start), usage_start);
+    if (exit_flag)
+    {
+        MSG("FPGA1 configuration " << ((watchdog.expired() != WatchdogPhase::NONE) ? "timed out" : "aborted"));
+        return false;
+    }
+    if (!_finish_delta(0))
+    {
+        return false;
+    }
+    if (check_conf_done && !_fpga_configured(0))
+    {
+        MSG("FPGA1 " << ConfigProtocol::DONE_PIN << " did not go high");
+        return false;
+    }
+    std::cout << "FPGA1 configured, " << std::chrono::duration_cast<std::chrono::milliseconds>(end - start).count() << "ms" << std::endl;
+    _print_stall_stats("FPGA1");
+    _print_fault_stats("FPGA1", HISTORY_PHASE_FPGA1);
+    return true;
+}
+
+#if MELBINST_PI_HAT == 0
+//----------------------------------------------------------------------------
+// _config_fpga2
+//----------------------------------------------------------------------------
+bool _config_fpga2()
+{
+    // Get the FPGA2 binary image
+    if (!_get_fpga_image(1, "FPGA2"))
+    {
+        return false;
+    }
+
+    // Set FPGA2 nCE low to select the second FPGA, and wait 1ms
+    uint64_t wait_start = TraceRecorder::now_ns();
+    CLR_GPIO_PIN(FPGA2_NCE_GPIO_PIN);
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    trace.slice(TraceTrack::CLOCKER, "nCE", wait_start, TraceRecorder::now_ns());
+
+    // Transfer the data
+    ResourceUsage usage_start = sample_usage(true);
+    auto start = std::chrono::system_clock::now();
+    _transfer_data(2);
+    auto end = std::chrono::system_clock::now();
+    _record_transfer(1, (end - start), usage_start);
+    if (exit_flag)
+    {
+        MSG("FPGA2 configuration " << ((watchdog.expired() != WatchdogPhase::NONE) ? "timed out" : "aborted"));
+        return false;
+    }
+    if (!_finish_delta(1))
+    {
+        return false;
+    }
+    if (check_conf_done && !_fpga_configured(1))
+    {
+        MSG("FPGA2 " << ConfigProtocol::DONE_PIN << " did not go high");
+        return false;
+    }
+    std::cout << "FPGA2 configured, " << std::chrono::duration_cast<std::chrono::milliseconds>(end - start).count() << "ms" << std::endl;
+    _print_stall_stats("FPGA2");
+    _print_fault_stats("FPGA2", HISTORY_PHASE_FPGA2);
+    return true;
+}
+#endif
+
+//----------------------------------------------------------------------------
+// _fpga_configured
+// Waits briefly for CONF_DONE, which should already be high after the
+// trailing DCLKs.
+//----------------------------------------------------------------------------
+bool _fpga_configured(uint fpga)
+{
+    TraceSlice slice(trace, TraceTrack::VERIFIER, "CONF_DONE");
+    auto timeout = std::chrono::steady_clock::now() + std::chrono::microseconds(CONF_DONE_TIMEOUT_US);
+    bool configured = true;
+    watchdog.arm(WatchdogPhase::CONF_DONE_WAIT);
+    while (!RD_GPIO_PIN(conf_done_pins[fpga]))
+    {
+        if ((std::chrono::steady_clock::now() > timeout) || exit_flag)
+        {
+            configured = false;
+            break;
+        }
+    }
+    watchdog.disarm();
+    configured = configured && RD_GPIO_PIN(nstatus_pins[fpga]);
+    slice.args = trace_arg("fpga", (fpga + 1)) + "," + trace_arg("configured", configured);
+    return configured;
+}
+
+//----------------------------------------------------------------------------
+// _finish_delta
+// Waits for an image being built from a delta and checks its hash. A bad
+// image was still transferred, so it is discarded and the configuration
+// fails, falling back to the other slot if there is one.
+//----------------------------------------------------------------------------
+bool _finish_delta(uint fpga)
+{
+    SlotImage &image = fpga_images[fpga];
+
+    if (image.delta)
+    {
+        TraceSlice slice(trace, TraceTrack::VERIFIER, "delta hash");
+        bool ok = image.delta->finish();
+        image.delta.reset();
+        slice.args = trace_arg("fpga", (fpga + 1)) + "," + trace_arg("ok", ok);
+        if (!ok)
+        {
+            MSG("FPGA" << (fpga + 1) << " " << _image_name(image) << " does not match its hash");
+            image.data.clear();
+            return false;
+        }
+    }
+    return true;
+}
+
+//----------------------------------------------------------------------------
+// _image_name
+//----------------------------------------------------------------------------
+std::string _image_name(const SlotImage &image)
+{
+    return image.slot ? (std::string("slot ") + image.slot + " (" + image.filename + ")") : image.filename;
+}
+
+//----------------------------------------------------------------------------
+// _transfer_data
+//----------------------------------------------------------------------------
+void _transfer_data(uint fpga_num)
+{
+    const SlotImage &image = fpga_images[fpga_num - 1];
+    TransferProgress *progress = progress_segment.progress();
+    TraceSlice slice(trace, TraceTrack::CLOCKER, "transfer");
+    slice.args = trace_arg("fpga", fpga_num) + "," + trace_arg("bytes", binary_data_size) + "," +
+                 trace_arg("kernel", _kernel_name(transfer_kernel));
+
+#if FPGA_CONFIG_STALL_DETECTOR
+    stall_detector.reset();
+#endif
+    watchdog.arm(WatchdogPhase::TRANSFER);
+    progress->begin(fpga_num, binary_data_size);
+    if (transfer_kernel == TransferKernel::SPI)
+    {
+        // Shift the data out using the SPI peripheral, replaying the
+        // translated stream from the cache if there is one
+        SpiEngine spi_engine(spi_device);
+        uint stream_size = 0;
+        const uint8_t *stream = stream_cache.map(image.hash, _stream_profile(), stream_size);
+        stream_missed[fpga_num - 1] = !stream;
+        if (!stream && image.delta)
+        {
+            image.delta->finish();
+        }
+        spi_engine.set_progress(progress);
+        if (!(stream ? spi_engine.transfer_stream(stream, stream_size, exit_flag) :
+                       spi_engine.transfer(binary_data, binary_data_size, exit_flag)) && !exit_flag)
+        {
+            MSG("SPI transfer error");
+        }
+    }
+    else
+    {
+        // Clock the data out using the CPU, with the bit loop or the byte
+        // handler table, following an image being built from a delta
+        MmioGpio gpio = {gpio_set_reg, gpio_clr_reg};
+        CpuKernelSampler sampler = {progress, image.delta.get()};
+        if (image.delta)
+        {
+            image.delta->wait_for(TRANSFER_CHUNK_SIZE, exit_flag);
+        }
+#if FPGA_CONFIG_STALL_DETECTOR
+        stall_detector.start();
+#endif
+        if (transfer_kernel == TransferKernel::TABLE)
+        {
+            transfer_data_table(gpio, binary_data, binary_data_size, exit_flag, sampler);
+        }
+        else
+        {
+            transfer_data(gpio, binary_data, binary_data_size, exit_flag, sampler);
+        }
+    }
+    watchdog.disarm();
+    progress->end(exit_flag);
+    progress_reporter.end_line();
+
+    // Show the stalls as slices within the transfer
+#if FPGA_CONFIG_STALL_DETECTOR
+    if (trace.enabled())
+    {
+        for (const Stall &stall : stall_detector.stalls())
+        {
+            trace.slice(TraceTrack::CLOCKER, "stall", stall.start_ns, (stall.start_ns + stall.duration_ns),
+                        trace_arg("us", (stall.duration_ns / 1000)));
+        }
+    }
+#endif
+}
+
+//----------------------------------------------------------------------------
+// _print_stall_stats
+//----------------------------------------------------------------------------
+void _print_stall_stats([[maybe_unused]] const char *name)
+{
+#if FPGA_CONFIG_STALL_DETECTOR
+    StallStats stats = stall_detector.stats();
+    if (stats.num_samples > 1)
+    {
+        std::string histogram;
+        for (uint i=0; i<STALL_HISTOGRAM_BUCKETS; i++)
+        {
+            if (stats.histogram[i])
+            {
+                histogram += " " + std::string((i < (STALL_HISTOGRAM_BUCKETS - 1)) ? "<" : ">=") +
+                             std::to_string(2 << ((i < (STALL_HISTOGRAM_BUCKETS - 1)) ? i : (i - 1))) +
+                             ":" + std::to_string(stats.histogram[i]);
+            }
+        }
+        MSG(name << " stalls: " << stats.num_stalls << ", total " << (stats.total_stall_ns / 1000) << "us, worst " <<
+            (stats.worst_stall_ns / 1000) << "us (chunk median " << (stats.median_gap_ns / 1000) << "us)");
+        MSG(name << " chunk gaps (us):" << histogram);
+    }
+#endif
+}
+
+//----------------------------------------------------------------------------
+// _print_fault_stats
+// Any page fault in the transfer window stalls the transfer.
+//----------------------------------------------------------------------------
+void _print_fault_stats(const char *name, HistoryPhase phase)
+{
+    const ResourceUsage &usage = history_record.usage[phase];
+    MSG(name << " transfer: " << usage.major_faults << " major and " << usage.minor_faults << " minor page faults, " <<
+        usage.vol_switches << " voluntary and " << usage.invol_switches << " involuntary context switches, peak RSS " <<
+        usage.max_rss_kb << "kB");
+}
+
+//----------------------------------------------------------------------------
+// _begin_history_record
+//----------------------------------------------------------------------------
+void _begin_history_record()
+{
+    history_record = {};
+    history_start = std::chrono::steady_clock::now();
+    history_usage_start = sample_usage(false);
+}
+
+//----------------------------------------------------------------------------
+// _record_transfer
+// Called after each transfer, on the transfer thread. If the chain is
+// configured again after a fallback the last transfer time and usage are
+// kept, and the stalls add up.
+//----------------------------------------------------------------------------
+void _record_transfer(uint fpga, std::chrono::system_clock::duration time, const ResourceUsage &usage_start)
+{
+    history_record.usage[HISTORY_PHASE_FPGA1 + fpga] = usage_since(usage_start, true);
+    history_record.phase_us[HISTORY_PHASE_FPGA1 + fpga] = std::chrono::duration_cast<std::chrono::microseconds>(time).count();
+#if FPGA_CONFIG_STALL_DETECTOR
+    StallStats stats = stall_detector.stats();
+    history_record.num_stalls += stats.num_stalls;
+    history_record.worst_stall_us = std::max(history_record.worst_stall_us, static_cast<uint32_t>(stats.worst_stall_ns / 1000));
+#endif
+}
+
+//----------------------------------------------------------------------------
+// _append_history_record
+//----------------------------------------------------------------------------
+void _append_history_record(int result)
+{
+    history_record.timestamp = std::time(nullptr);
+    read_boot_id(history_record.boot_id);
+    for (uint i=0; i<NUM_FPGAS; i++)
+    {
+        history_record.image_hashes[i] = fpga_images[i].hash;
+    }
+    std::strncpy(history_record.kernel, _kernel_name(transfer_kernel), (sizeof(history_record.kernel) - 1));
+    history_record.board_rev = _board_rev();
+    history_record.result = result;
+    history_record.phase_us[HISTORY_PHASE_TOTAL] = _elapsed_us(history_start);
+    history_record.usage[HISTORY_PHASE_TOTAL] = usage_since(history_usage_start, false);
+    TraceSlice slice(trace, TraceTrack::CONTROL, "append history");
+    if (!history.append(history_record))
+    {
+        DEBUG_MSG("Could not append to the configuration history");
+    }
+}
+
+//----------------------------------------------------------------------------
+// _exit_code
+// The exit code of the phase that timed out, otherwise of the abort or the
+// configuration result.
+//----------------------------------------------------------------------------
+int _exit_code(bool ok)
+{
+    if (watchdog.expired() != WatchdogPhase::NONE)
+    {
+        return watchdog_exit_code(watchdog.expired());
+    }
+    return exit_flag ? ABORT_EXIT_CODE : (ok ? 0 : 1);
+}
+
+//----------------------------------------------------------------------------
+// _elapsed_us
+//----------------------------------------------------------------------------
+uint32_t _elapsed_us(std::chrono::steady_clock::time_point start)
+{
+    return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+}
+
+//----------------------------------------------------------------------------
+// _show_history
+//----------------------------------------------------------------------------
+int _show_history()
+{
+    History history;
+
+    if (!history.open((state_dir + HISTORY_FILENAME), true))
+    {
+        MSG("No configuration history in " << state_dir);
+        return 1;
+    }
+    print_history(history.records());
+    return 0;
+}
+
+//----------------------------------------------------------------------------
+// _make_delta
+// Writes the delta of the target image against the base image next to the
+// target, e.g. synthia_fpga_1.b.rbf.delta. The base is named without its
+// directory, as it must be in the firmware directory with the delta.
+//----------------------------------------------------------------------------
+int _make_delta()
+{
+    std::ifstream base_file(delta_base_file, (std::ios::in|std::ios::binary));
+    std::ifstream target_file(delta_target_file, (std::ios::in|std::ios::binary));
+    std::string base_filename = delta_base_file.substr(delta_base_file.find_last_of('/') + 1);
+    std::string delta_file = delta_target_file + DELTA_SUFFIX;
+
+    if (!base_file.is_open() || !target_file.is_open())
+    {
+        MSG("Could not open the base or target image");
+        return 1;
+    }
+    if (base_filename.size() >= DELTA_BASE_NAME_SIZE)
+    {
+        MSG("Base image name too long: " << base_filename);
+        return 1;
+    }
+    std::vector<uint8_t> base((std::istreambuf_iterator<char>(base_file)), {});
+    std::vector<uint8_t> target((std::istreambuf_iterator<char>(target_file)), {});
+    std::vector<uint8_t> delta;
+    if (target.empty())
+    {
+        MSG("Empty target image: " << delta_target_file);
+        return 1;
+    }
+    make_delta(base, base_filename, target, delta);
+
+    // Write it to a temporary file and rename it into place, so the image
+    // watcher never sees a partial delta
+    std::string tmp_file = delta_file + ".tmp";
+    std::ofstream file(tmp_file, (std::ios::out|std::ios::binary|std::ios::trunc));
+    file.write(reinterpret_cast<const char *>(delta.data()), delta.size());
+    file.close();
+    if (!file || (std::rename(tmp_file.c_str(), delta_file.c_str()) != 0))
+    {
+        std::remove(tmp_file.c_str());
+        MSG("Could not write " << delta_file);
+        return 1;
+    }
+    MSG(delta_file << ": " << delta.size() << " bytes, " << std::fixed << std::setprecision(1) <<
+        ((delta.size() * 100.0) / target.size()) << "% of " << delta_target_file);
+    return 0;
+}
+
+//----------------------------------------------------------------------------
+// _notify_ready
+// Sends READY=1 to systemd if run as a notify service. This is the sd_notify
+// protocol, without linking libsystemd.
+//----------------------------------------------------------------------------
+void _notify_ready()
+{
+    const char *socket_path = std::getenv("NOTIFY_SOCKET");
+    struct sockaddr_un addr = {};
+    const char ready[] = "READY=1";
+
+    if (!socket_path || ((socket_path[0] != '/') && (socket_path[0] != '@')) ||
+        (std::strlen(socket_path) >= sizeof(addr.sun_path)))
+    {
+        return;
+    }
+    int fd = ::socket(AF_UNIX, (SOCK_DGRAM|SOCK_CLOEXEC), 0);
+    if (fd < 0)
+    {
+        return;
+    }
+
+    // A leading '@' is an abstract socket
+    addr.sun_family = AF_UNIX;
+    std::strncpy(addr.sun_path, socket_path, (sizeof(addr.sun_path) - 1));
+    if (addr.sun_path[0] == '@')
+    {
+        addr.sun_path[0] = 0;
+    }
+    socklen_t len = offsetof(struct sockaddr_un, sun_path) + std::strlen(socket_path);
+    if (::sendto(fd, ready, (sizeof(ready) - 1), MSG_NOSIGNAL, reinterpret_cast<struct sockaddr *>(&addr), len) < 0)
+    {
+        DEBUG_MSG("Could not notify systemd");
+    }
+    ::close(fd);
+}
+
+//----------------------------------------------------------------------------
+// _write_metrics
+//----------------------------------------------------------------------------
+void _write_metrics()
+{
+    uint image_sizes[HISTORY_MAX_FPGAS] = {};
+
+    if (metrics_file.empty())
+    {
+        return;
+    }
+    TraceSlice slice(trace, TraceTrack::CONTROL, "write metrics");
+    std::vector<HistoryRecord> records = history.records();
+    if (records.empty())
+    {
+        records.push_back(history_record);
+    }
+    for (uint i=0; i<NUM_FPGAS; i++)
+    {
+        image_sizes[i] = fpga_images[i].data.size();
+    }
+    if (!write_metrics(metrics_file, records, image_sizes))
+    {
+        DEBUG_MSG("Could not write the metrics file " << metrics_file);
+    }
+}
+
+//----------------------------------------------------------------------------
+// _write_trace
+//----------------------------------------------------------------------------
+void _write_trace()
+{
+    if (trace.enabled() && !trace.write(trace_file))
+    {
+        MSG("Could not write the trace file " << trace_file);
+    }
+}
+
+//----------------------------------------------------------------------------
+// _stream_profile
+// The kernel, board and protocol the translated streams are for.
+//----------------------------------------------------------------------------
+uint64_t _stream_profile()
+{
+    std::string profile = std::string(_kernel_name(transfer_kernel)) + "/" + _board_rev() + "/" + ConfigProtocol::NAME;
+    return hash_bytes(profile.data(), profile.size());
+}
+
+//----------------------------------------------------------------------------
+// _store_streams
+// Stores the translated stream of any image that missed the cache. Only
+// the SPI kernel replays a translated stream.
+//----------------------------------------------------------------------------
+void _store_streams()
+{
+    if ((transfer_kernel != TransferKernel::SPI) || exit_flag)
+    {
+        return;
+    }
+    TraceSlice slice(trace, TraceTrack::CONTROL, "store streams");
+    for (uint i=0; i<NUM_FPGAS; i++)
+    {
+        if (stream_missed[i] && !fpga_images[i].data.empty())
+        {
+            std::vector<uint8_t> stream = spi_stream(fpga_images[i].data.data(), fpga_images[i].data.size());
+            if (!stream_cache.store(fpga_images[i].hash, _stream_profile(), stream.data(), stream.size()))
+            {
+                DEBUG_MSG("Could not store the FPGA" << (i + 1) << " stream in " << cache_dir);
+            }
+            stream_missed[i] = false;
+        }
+    }
+}
+
+//----------------------------------------------------------------------------
+// _monitor
+// Samples CONF_DONE/nSTATUS of each FPGA until the app exits, and
+// reconfigures the FPGAs from their resident images if one loses its
+// configuration or a reconfigure is requested (SIGHUP). Another invocation
+// configuring the FPGAs also drops CONF_DONE, so the lock is taken and the
+// status checked again first.
+//----------------------------------------------------------------------------
+void _monitor()
+{
+    // Lock the whole app in RAM, so recovery is just the transfer time
+    if (::mlockall(MCL_CURRENT|MCL_FUTURE) != 0)
+    {
+        MSG("Could not lock the app in RAM");
+    }
+    MSG("\nMonitoring the FPGA configuration");
+    while (!exit_flag)
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(MONITOR_POLL_MS));
+
+        // Use any images refreshed by the image watcher
+        _adopt_refreshed_images();
+
+        // Check the configuration, confirming any loss to ignore glitches
+        int lost = _find_lost_fpga();
+        if (lost >= 0)
+        {
+            std::this_thread::sleep_for(std::chrono::milliseconds(MONITOR_CONFIRM_MS));
+            lost = _find_lost_fpga();
+        }
+        bool requested = reconfig_flag.exchange(false);
+        if ((lost < 0) && !requested)
+        {
+            continue;
+        }
+        auto detected = std::chrono::system_clock::now();
+        std::time_t detected_time = std::chrono::system_clock::to_time_t(detected);
+        if (lost >= 0)
+        {
+            MSG("\n" << std::put_time(std::localtime(&detected_time), "%F %T") << ": FPGA" << (lost + 1) <<
+                " configuration lost (CONF_DONE " << RD_GPIO_PIN(conf_done_pins[lost]) << ", nSTATUS " <<
+                RD_GPIO_PIN(nstatus_pins[lost]) << ")");
+        }
+        else
+        {
+            MSG("\n" << std::put_time(std::localtime(&detected_time), "%F %T") << ": reconfiguration requested");
+        }
+
+        // Wait for any other configuration in flight
+        int result = 0;
+        uint owner_pid = 0;
+        _begin_history_record();
+        LockResult lock_result = config_lock.acquire(lock_file.c_str(), images_key, exit_flag, result, owner_pid);
+        if (lock_result == LockResult::ABORTED)
+        {
+            break;
+        }
+        if ((lock_result == LockResult::COALESCED) || (!requested && (_find_lost_fpga() < 0)))
+        {
+            MSG("FPGAs configured by another invocation");
+            config_lock.release(0);
+            continue;
+        }
+
+        // Reconfigure the FPGAs
+        history_record.phase_us[HISTORY_PHASE_LOCK_WAIT] = _elapsed_us(history_start);
+        history_record.usage[HISTORY_PHASE_LOCK_WAIT] = usage_since(history_usage_start, false);
+        trace.instant(TraceTrack::CONTROL, (requested ? "reconfiguration requested" : "configuration lost"));
+        bool ok = _reconfigure_fpgas();
+        config_lock.release(ok ? 0 : 1);
+        if (exit_flag)
+        {
+            // Recorded once the abort control has stopped
+            history_pending = true;
+            break;
+        }
+        _append_history_record(_exit_code(ok));
+        _write_metrics();
+        _store_streams();
+        auto end = std::chrono::system_clock::now();
+        MSG((ok ? "FPGAs reconfigured, " : "FPGA reconfiguration FAILED, ") <<
+            std::chrono::duration_cast<std::chrono::milliseconds>(end - detected).count() << "ms after the " <<
+            (requested ? "request" : "loss was detected"));
+    }
+}
+
+//----------------------------------------------------------------------------
+// _find_lost_fpga
+// Returns the first FPGA with CONF_DONE or nSTATUS low, or -1 if all are
+// configured.
+//----------------------------------------------------------------------------
+int _find_lost_fpga()
+{
+    uint64_t levels = 0;
+
+    // Read the level register of each bank with a status pin
+    for (uint i=0; i<GPIO_NUM_BANKS; i++)
+    {
+        if (status_pins.masks[i])
+        {
+            levels |= static_cast<uint64_t>(gpio_rd_reg[i]) << (i * GPIO_BANK_SIZE);
+        }
+    }
+    for (uint i=0; i<NUM_FPGAS; i++)
+    {
+        if (!((levels >> conf_done_pins[i]) & 0x01) || !((levels >> nstatus_pins[i]) & 0x01))
+        {
+            return i;
+        }
+    }
+    return -1;
+}
+
+//----------------------------------------------------------------------------
+// _reconfigure_fpgas
+// nCONFIG is shared by the FPGAs, so the whole chain is reset and
+// reconfigured.
+//----------------------------------------------------------------------------
+bool _reconfigure_fpgas()
+{
+    // Reset the FPGAs, with FPGA2 deselected
+    _set_safe_pin_state();
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+
+    // Configure each FPGA from its resident image
+    return _config_fpgas() && (_find_lost_fpga() < 0);
+}
+
+//----------------------------------------------------------------------------
+// _verify_kernels
+// Verifies each transfer kernel against the CPU kernel, using the images in
+// the firmware directory, any image files on the command line, and a set of
+// synthetic images. No hardware is accessed.
+//----------------------------------------------------------------------------
+int _verify_kernels()
+{
+    std::vector<VerifyImage> corpus;
+    bool ok;
+
+    // Build the corpus
+    add_image_dir(firmware_dir, corpus);
+    for (const std::string &filename : verify_files)
+    {
+        if (!add_image_file(filename, corpus))
+        {
+            MSG("Could not open the binary file: " << filename);
+            return 1;
+        }
+    }
+    add_synthetic_images(corpus);
+
+    // Verify the kernels
+    ok = verify_kernels(corpus);
+    MSG((ok ? "\nKernel verification passed" : "\nKernel verification FAILED"));
+    return ok ? 0 : 1;
+}
+
+//----------------------------------------------------------------------------
+// _dry_run
+// Predicts the transfer time of each FPGA image with the selected kernel,
+// without accessing any hardware.
+//----------------------------------------------------------------------------
+int _dry_run()
+{
+    CostCoefficients coeffs;
+    double total_us = 0;
+    bool ok;
+
+    // Get the platform coefficients, and apply any tuning file
+    if (platform_name.empty())
+    {
+        detect_platform_coefficients(coeffs);
+    }
+    else if (!find_platform_coefficients(platform_name.c_str(), coeffs))
+    {
+        MSG("Unknown platform: " << platform_name);
+        return 1;
+    }
+    if (!tuning_file.empty())
+    {
+        if (!load_tuning_file(tuning_file.c_str(), coeffs))
+        {
+            MSG("Could not open the tuning file: " << tuning_file);
+            return 1;
+        }
+    }
+    else
+    {
+        load_tuning_file(TUNING_FILE_PATH, coeffs);
+    }
+    MSG("Dry run: " << _kernel_name(transfer_kernel) << " kernel, " << ConfigProtocol::NAME << " protocol, " << coeffs.platform << " coefficients");
+
+    // Predict each FPGA
+    ok = _predict_image(FPGA1_BINARY_FILENAME, "FPGA1", coeffs, total_us);
+#if MELBINST_PI_HAT == 0
+    ok &= _predict_image(FPGA2_BINARY_FILENAME, "FPGA2", coeffs, total_us);
+#endif
+    if (ok)
+    {
+        MSG("\nTotal predicted transfer time: " << std::fixed << std::setprecision(2) << (total_us / 1000.0) << "ms");
+    }
+    return ok ? 0 : 1;
+}
+
+//----------------------------------------------------------------------------
+// _predict_image
+//----------------------------------------------------------------------------
+bool _predict_image(const char *filename, const char *name, const CostCoefficients &coeffs, double &total_us)
+{
+    KernelCounts counts;
+    double us = 0;
+    bool ok = false;
+
+    // Load the binary image
+    if (!_load_binary_file(filename, name))
+    {
+        return false;
+    }
+
+    // Run the kernel against a counting backend and predict its time
+    switch (transfer_kernel)
+    {
+        case TransferKernel::SPI:
+            ok = count_spi_kernel(binary_data, binary_data_size, counts);
+            us = predict_spi_transfer_us(counts, coeffs, SPI_SPEED_HZ);
+            break;
+
+        case TransferKernel::TABLE:
+            ok = count_table_kernel(binary_data, binary_data_size, counts);
+            us = predict_table_transfer_us(counts, coeffs);
+            break;
+
+        default:
+            ok = count_cpu_kernel(binary_data, binary_data_size, counts);
+            us = predict_cpu_transfer_us(counts, coeffs);
+            break;
+    }
+    _free_binary_file();
+    if (!ok)
+    {
+        MSG(name << ": kernel error");
+        return false;
+    }
+    if (transfer_kernel == TransferKernel::SPI)
+    {
+        MSG(name << ": " << counts.num_spi_bytes << " SPI bytes in " << counts.num_spi_messages << " messages");
+    }
+    else
+    {
+        MSG(name << ": " << counts.num_gpio_writes << " GPIO writes");
+    }
+    MSG(name << ": predicted transfer time " << std::fixed << std::setprecision(2) << (us / 1000.0) << "ms");
+    total_us += us;
+    return true;
+}
+
+//----------------------------------------------------------------------------
+// _kernel_name
+//----------------------------------------------------------------------------
+const char *_kernel_name(TransferKernel kernel)
+{
+    switch (kernel)
+    {
+        case TransferKernel::SPI:
+            return "spi";
+
+        case TransferKernel::TABLE:
+            return "table";
+
+        default:
+            return "cpu";
+    }
+}
+
+//----------------------------------------------------------------------------
+// _close_gpio
+//----------------------------------------------------------------------------
+void _close_gpio()
+{
+    // Ummap the GPIO device if open
+    if (gpio_port)
+    {
+        // Set the default GPIO values
+        MmioGpio gpio = {gpio_set_reg, gpio_clr_reg};
+        gpio.clr_pins(idle_clr_pins);
+
+        // Unmap it
+        ::munmap(gpio_port, PAGE_SIZE);
+        gpio_port = nullptr;
+        MSG("GPIO port closed");
+    }
+}
+
+//----------------------------------------------------------------------------
+// _print_app_info
+//----------------------------------------------------------------------------
+void _print_app_info()
+{
+    MSG("FPGA CONFIG - Copyright (c) 2023-2024 Melbourne Instruments, Australia");
+    MSG("Version " << FPGA_CONFIG_MAJOR_VERSION << "." << FPGA_CONFIG_MINOR_VERSION << "." << FPGA_CONFIG_PATCH_VERSION);
+    MSG("");
+}
+
+//----------------------------------------------------------------------------
+// _print_usage
+//----------------------------------------------------------------------------
+void _print_usage()
+{
+    MSG("Usage: fpga_config [options]");
+    MSG("       fpga_config --verify [options] [files]");
+    MSG("       fpga_config --make-delta <base> <target>");
+    MSG("  -k, --kernel <kernel>       Transfer kernel used to clock the data: cpu, spi or table (default cpu)");
+    MSG("  -m, --monitor               Stay resident and reconfigure the FPGAs if they lose their configuration");
+    MSG("  -v, --verify [files]        Verify the transfer kernels against the CPU kernel, no hardware is used");
+    MSG("  -n, --dry-run               Predict the transfer time of the selected kernel, no hardware is used");
+    MSG("  -d, --firmware-dir <dir>    Directory containing the FPGA binary files");
+    MSG("      --platform <name>       Dry run platform coefficients (pi4, cm4, pi400, default detected)");
+    MSG("      --tuning-file <file>    Dry run tuning file (default " << TUNING_FILE_PATH << ")");
+    MSG("      --steer-cpu <cpu>       Pin to the CPU, move IRQs off it and raise its frequency while configuring");
+    MSG("      --sysfs-root <dir>      sysfs root used for CPU steering (default " << DEFAULT_SYSFS_ROOT << ")");
+    MSG("      --procfs-root <dir>     procfs root used for CPU steering (default " << DEFAULT_PROCFS_ROOT << ")");
+    MSG("      --progress              Show the transfer progress, rate and ETA");
+    MSG("      --lock-file <file>      Lock file shared by concurrent invocations (default " << DEFAULT_LOCK_FILE_PATH << ")");
+    MSG("      --state-dir <dir>       Directory holding the A/B slot record and history (default " << DEFAULT_STATE_DIR << ")");
+    MSG("      --history               Show the configuration time history, no hardware is used");
+    MSG("      --metrics-file <file>   Prometheus textfile metrics, empty to disable (default " << DEFAULT_METRICS_FILE_PATH << ")");
+    MSG("      --trace-file <file>     Write a Chrome trace (JSON) of the configuration timeline");
+    MSG("      --cache-dir <dir>       Translated stream cache, empty to disable (default " << DEFAULT_CACHE_DIR << ")");
+    MSG("      --make-delta <base>     Write <target>.delta, the target image as a delta against the base image");
+    MSG("      --check-nstatus         Wait for nSTATUS to be released after nCONFIG, the status pins must be wired");
+    MSG("  -h, --help                  Show this help");
+}
+
+//----------------------------------------------------------------------------
+// _print_board_rev_info
+//----------------------------------------------------------------------------
+void _print_board_rev_info()
+{
+    char rev = _board_rev();
+    if (rev)
+    {
+        MSG("Detected Board Rev " << rev);
+    }
+}
+
+//----------------------------------------------------------------------------
+// _board_rev
+//----------------------------------------------------------------------------
+char _board_rev()
+{
+    if (!gpio_port)
+    {
+        return 0;
+    }
+    uint rev = RD_GPIO_PIN(BOARD_REV_GPIO_PIN_1) + (RD_GPIO_PIN(BOARD_REV_GPIO_PIN_2) << 1);
+    switch(rev)
+    {
+        case 0:
+            return 'D';
+
+        case 1:
+            return 'B';
+
+        case 2:
+            return 'C';
+
+        case 3:
+            return 'A';
+
+        default:
+            return 0;
+    }
+}
+
+//----------------------------------------------------------------------------
+// _set_safe_pin_state
+// DCLK/DATA0 low, nCONFIG low to hold the FPGAs in reset, and FPGA2
+// deselected.
+//----------------------------------------------------------------------------
+void _set_safe_pin_state()
+{
+    if (gpio_port)
+    {
+        MmioGpio gpio = {gpio_set_reg, gpio_clr_reg};
+        gpio.clr_pins(safe_state_clr_pins);
+#if MELBINST_PI_HAT == 0
+        SET_GPIO_PIN(FPGA2_NCE_GPIO_PIN);
+#endif
+    }
+}
+
+//----------------------------------------------------------------------------
+// _force_safe_state
+// Called from the abort control thread if the app does not shut down in
+// time.
+//----------------------------------------------------------------------------
+void _force_safe_state()
+{
+    _set_safe_pin_state();
 }
 
 //----------------------------------------------------------------------------
-// _sigint_handler
+// _before_forced_exit
+// Called from the abort control or watchdog thread before it exits the
+// app, as the main thread is stuck and will not restore the IRQ and CPU
+// frequency settings.
 //----------------------------------------------------------------------------
-void _sigint_handler([[maybe_unused]] int sig)
+void _before_forced_exit()
 {
-    // Signal to exit the app
-    exit_flag = true;
-    exit_notifier.notify_one();
+    cpu_steering.restore();
 }
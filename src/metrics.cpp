@@ -0,0 +1,205 @@
+/**
+ *-----------------------------------------------------------------------------
+ * Copyright (c) 2021-2024 Melbourne Instruments, Australia
+ *-----------------------------------------------------------------------------
+ * @file  metrics.cpp
+ * @brief Prometheus textfile metrics.
+ *-----------------------------------------------------------------------------
+ */
+#include <sstream>
+#include <iomanip>
+#include <cstdio>
+#include <cstring>
+#include <unistd.h>
+#include <fcntl.h>
+#include "metrics.h"
+
+// Constants
+constexpr double DURATION_BUCKETS[] = { 0.025, 0.05, 0.1, 0.2, 0.5, 1.0, 2.0, 5.0 };
+const char *result_names[]          = { "ok", "failed", "aborted" };
+const char *phase_labels[]          = { "lock_wait", "load", "fpga1", "fpga2", "total" };
+
+// Local functions
+void _write_duration_buckets(std::ostringstream &metrics, const char *name, const std::string &labels, const std::vector<double> &values);
+
+//----------------------------------------------------------------------------
+// write_metrics
+// The duration buckets and counts cover the runs in the history, and the
+// other gauges the latest run. All of them are gauges, as the history is a
+// ring and its counts drop once it wraps.
+//----------------------------------------------------------------------------
+bool write_metrics(const std::string &path, const std::vector<HistoryRecord> &records, const uint image_sizes[HISTORY_MAX_FPGAS])
+{
+    std::ostringstream metrics;
+    std::vector<double> fpga_durations[HISTORY_MAX_FPGAS];
+    std::vector<double> total_durations;
+    uint num_runs[3] = {};
+    uint64_t num_fallbacks = 0;
+    uint64_t num_retries = 0;
+    uint64_t num_stalls = 0;
+    uint64_t last_success = 0;
+
+    if (records.empty())
+    {
+        return false;
+    }
+
+    // Gather the durations and counts
+    for (const HistoryRecord &r : records)
+    {
+        num_runs[((r.result >= 0) && (r.result <= 2)) ? r.result : 1]++;
+        num_fallbacks += r.num_fallbacks;
+        num_retries += r.num_retries;
+        num_stalls += r.num_stalls;
+        if (r.result == 0)
+        {
+            for (uint i=0; i<HISTORY_MAX_FPGAS; i++)
+            {
+                if (r.phase_us[HISTORY_PHASE_FPGA1 + i])
+                {
+                    fpga_durations[i].push_back(r.phase_us[HISTORY_PHASE_FPGA1 + i] / 1e6);
+                }
+            }
+            total_durations.push_back(r.phase_us[HISTORY_PHASE_TOTAL] / 1e6);
+            last_success = r.timestamp;
+        }
+    }
+    const HistoryRecord &last = records.back();
+    metrics << std::setprecision(9);
+
+    // Duration buckets over the history
+    metrics << "# HELP fpga_config_duration_runs Successful runs in the history that clocked out the image of each FPGA within le seconds.\n";
+    metrics << "# TYPE fpga_config_duration_runs gauge\n";
+    for (uint i=0; i<HISTORY_MAX_FPGAS; i++)
+    {
+        if (!fpga_durations[i].empty())
+        {
+            _write_duration_buckets(metrics, "fpga_config_duration_runs", ("fpga=\"" + std::to_string(i + 1) + "\""), fpga_durations[i]);
+        }
+    }
+    metrics << "# HELP fpga_config_total_duration_runs Successful runs in the history that completed within le seconds.\n";
+    metrics << "# TYPE fpga_config_total_duration_runs gauge\n";
+    _write_duration_buckets(metrics, "fpga_config_total_duration_runs", "", total_durations);
+
+    // Counts over the history
+    metrics << "# HELP fpga_config_runs Configuration runs in the history, by result.\n";
+    metrics << "# TYPE fpga_config_runs gauge\n";
+    for (uint i=0; i<3; i++)
+    {
+        metrics << "fpga_config_runs{result=\"" << result_names[i] << "\"} " << num_runs[i] << "\n";
+    }
+    metrics << "# HELP fpga_config_fallbacks Fallbacks to the other image slot in the history.\n";
+    metrics << "# TYPE fpga_config_fallbacks gauge\n";
+    metrics << "fpga_config_fallbacks " << num_fallbacks << "\n";
+    metrics << "# HELP fpga_config_retries Retries after a phase timeout in the history.\n";
+    metrics << "# TYPE fpga_config_retries gauge\n";
+    metrics << "fpga_config_retries " << num_retries << "\n";
+    metrics << "# HELP fpga_config_stalls Transfer stalls in the history.\n";
+    metrics << "# TYPE fpga_config_stalls gauge\n";
+    metrics << "fpga_config_stalls " << num_stalls << "\n";
+
+    // Gauges for the latest run
+    metrics << "# HELP fpga_config_last_duration_seconds Time to clock out the image of each FPGA in the latest run.\n";
+    metrics << "# TYPE fpga_config_last_duration_seconds gauge\n";
+    for (uint i=0; i<HISTORY_MAX_FPGAS; i++)
+    {
+        if (last.phase_us[HISTORY_PHASE_FPGA1 + i])
+        {
+            metrics << "fpga_config_last_duration_seconds{fpga=\"" << (i + 1) << "\"} " << (last.phase_us[HISTORY_PHASE_FPGA1 + i] / 1e6) << "\n";
+        }
+    }
+    metrics << "# HELP fpga_config_last_bytes_per_second Transfer rate of each FPGA in the latest run.\n";
+    metrics << "# TYPE fpga_config_last_bytes_per_second gauge\n";
+    for (uint i=0; i<HISTORY_MAX_FPGAS; i++)
+    {
+        if (last.phase_us[HISTORY_PHASE_FPGA1 + i])
+        {
+            metrics << "fpga_config_last_bytes_per_second{fpga=\"" << (i + 1) << "\"} " << ((image_sizes[i] * 1e6) / last.phase_us[HISTORY_PHASE_FPGA1 + i]) << "\n";
+        }
+    }
+    metrics << "# HELP fpga_config_last_result Result of the latest run (0 ok, 1 failed, 2 aborted, 3-6 phase timeout).\n";
+    metrics << "# TYPE fpga_config_last_result gauge\n";
+    metrics << "fpga_config_last_result " << last.result << "\n";
+    metrics << "# HELP fpga_config_last_fallbacks Fallbacks to the other image slot in the latest run.\n";
+    metrics << "# TYPE fpga_config_last_fallbacks gauge\n";
+    metrics << "fpga_config_last_fallbacks " << last.num_fallbacks << "\n";
+    metrics << "# HELP fpga_config_last_retries Retries after a phase timeout in the latest run.\n";
+    metrics << "# TYPE fpga_config_last_retries gauge\n";
+    metrics << "fpga_config_last_retries " << static_cast<uint>(last.num_retries) << "\n";
+    metrics << "# HELP fpga_config_last_stalls Transfer stalls in the latest run.\n";
+    metrics << "# TYPE fpga_config_last_stalls gauge\n";
+    metrics << "fpga_config_last_stalls " << last.num_stalls << "\n";
+    metrics << "# HELP fpga_config_last_worst_stall_seconds Longest transfer stall in the latest run.\n";
+    metrics << "# TYPE fpga_config_last_worst_stall_seconds gauge\n";
+    metrics << "fpga_config_last_worst_stall_seconds " << (last.worst_stall_us / 1e6) << "\n";
+    metrics << "# HELP fpga_config_last_page_faults Page faults of each phase in the latest run.\n";
+    metrics << "# TYPE fpga_config_last_page_faults gauge\n";
+    for (uint i=0; i<NUM_HISTORY_PHASES; i++)
+    {
+        if (last.phase_us[i])
+        {
+            metrics << "fpga_config_last_page_faults{phase=\"" << phase_labels[i] << "\",type=\"major\"} " << last.usage[i].major_faults << "\n";
+            metrics << "fpga_config_last_page_faults{phase=\"" << phase_labels[i] << "\",type=\"minor\"} " << last.usage[i].minor_faults << "\n";
+        }
+    }
+    metrics << "# HELP fpga_config_last_context_switches Context switches of each phase in the latest run.\n";
+    metrics << "# TYPE fpga_config_last_context_switches gauge\n";
+    for (uint i=0; i<NUM_HISTORY_PHASES; i++)
+    {
+        if (last.phase_us[i])
+        {
+            metrics << "fpga_config_last_context_switches{phase=\"" << phase_labels[i] << "\",type=\"voluntary\"} " << last.usage[i].vol_switches << "\n";
+            metrics << "fpga_config_last_context_switches{phase=\"" << phase_labels[i] << "\",type=\"involuntary\"} " << last.usage[i].invol_switches << "\n";
+        }
+    }
+    metrics << "# HELP fpga_config_last_max_rss_bytes Peak resident set size of the latest run.\n";
+    metrics << "# TYPE fpga_config_last_max_rss_bytes gauge\n";
+    metrics << "fpga_config_last_max_rss_bytes " << (static_cast<uint64_t>(last.usage[HISTORY_PHASE_TOTAL].max_rss_kb) * 1024) << "\n";
+    metrics << "# HELP fpga_config_kernel Transfer kernel used by the latest run.\n";
+    metrics << "# TYPE fpga_config_kernel gauge\n";
+    metrics << "fpga_config_kernel{kernel=\"" << std::string(last.kernel, strnlen(last.kernel, sizeof(last.kernel))) << "\"} 1\n";
+    if (last_success)
+    {
+        metrics << "# HELP fpga_config_last_success_timestamp_seconds Time of the latest successful run.\n";
+        metrics << "# TYPE fpga_config_last_success_timestamp_seconds gauge\n";
+        metrics << "fpga_config_last_success_timestamp_seconds " << last_success << "\n";
+    }
+
+    // Write the temporary file, then rename it over the metrics file
+    std::string str = metrics.str();
+    std::string tmp_path = path + ".tmp";
+    int fd = ::open(tmp_path.c_str(), (O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC), 0644);
+    if (fd < 0)
+    {
+        return false;
+    }
+    bool ok = ::write(fd, str.data(), str.size()) == static_cast<ssize_t>(str.size());
+    ::close(fd);
+    if (!ok || (::rename(tmp_path.c_str(), path.c_str()) != 0))
+    {
+        ::unlink(tmp_path.c_str());
+        return false;
+    }
+    return true;
+}
+
+//----------------------------------------------------------------------------
+// _write_duration_buckets
+// Writes the cumulative count of the values within each bucket, in the
+// layout of a histogram but as a gauge.
+//----------------------------------------------------------------------------
+void _write_duration_buckets(std::ostringstream &metrics, const char *name, const std::string &labels, const std::vector<double> &values)
+{
+    std::string sep = labels.empty() ? "" : ",";
+
+    for (double bucket : DURATION_BUCKETS)
+    {
+        uint count = 0;
+        for (double v : values)
+        {
+            count += (v <= bucket);
+        }
+        metrics << name << "{" << labels << sep << "le=\"" << bucket << "\"} " << count << "\n";
+    }
+    metrics << name << "{" << labels << sep << "le=\"+Inf\"} " << values.size() << "\n";
+}
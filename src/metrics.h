@@ -0,0 +1,30 @@
+/**
+ *-----------------------------------------------------------------------------
+ * Copyright (c) 2021-2024 Melbourne Instruments, Australia
+ *-----------------------------------------------------------------------------
+ * @file  metrics.h
+ * @brief Prometheus textfile metrics.
+ *
+ * The metrics are written in the Prometheus text format for the
+ * node_exporter textfile collector. The duration buckets and counts are
+ * built from the configuration history, and the other gauges from the
+ * latest run. The history is a ring of records, so everything is exported
+ * as a gauge rather than a histogram or counter. The file is
+ * written to a temporary file and renamed over the old one, so the collector
+ * never reads a partial file.
+ *-----------------------------------------------------------------------------
+ */
+#ifndef _METRICS_H
+#define _METRICS_H
+
+#include <string>
+#include <vector>
+#include "history.h"
+
+// Constants
+constexpr char DEFAULT_METRICS_FILE_PATH[] = "/var/lib/node_exporter/textfile_collector/fpga_config.prom";
+
+// Functions
+bool write_metrics(const std::string &path, const std::vector<HistoryRecord> &records, const uint image_sizes[HISTORY_MAX_FPGAS]);
+
+#endif  // _METRICS_H
@@ -0,0 +1,115 @@
+/**
+ *-----------------------------------------------------------------------------
+ * Copyright (c) 2021-2024 Melbourne Instruments, Australia
+ *-----------------------------------------------------------------------------
+ * @file  mmio.h
+ * @brief Register stores with an explicit ordering policy.
+ *
+ * The kernels call edge() on their GPIO backend before each DCLK edge, which
+ * is the only point where the order of the stores matters: DATA0 must be
+ * written before DCLK rises, and a DCLK level must be written before the
+ * opposite edge. How that is guaranteed is an ordering policy, selected with
+ * GPIO_ORDERING in CMake:
+ *
+ *   relaxed   The default, as the CPU kernel has always run. Plain device
+ *             stores, with the DCLK writes of each edge repeated by a loop
+ *             on a volatile counter, which also stretches the pulse. /dev/mem
+ *             maps the GPIO block as Device memory, which keeps stores to
+ *             the block in program order, so this relies on the mapping.
+ *   edge      A store barrier (dmb) before each DCLK edge, which orders the
+ *             stores whatever the mapping, without waiting for them.
+ *   sync      A dsb after every store, so each store has completed before
+ *             the next is issued.
+ *
+ * The edge and sync policies unroll the DCLK writes, so the pulse width is
+ * set by the stores and barriers alone, and must be measured against the
+ * minimum pulse width of the protocol on the target before either is used.
+ * The volatile stores only stop the compiler merging or dropping them, the
+ * policy states what the bus sees. fpga_mmio_bench times the kernels with
+ * each policy, and --verify checks every DCLK edge has a barrier point.
+ *-----------------------------------------------------------------------------
+ */
+#ifndef _MMIO_H
+#define _MMIO_H
+
+#include <cstdint>
+#include <atomic>
+
+//----------------------------------------------------------------------------
+// mmio_store_barrier
+// Orders the stores before it with those after it, without waiting for them.
+//----------------------------------------------------------------------------
+inline void mmio_store_barrier()
+{
+#if defined(__aarch64__)
+    asm volatile("dmb oshst" ::: "memory");
+#elif defined(__arm__)
+    asm volatile("dmb st" ::: "memory");
+#else
+    std::atomic_thread_fence(std::memory_order_release);
+#endif
+}
+
+//----------------------------------------------------------------------------
+// mmio_sync_barrier
+// Waits for the stores before it to complete.
+//----------------------------------------------------------------------------
+inline void mmio_sync_barrier()
+{
+#if defined(__aarch64__) || defined(__arm__)
+    asm volatile("dsb st" ::: "memory");
+#else
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+#endif
+}
+
+// Relaxed ordering - relies on the Device memory mapping
+struct RelaxedOrdering
+{
+    static constexpr char NAME[] = "relaxed";
+    static constexpr bool UNROLLED_DCLK_WRITES = false;
+
+    static inline void after_store() {}
+    static inline void before_edge() {}
+};
+
+// Edge ordering - a store barrier before each DCLK edge
+struct EdgeOrdering
+{
+    static constexpr char NAME[] = "edge";
+    static constexpr bool UNROLLED_DCLK_WRITES = true;
+
+    static inline void after_store() {}
+    static inline void before_edge() { mmio_store_barrier(); }
+};
+
+// Sync ordering - every store completes before the next
+struct SyncOrdering
+{
+    static constexpr char NAME[] = "sync";
+    static constexpr bool UNROLLED_DCLK_WRITES = true;
+
+    static inline void after_store() { mmio_sync_barrier(); }
+    static inline void before_edge() {}
+};
+
+// The ordering of this build
+#if GPIO_ORDERING_POLICY == 1
+using GpioOrdering = EdgeOrdering;
+#elif GPIO_ORDERING_POLICY == 2
+using GpioOrdering = SyncOrdering;
+#else
+using GpioOrdering = RelaxedOrdering;
+#endif
+
+//----------------------------------------------------------------------------
+// mmio_store
+//----------------------------------------------------------------------------
+template <class Ordering>
+inline void mmio_store(volatile uint32_t *reg, uint32_t value)
+{
+    *reg = value;
+    Ordering::after_store();
+}
+
+#endif  // _MMIO_H
@@ -0,0 +1,495 @@
+/**
+ *-----------------------------------------------------------------------------
+ * Copyright (c) 2021-2024 Melbourne Instruments, Australia
+ *-----------------------------------------------------------------------------
+ * @file  mmio_bench.cpp
+ * @brief GPIO register access microbenchmark of the target platform.
+ *
+ * Measures the cost of single and back-to-back stores to the GPIO set and
+ * clear registers, a level register read after a store, the store barriers,
+ * and stores through /dev/gpiomem as well as /dev/mem, then times the CPU
+ * and table kernels with each ordering policy (see mmio.h) and derives their
+ * loop and dispatch overheads with the policy of this build. The
+ * results are written as a tuning file, so the dry run predictions use the
+ * measured costs, along with the number of consecutive DCLK writes that
+ * holds each DCLK level for the minimum pulse width of the protocol.
+ *
+ * Every store writes a zero mask, which the GPIO block handles like any
+ * other write but which changes no pin, so the bench can be run with the
+ * FPGAs configured and running.
+ *-----------------------------------------------------------------------------
+ */
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <algorithm>
+#include <vector>
+#include <string>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <random>
+#include <sched.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "common.h"
+#include "gpio.h"
+#include "transfer.h"
+#include "protocol.h"
+#include "mmio.h"
+#include "cost_model.h"
+
+// Constants
+constexpr char GPIOMEM_DEV_NAME[]    = "/dev/gpiomem";
+constexpr uint DEFAULT_NUM_RUNS      = 9;
+constexpr uint NUM_ITERATIONS        = 100000;
+constexpr uint OPS_PER_ITERATION     = 8;
+constexpr uint KERNEL_IMAGE_SIZE     = 65536;
+constexpr double PAD_MARGIN_NS       = 5.0;    // Slew of the GPIO pad and board trace
+constexpr uint NUM_ORDERINGS         = 3;
+constexpr const char *ordering_names[NUM_ORDERINGS] = { RelaxedOrdering::NAME, EdgeOrdering::NAME, SyncOrdering::NAME };
+
+// MMIO backend that stores a zero mask to GPSETn/GPCLRn, so the kernels
+// can be timed without driving any pins
+template <class Ordering>
+struct ZeroMaskGpio
+{
+    using Policy = Ordering;
+
+    volatile uint32_t *set_reg;
+    volatile uint32_t *clr_reg;
+
+    inline void set(uint bank, [[maybe_unused]] uint32_t mask) { mmio_store<Ordering>(&set_reg[bank], 0); }
+    inline void clr(uint bank, [[maybe_unused]] uint32_t mask) { mmio_store<Ordering>(&clr_reg[bank], 0); }
+    inline void edge() { Ordering::before_edge(); }
+};
+
+// GPIO registers of a mapping
+struct GpioRegs
+{
+    volatile uint32_t *set_reg;
+    volatile uint32_t *clr_reg;
+    volatile uint32_t *lev_reg;
+};
+
+// Measured costs, in ns
+struct MmioResults
+{
+    double write_ns = 0;
+    double write_alt_ns = 0;
+    double read_after_write_ns = 0;
+    double dmb_ns = 0;
+    double dsb_ns = 0;
+    double gpiomem_write_ns = 0;
+    bool have_gpiomem = false;
+    double bit_loop_ns = 0;
+    double byte_dispatch_ns = 0;
+    double cpu_byte_ns[NUM_ORDERINGS] = {};
+    double table_byte_ns[NUM_ORDERINGS] = {};
+    uint consecutive_gpio_writes = 0;
+};
+
+// Local functions
+bool _map_regs(volatile uint32_t *base, GpioRegs &regs);
+volatile uint32_t *_map_gpiomem();
+void _measure_registers(const GpioRegs &mem, const GpioRegs *gpiomem, uint num_runs, MmioResults &results);
+void _measure_kernels(const GpioRegs &mem, uint num_runs, MmioResults &results);
+template <class Ordering>
+void _time_kernels(const GpioRegs &mem, const std::vector<uint8_t> &image, uint num_runs, double &cpu_ns, double &table_ns);
+uint _build_ordering();
+bool _write_tuning_file(const std::string &path, const MmioResults &results);
+void _print_results(const MmioResults &results);
+void _print_usage();
+
+//----------------------------------------------------------------------------
+// _now_ns
+//----------------------------------------------------------------------------
+inline uint64_t _now_ns()
+{
+    struct timespec ts;
+    ::clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (static_cast<uint64_t>(ts.tv_sec) * 1000000000) + ts.tv_nsec;
+}
+
+//----------------------------------------------------------------------------
+// _repeat
+// Unrolls the op, so the loop overhead is spread over OPS_PER_ITERATION ops.
+//----------------------------------------------------------------------------
+template <class Op, size_t... Ops>
+inline void _repeat(Op &op, std::index_sequence<Ops...>)
+{
+    ((static_cast<void>(Ops), op()), ...);
+}
+
+//----------------------------------------------------------------------------
+// _time_op_ns
+// Returns the median time of an op over the runs, less the loop overhead.
+//----------------------------------------------------------------------------
+template <class Op>
+double _time_op_ns(Op op, uint num_runs)
+{
+    std::vector<double> op_ns;
+    std::vector<double> loop_ns;
+    auto empty = []() { asm volatile("" ::: "memory"); };
+
+    for (uint i=0; i<num_runs; i++)
+    {
+        uint64_t start = _now_ns();
+        for (uint j=0; j<NUM_ITERATIONS; j++)
+        {
+            _repeat(op, std::make_index_sequence<OPS_PER_ITERATION>());
+        }
+        uint64_t end = _now_ns();
+        for (uint j=0; j<NUM_ITERATIONS; j++)
+        {
+            _repeat(empty, std::make_index_sequence<OPS_PER_ITERATION>());
+        }
+        op_ns.push_back(static_cast<double>(end - start) / (NUM_ITERATIONS * OPS_PER_ITERATION));
+        loop_ns.push_back(static_cast<double>(_now_ns() - end) / (NUM_ITERATIONS * OPS_PER_ITERATION));
+    }
+    std::sort(op_ns.begin(), op_ns.end());
+    std::sort(loop_ns.begin(), loop_ns.end());
+    return std::max((op_ns[op_ns.size() / 2] - loop_ns[loop_ns.size() / 2]), 0.0);
+}
+
+//----------------------------------------------------------------------------
+// _time_kernel_ns
+// Returns the median time per byte of a kernel over the runs.
+//----------------------------------------------------------------------------
+template <class Kernel>
+double _time_kernel_ns(Kernel kernel, uint size, uint num_runs)
+{
+    std::vector<double> byte_ns;
+
+    for (uint i=0; i<num_runs; i++)
+    {
+        uint64_t start = _now_ns();
+        kernel();
+        byte_ns.push_back(static_cast<double>(_now_ns() - start) / size);
+    }
+    std::sort(byte_ns.begin(), byte_ns.end());
+    return byte_ns[byte_ns.size() / 2];
+}
+
+//----------------------------------------------------------------------------
+// main
+//----------------------------------------------------------------------------
+int main(int argc, char *argv[])
+{
+    std::string tuning_file = TUNING_FILE_PATH;
+    uint num_runs = DEFAULT_NUM_RUNS;
+    bool write_file = true;
+    int cpu = -1;
+    int opt;
+
+    // Parse the command line arguments
+    while ((opt = ::getopt(argc, argv, "o:n:c:ph")) != -1)
+    {
+        switch (opt)
+        {
+            case 'o':
+                tuning_file = optarg;
+                break;
+
+            case 'n':
+                num_runs = std::strtoul(optarg, nullptr, 10);
+                break;
+
+            case 'c':
+                cpu = std::atoi(optarg);
+                break;
+
+            case 'p':
+                write_file = false;
+                break;
+
+            default:
+                _print_usage();
+                return 1;
+        }
+    }
+    if ((optind != argc) || (num_runs == 0))
+    {
+        _print_usage();
+        return 1;
+    }
+
+    // Pin the bench to a CPU if requested, so the runs are not migrated
+    if (cpu >= 0)
+    {
+        cpu_set_t cpu_set;
+        CPU_ZERO(&cpu_set);
+        CPU_SET(cpu, &cpu_set);
+        if (::sched_setaffinity(0, sizeof(cpu_set), &cpu_set) != 0)
+        {
+            MSG("Could not pin the bench to CPU " << cpu);
+            return 1;
+        }
+    }
+
+    // Map the GPIO registers through /dev/mem, and through /dev/gpiomem if
+    // it is available
+    GpioRegs mem;
+    GpioRegs gpiomem;
+    if (!_map_regs(static_cast<volatile uint32_t *>(mmap_bcm_register_base(GPIO_REGISTER_BASE)), mem))
+    {
+        MSG("Could not map the GPIO registers through " << MEM_DEV_NAME);
+        return 1;
+    }
+    MmioResults results;
+    results.have_gpiomem = _map_regs(_map_gpiomem(), gpiomem);
+    if (!results.have_gpiomem)
+    {
+        MSG("Could not map the GPIO registers through " << GPIOMEM_DEV_NAME << ", skipping it");
+    }
+
+    // Run the benchmarks
+    _measure_registers(mem, (results.have_gpiomem ? &gpiomem : nullptr), num_runs, results);
+    _measure_kernels(mem, num_runs, results);
+    _print_results(results);
+    if (write_file)
+    {
+        if (!_write_tuning_file(tuning_file, results))
+        {
+            MSG("Could not write the tuning file " << tuning_file);
+            return 1;
+        }
+        MSG("Tuning file written to " << tuning_file);
+    }
+    return 0;
+}
+
+//----------------------------------------------------------------------------
+// _map_regs
+//----------------------------------------------------------------------------
+bool _map_regs(volatile uint32_t *base, GpioRegs &regs)
+{
+    if (!base)
+    {
+        return false;
+    }
+    regs.set_reg = base + (GPIO_SET_OFFSET / sizeof(uint32_t));
+    regs.clr_reg = base + (GPIO_CLR_OFFSET / sizeof(uint32_t));
+    regs.lev_reg = base + (GPIO_RD_OFFSET / sizeof(uint32_t));
+    return true;
+}
+
+//----------------------------------------------------------------------------
+// _map_gpiomem
+// /dev/gpiomem maps the GPIO block at offset 0, without needing root.
+//----------------------------------------------------------------------------
+volatile uint32_t *_map_gpiomem()
+{
+    int fd = ::open(GPIOMEM_DEV_NAME, (O_RDWR|O_SYNC|O_CLOEXEC));
+    if (fd < 0)
+    {
+        return nullptr;
+    }
+    void *addr = ::mmap(NULL, PAGE_SIZE, (PROT_READ|PROT_WRITE), MAP_SHARED, fd, 0);
+    ::close(fd);
+    return (addr == MAP_FAILED) ? nullptr : static_cast<volatile uint32_t *>(addr);
+}
+
+//----------------------------------------------------------------------------
+// _measure_registers
+// Each cost is the extra time an access adds to a stream of them, which is
+// what the kernels see, rather than the latency of one access on its own.
+//----------------------------------------------------------------------------
+void _measure_registers(const GpioRegs &mem, const GpioRegs *gpiomem, uint num_runs, MmioResults &results)
+{
+    volatile uint32_t *set_reg = mem.set_reg;
+    volatile uint32_t *clr_reg = mem.clr_reg;
+    volatile uint32_t *lev_reg = mem.lev_reg;
+
+    // Back-to-back stores to the same register, as in a DCLK edge
+    results.write_ns = _time_op_ns([set_reg]() { *set_reg = 0; }, num_runs);
+
+    // Stores alternating between GPSET0 and GPCLR0, as in a data bit
+    results.write_alt_ns = _time_op_ns([set_reg, clr_reg]() {
+        *set_reg = 0;
+        *clr_reg = 0;
+    }, num_runs) / 2;
+
+    // A GPLEV0 read after a store, which has to wait for the store
+    double write_read_ns = _time_op_ns([set_reg, lev_reg]() {
+        *set_reg = 0;
+        static_cast<void>(*lev_reg);
+    }, num_runs);
+    results.read_after_write_ns = std::max((write_read_ns - results.write_ns), 0.0);
+
+    // A store followed by each barrier
+    double write_dmb_ns = _time_op_ns([set_reg]() {
+        *set_reg = 0;
+        mmio_store_barrier();
+    }, num_runs);
+    results.dmb_ns = std::max((write_dmb_ns - results.write_ns), 0.0);
+    double write_dsb_ns = _time_op_ns([set_reg]() {
+        *set_reg = 0;
+        mmio_sync_barrier();
+    }, num_runs);
+    results.dsb_ns = std::max((write_dsb_ns - results.write_ns), 0.0);
+
+    // Back-to-back stores through the /dev/gpiomem mapping
+    if (gpiomem)
+    {
+        volatile uint32_t *gpiomem_set_reg = gpiomem->set_reg;
+        results.gpiomem_write_ns = _time_op_ns([gpiomem_set_reg]() { *gpiomem_set_reg = 0; }, num_runs);
+    }
+
+    // The consecutive DCLK writes that hold each level for the minimum pulse
+    // width of the protocol, assuming the stores reach the pin at the rate
+    // they are issued
+    double pulse_ns = ConfigProtocol::MIN_CLOCK_PULSE_NS + PAD_MARGIN_NS;
+    results.consecutive_gpio_writes = std::max(static_cast<uint>(std::ceil(pulse_ns / std::max(results.write_ns, 0.1))), 1u);
+}
+
+//----------------------------------------------------------------------------
+// _measure_kernels
+// Times the CPU and table kernels on random data with each ordering policy.
+// With the policy of this build, the time not spent in the register stores
+// is attributed to the per bit loop of the CPU kernel and the per byte
+// dispatch of the table kernel, so they include its barriers.
+//----------------------------------------------------------------------------
+void _measure_kernels(const GpioRegs &mem, uint num_runs, MmioResults &results)
+{
+    std::vector<uint8_t> image(KERNEL_IMAGE_SIZE);
+    std::mt19937 rng(1);
+    std::atomic<bool> exit_flag{false};
+    CountingGpio counter;
+
+    // Count the register stores of a transfer, which are the same for both
+    // kernels
+    std::generate(image.begin(), image.end(), [&rng]() { return static_cast<uint8_t>(rng()); });
+    transfer_data(counter, image.data(), image.size(), exit_flag);
+    double write_ns = static_cast<double>(counter.num_writes) * results.write_ns / image.size();
+
+    // Time the kernels
+    _time_kernels<RelaxedOrdering>(mem, image, num_runs, results.cpu_byte_ns[0], results.table_byte_ns[0]);
+    _time_kernels<EdgeOrdering>(mem, image, num_runs, results.cpu_byte_ns[1], results.table_byte_ns[1]);
+    _time_kernels<SyncOrdering>(mem, image, num_runs, results.cpu_byte_ns[2], results.table_byte_ns[2]);
+    uint i = _build_ordering();
+    results.bit_loop_ns = std::max(((results.cpu_byte_ns[i] - write_ns) / 8), 0.0);
+    results.byte_dispatch_ns = std::max((results.table_byte_ns[i] - write_ns), 0.0);
+}
+
+//----------------------------------------------------------------------------
+// _time_kernels
+// Returns the time per byte of each kernel.
+//----------------------------------------------------------------------------
+template <class Ordering>
+void _time_kernels(const GpioRegs &mem, const std::vector<uint8_t> &image, uint num_runs, double &cpu_ns, double &table_ns)
+{
+    ZeroMaskGpio<Ordering> gpio{mem.set_reg, mem.clr_reg};
+    std::atomic<bool> exit_flag{false};
+
+    cpu_ns = _time_kernel_ns([&]() { transfer_data(gpio, image.data(), image.size(), exit_flag); }, image.size(), num_runs);
+    table_ns = _time_kernel_ns([&]() { transfer_data_table(gpio, image.data(), image.size(), exit_flag); }, image.size(), num_runs);
+}
+
+//----------------------------------------------------------------------------
+// _build_ordering
+// Returns the index of the ordering policy of this build.
+//----------------------------------------------------------------------------
+uint _build_ordering()
+{
+    for (uint i=0; i<NUM_ORDERINGS; i++)
+    {
+        if (std::strcmp(ordering_names[i], GpioOrdering::NAME) == 0)
+        {
+            return i;
+        }
+    }
+    return 0;
+}
+
+//----------------------------------------------------------------------------
+// _write_tuning_file
+// The cost model keys come first. The rest are not used by the cost model,
+// which ignores them, and are kept for reference. Written to a temporary
+// file and renamed into place, so the dry run never reads half a file.
+//----------------------------------------------------------------------------
+bool _write_tuning_file(const std::string &path, const MmioResults &results)
+{
+    std::ostringstream file;
+    std::time_t now = std::time(nullptr);
+    char date[32];
+
+    std::strftime(date, sizeof(date), "%Y-%m-%d %H:%M:%S", std::localtime(&now));
+    file << std::fixed << std::setprecision(2);
+    file << "# Measured by fpga_mmio_bench on " << date << ", " << GpioOrdering::NAME << " ordering\n";
+    file << "gpio_write_ns = " << results.write_ns << "\n";
+    file << "bit_loop_ns = " << results.bit_loop_ns << "\n";
+    file << "byte_loop_ns = 0\n";
+    file << "byte_dispatch_ns = " << results.byte_dispatch_ns << "\n";
+    file << "\n# For reference only\n";
+    file << "gpio_write_alt_ns = " << results.write_alt_ns << "\n";
+    file << "gpio_read_after_write_ns = " << results.read_after_write_ns << "\n";
+    file << "dmb_ns = " << results.dmb_ns << "\n";
+    file << "dsb_ns = " << results.dsb_ns << "\n";
+    if (results.have_gpiomem)
+    {
+        file << "gpiomem_write_ns = " << results.gpiomem_write_ns << "\n";
+    }
+    file << "consecutive_gpio_writes = " << results.consecutive_gpio_writes << "\n";
+
+    // Write the temporary file, then rename it over the tuning file
+    std::string tmp_path = path + ".tmp";
+    ::mkdir(path.substr(0, path.find_last_of('/')).c_str(), 0755);
+    std::ofstream tmp(tmp_path, std::ios::trunc);
+    tmp << file.str();
+    tmp.close();
+    if (!tmp || (std::rename(tmp_path.c_str(), path.c_str()) != 0))
+    {
+        std::remove(tmp_path.c_str());
+        return false;
+    }
+    return true;
+}
+
+//----------------------------------------------------------------------------
+// _print_results
+//----------------------------------------------------------------------------
+void _print_results(const MmioResults &results)
+{
+    auto line = [](const char *name, double ns) {
+        MSG(std::left << std::setw(34) << name << std::right << std::fixed << std::setprecision(2) << std::setw(8) << ns << " ns");
+    };
+    line("GPSET0 store, back-to-back", results.write_ns);
+    line("GPSET0/GPCLR0 store, alternating", results.write_alt_ns);
+    line("GPLEV0 read after a store", results.read_after_write_ns);
+    line("Store barrier (dmb)", results.dmb_ns);
+    line("Sync barrier (dsb)", results.dsb_ns);
+    if (results.have_gpiomem)
+    {
+        line("GPSET0 store through gpiomem", results.gpiomem_write_ns);
+    }
+    line("CPU kernel loop per bit", results.bit_loop_ns);
+    line("Table kernel dispatch per byte", results.byte_dispatch_ns);
+    MSG("\nKernel time per byte (ns)   cpu   table");
+    for (uint i=0; i<NUM_ORDERINGS; i++)
+    {
+        MSG(std::left << std::setw(24) << (std::string(ordering_names[i]) + " ordering") << std::right << std::fixed <<
+            std::setprecision(1) << std::setw(8) << results.cpu_byte_ns[i] << std::setw(8) << results.table_byte_ns[i] <<
+            ((i == _build_ordering()) ? "   (this build)" : ""));
+    }
+    MSG("");
+    MSG("Consecutive DCLK writes for a " << ConfigProtocol::MIN_CLOCK_PULSE_NS << "ns pulse (" <<
+        ConfigProtocol::NAME << "): " << results.consecutive_gpio_writes << ", built with " << NUM_CONSECUTIVE_GPIO_WRITES);
+}
+
+//----------------------------------------------------------------------------
+// _print_usage
+//----------------------------------------------------------------------------
+void _print_usage()
+{
+    MSG("Usage: fpga_mmio_bench [options]");
+    MSG("  -o <file>   Tuning file to write (default " << TUNING_FILE_PATH << ")");
+    MSG("  -p          Print the results only, without writing the tuning file");
+    MSG("  -n <runs>   Number of runs of each measurement (default " << DEFAULT_NUM_RUNS << ")");
+    MSG("  -c <cpu>    CPU to pin the bench to");
+    MSG("  -h          Show this help");
+}
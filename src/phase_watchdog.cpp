@@ -0,0 +1,173 @@
+/**
+ *-----------------------------------------------------------------------------
+ * Copyright (c) 2021-2024 Melbourne Instruments, Australia
+ *-----------------------------------------------------------------------------
+ * @file  phase_watchdog.cpp
+ * @brief Deadlines for the phases of a configuration.
+ *-----------------------------------------------------------------------------
+ */
+#include <iostream>
+#include <cerrno>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/timerfd.h>
+#include <sys/eventfd.h>
+#include "common.h"
+#include "phase_watchdog.h"
+
+// Constants
+const char *watchdog_phase_names[] = { "none", "load", "nCONFIG wait", "transfer", "CONF_DONE wait" };
+
+//----------------------------------------------------------------------------
+// start
+//----------------------------------------------------------------------------
+bool PhaseWatchdog::start(std::atomic<bool> &exit_flag, void (*force_safe_state)(), void (*before_exit)())
+{
+    _timer_fd = ::timerfd_create(CLOCK_MONOTONIC, (TFD_CLOEXEC|TFD_NONBLOCK));
+    _event_fd = ::eventfd(0, EFD_CLOEXEC);
+    if ((_timer_fd < 0) || (_event_fd < 0))
+    {
+        stop();
+        return false;
+    }
+    _exit_flag = &exit_flag;
+    _force_safe_state = force_safe_state;
+    _before_exit = before_exit;
+    _thread = std::thread(&PhaseWatchdog::_run, this);
+    return true;
+}
+
+//----------------------------------------------------------------------------
+// stop
+//----------------------------------------------------------------------------
+void PhaseWatchdog::stop()
+{
+    if (_thread.joinable())
+    {
+        uint64_t value = 1;
+        [[maybe_unused]] auto ret = ::write(_event_fd, &value, sizeof(value));
+        _thread.join();
+    }
+    if (_timer_fd >= 0)
+    {
+        ::close(_timer_fd);
+        _timer_fd = -1;
+    }
+    if (_event_fd >= 0)
+    {
+        ::close(_event_fd);
+        _event_fd = -1;
+    }
+}
+
+//----------------------------------------------------------------------------
+// arm
+// Starts the deadline of the phase, replacing that of any previous phase.
+//----------------------------------------------------------------------------
+void PhaseWatchdog::arm(WatchdogPhase phase)
+{
+    if (_timer_fd >= 0)
+    {
+        _phase = phase;
+        _seq++;
+        _set_timer(WATCHDOG_DEADLINES_MS[static_cast<uint>(phase)]);
+    }
+}
+
+//----------------------------------------------------------------------------
+// disarm
+// Ends the phase, which also tells the watchdog that an overrun phase has
+// returned.
+//----------------------------------------------------------------------------
+void PhaseWatchdog::disarm()
+{
+    if (_timer_fd >= 0)
+    {
+        _phase = WatchdogPhase::NONE;
+        _seq++;
+        _set_timer(0);
+    }
+}
+
+//----------------------------------------------------------------------------
+// _run
+//----------------------------------------------------------------------------
+void PhaseWatchdog::_run()
+{
+    struct pollfd fds[2] = {{_timer_fd, POLLIN, 0}, {_event_fd, POLLIN, 0}};
+
+    while (true)
+    {
+        // Wait for a deadline, or the app to stop us
+        while ((::poll(fds, 2, -1) < 0) && (errno == EINTR))
+        {
+        }
+        if (fds[1].revents)
+        {
+            return;
+        }
+        uint64_t expirations;
+        uint seq = _seq;
+        WatchdogPhase phase = _phase;
+        if ((::read(_timer_fd, &expirations, sizeof(expirations)) != sizeof(expirations)) || (phase == WatchdogPhase::NONE))
+        {
+            // Disarmed or re-armed as it expired
+            continue;
+        }
+
+        // Cancel the phase, and make the pins safe straight away
+        MSG("Watchdog: " << watchdog_phase_name(phase) << " overran its " <<
+            WATCHDOG_DEADLINES_MS[static_cast<uint>(phase)] << "ms deadline");
+        _expired = phase;
+        _exit_flag->store(true);
+        if (_force_safe_state)
+        {
+            _force_safe_state();
+        }
+
+        // Give the phase time to return (disarm or re-arm), otherwise exit
+        auto timeout = std::chrono::steady_clock::now() + std::chrono::milliseconds(WATCHDOG_GRACE_MS);
+        while ((_seq == seq) && (std::chrono::steady_clock::now() < timeout) && !fds[1].revents)
+        {
+            ::poll(&fds[1], 1, 1);
+        }
+        if ((_seq == seq) && !fds[1].revents)
+        {
+            MSG("Watchdog: " << watchdog_phase_name(phase) << " did not return, exiting");
+            if (_before_exit)
+            {
+                _before_exit();
+            }
+            ::_exit(watchdog_exit_code(phase));
+        }
+    }
+}
+
+//----------------------------------------------------------------------------
+// _set_timer
+// A time of 0 disarms the timer.
+//----------------------------------------------------------------------------
+void PhaseWatchdog::_set_timer(uint ms)
+{
+    struct itimerspec spec = {};
+    spec.it_value.tv_sec = ms / 1000;
+    spec.it_value.tv_nsec = (ms % 1000) * 1000000;
+    ::timerfd_settime(_timer_fd, 0, &spec, nullptr);
+}
+
+//----------------------------------------------------------------------------
+// watchdog_phase_name
+//----------------------------------------------------------------------------
+const char *watchdog_phase_name(WatchdogPhase phase)
+{
+    return watchdog_phase_names[static_cast<uint>(phase)];
+}
+
+//----------------------------------------------------------------------------
+// watchdog_exit_code
+// 3 load, 4 nCONFIG wait, 5 transfer, 6 CONF_DONE wait.
+//----------------------------------------------------------------------------
+int watchdog_exit_code(WatchdogPhase phase)
+{
+    return WATCHDOG_EXIT_CODE_BASE + static_cast<int>(phase) - static_cast<int>(WatchdogPhase::LOAD);
+}
@@ -0,0 +1,75 @@
+/**
+ *-----------------------------------------------------------------------------
+ * Copyright (c) 2021-2024 Melbourne Instruments, Australia
+ *-----------------------------------------------------------------------------
+ * @file  phase_watchdog.h
+ * @brief Deadlines for the phases of a configuration.
+ *
+ * Each phase (loading the images, the nCONFIG wait, the transfer and the
+ * CONF_DONE wait) is armed with a deadline on a CLOCK_MONOTONIC timerfd,
+ * which a watchdog thread waits on. If a phase overruns, the watchdog puts
+ * the pins into a safe state and sets the exit flag, which cancels the
+ * phase like an abort, and records the phase so the app can retry or fail
+ * with the exit code of the phase. If the phase does not return within
+ * WATCHDOG_GRACE_MS (e.g. a read hung in the kernel), the watchdog calls
+ * the before exit callback (to restore any system settings) and exits the
+ * app with that exit code itself, so the worst-case configuration time is
+ * bounded by the sum of the deadlines.
+ *-----------------------------------------------------------------------------
+ */
+#ifndef _PHASE_WATCHDOG_H
+#define _PHASE_WATCHDOG_H
+
+#include <atomic>
+#include <thread>
+#include <sys/types.h>
+
+// Watchdog phases
+enum class WatchdogPhase : uint
+{
+    NONE,
+    LOAD,
+    NCONFIG_WAIT,
+    TRANSFER,
+    CONF_DONE_WAIT
+};
+
+// Constants
+constexpr uint WATCHDOG_DEADLINES_MS[]    = { 0, 5000, 100, 2000, 100 };
+constexpr uint WATCHDOG_GRACE_MS          = 100;
+constexpr int WATCHDOG_EXIT_CODE_BASE     = 3;    // Exit code of the load phase, then one per phase
+
+// Phase watchdog
+class PhaseWatchdog
+{
+public:
+    PhaseWatchdog() = default;
+    ~PhaseWatchdog() { stop(); }
+
+    bool start(std::atomic<bool> &exit_flag, void (*force_safe_state)(), void (*before_exit)()=nullptr);
+    void stop();
+    void arm(WatchdogPhase phase);
+    void disarm();
+    void clear() { _expired = WatchdogPhase::NONE; }
+    WatchdogPhase expired() const { return _expired; }
+
+private:
+    int _timer_fd = -1;
+    int _event_fd = -1;
+    std::atomic<bool> *_exit_flag = nullptr;
+    void (*_force_safe_state)() = nullptr;
+    void (*_before_exit)() = nullptr;
+    std::atomic<WatchdogPhase> _phase{WatchdogPhase::NONE};
+    std::atomic<WatchdogPhase> _expired{WatchdogPhase::NONE};
+    std::atomic<uint> _seq{0};
+    std::thread _thread;
+
+    void _run();
+    void _set_timer(uint ms);
+};
+
+// Functions
+const char *watchdog_phase_name(WatchdogPhase phase);
+int watchdog_exit_code(WatchdogPhase phase);
+
+#endif  // _PHASE_WATCHDOG_H
@@ -0,0 +1,196 @@
+/**
+ *-----------------------------------------------------------------------------
+ * Copyright (c) 2021-2024 Melbourne Instruments, Australia
+ *-----------------------------------------------------------------------------
+ * @file  progress.cpp
+ * @brief Transfer progress reporting.
+ *-----------------------------------------------------------------------------
+ */
+#include <iostream>
+#include <iomanip>
+#include <sstream>
+#include <new>
+#include <ctime>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "progress.h"
+
+// Local functions
+uint64_t _monotonic_ns();
+
+//----------------------------------------------------------------------------
+// TransferProgress::begin
+//----------------------------------------------------------------------------
+void TransferProgress::begin(uint fpga_num, uint64_t size)
+{
+    bytes_sent.store(0);
+    total_bytes.store(size);
+    start_ns.store(_monotonic_ns());
+    end_ns.store(0);
+    fpga.store(fpga_num);
+    state.store(TransferState::RUNNING);
+}
+
+//----------------------------------------------------------------------------
+// TransferProgress::end
+//----------------------------------------------------------------------------
+void TransferProgress::end(bool aborted)
+{
+    if (!aborted)
+    {
+        bytes_sent.store(total_bytes.load());
+    }
+    end_ns.store(_monotonic_ns());
+    state.store(aborted ? TransferState::ABORTED : TransferState::DONE);
+}
+
+//----------------------------------------------------------------------------
+// ProgressSegment::open
+//----------------------------------------------------------------------------
+bool ProgressSegment::open(const char *path)
+{
+    // Create the segment, readable by everyone. The path is in a shared
+    // directory, so a symlink is not followed, and the segment must be a
+    // regular file owned by us before it is resized
+    close();
+    int fd = ::open(path, (O_RDWR|O_CREAT|O_CLOEXEC|O_NOFOLLOW), 0644);
+    if (fd < 0)
+    {
+        return false;
+    }
+    struct stat st;
+    if ((::fstat(fd, &st) != 0) || !S_ISREG(st.st_mode) || (st.st_uid != ::geteuid()))
+    {
+        ::close(fd);
+        return false;
+    }
+    if (::ftruncate(fd, sizeof(TransferProgress)) != 0)
+    {
+        ::close(fd);
+        return false;
+    }
+    void *mem = ::mmap(nullptr, sizeof(TransferProgress), (PROT_READ|PROT_WRITE), MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (mem == MAP_FAILED)
+    {
+        return false;
+    }
+
+    // Initialise it, the magic is set last so readers only see a valid segment
+    _progress = new (mem) TransferProgress();
+    _progress->version = PROGRESS_VERSION;
+    std::atomic_thread_fence(std::memory_order_release);
+    _progress->magic = PROGRESS_MAGIC;
+    return true;
+}
+
+//----------------------------------------------------------------------------
+// ProgressSegment::close
+// The segment file is left in place so readers see the final state.
+//----------------------------------------------------------------------------
+void ProgressSegment::close()
+{
+    if (_progress)
+    {
+        ::munmap(_progress, sizeof(TransferProgress));
+        _progress = nullptr;
+    }
+}
+
+//----------------------------------------------------------------------------
+// ProgressReporter::start
+//----------------------------------------------------------------------------
+void ProgressReporter::start(const TransferProgress *progress)
+{
+    stop();
+    _progress = progress;
+    _quit = false;
+    _thread = std::thread(&ProgressReporter::_run, this);
+}
+
+//----------------------------------------------------------------------------
+// ProgressReporter::stop
+//----------------------------------------------------------------------------
+void ProgressReporter::stop()
+{
+    if (_thread.joinable())
+    {
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _quit = true;
+        }
+        _notifier.notify_all();
+        _thread.join();
+    }
+}
+
+//----------------------------------------------------------------------------
+// ProgressReporter::end_line
+// Shows the final progress of the transfer and ends the progress line, so
+// the app can print its own messages.
+//----------------------------------------------------------------------------
+void ProgressReporter::end_line()
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    if (_thread.joinable())
+    {
+        _show();
+        if (_line_shown)
+        {
+            std::cout << std::endl;
+            _line_shown = false;
+        }
+    }
+}
+
+//----------------------------------------------------------------------------
+// ProgressReporter::_run
+//----------------------------------------------------------------------------
+void ProgressReporter::_run()
+{
+    std::unique_lock<std::mutex> lock(_mutex);
+    while (!_notifier.wait_for(lock, std::chrono::milliseconds(PROGRESS_REPORT_MS), [this]{ return _quit; }))
+    {
+        if (_progress->state.load() == TransferState::RUNNING)
+        {
+            _show();
+        }
+    }
+}
+
+//----------------------------------------------------------------------------
+// ProgressReporter::_show
+// Shows the percentage sent, the rate, and the estimated time remaining.
+// Called with the mutex held.
+//----------------------------------------------------------------------------
+void ProgressReporter::_show()
+{
+    uint64_t total = _progress->total_bytes.load();
+    uint64_t sent = _progress->bytes_sent.load(std::memory_order_relaxed);
+    uint64_t end_ns = _progress->end_ns.load();
+    double elapsed_s = ((end_ns ? end_ns : _monotonic_ns()) - _progress->start_ns.load()) / 1e9;
+    double rate = (elapsed_s > 0) ? (sent / elapsed_s) : 0;
+
+    if ((_progress->state.load() == TransferState::IDLE) || (total == 0))
+    {
+        return;
+    }
+    std::ostringstream line;
+    line << "\rFPGA" << _progress->fpga.load() << ": " << std::setw(3) << ((sent * 100) / total) << "%, " <<
+            std::fixed << std::setprecision(2) << (rate / 1e6) << " MB/s, ETA " <<
+            ((rate > 0) ? ((total - sent) / rate) : 0.0) << "s   ";
+    std::cout << line.str() << std::flush;
+    _line_shown = true;
+}
+
+//----------------------------------------------------------------------------
+// _monotonic_ns
+//----------------------------------------------------------------------------
+uint64_t _monotonic_ns()
+{
+    struct timespec ts;
+    ::clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (static_cast<uint64_t>(ts.tv_sec) * 1000000000) + ts.tv_nsec;
+}
@@ -0,0 +1,103 @@
+/**
+ *-----------------------------------------------------------------------------
+ * Copyright (c) 2021-2024 Melbourne Instruments, Australia
+ *-----------------------------------------------------------------------------
+ * @file  progress.h
+ * @brief Transfer progress reporting.
+ *
+ * The transfer kernels publish the number of bytes sent once per chunk with
+ * a relaxed store to a counter on its own cache line, so reporting costs
+ * nothing in the bit loop. The counters live in a shared memory segment that
+ * other processes (e.g. the UI) can map read-only, and the optional console
+ * reporter thread reads the same counters.
+ *-----------------------------------------------------------------------------
+ */
+#ifndef _PROGRESS_H
+#define _PROGRESS_H
+
+#include <cstdint>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <sys/types.h>
+
+// Constants
+constexpr char PROGRESS_SEGMENT_PATH[] = "/dev/shm/fpga_config.progress";
+constexpr uint32_t PROGRESS_MAGIC      = 0x50475046;    // "FPGP"
+constexpr uint32_t PROGRESS_VERSION    = 1;
+constexpr uint CACHE_LINE_SIZE         = 64;
+constexpr uint PROGRESS_REPORT_MS      = 200;
+
+// Transfer states
+enum class TransferState : uint32_t
+{
+    IDLE,
+    RUNNING,
+    DONE,
+    ABORTED
+};
+
+// Transfer progress, as laid out in the shared memory segment. The bytes
+// sent counter is the only field written during the transfer, and has its
+// own cache line
+struct TransferProgress
+{
+    uint32_t magic;
+    uint32_t version;
+    std::atomic<uint32_t> fpga;
+    std::atomic<TransferState> state;
+    std::atomic<uint64_t> total_bytes;
+    std::atomic<uint64_t> start_ns;
+    std::atomic<uint64_t> end_ns;
+    alignas(CACHE_LINE_SIZE) std::atomic<uint64_t> bytes_sent;
+
+    void begin(uint fpga_num, uint64_t size);
+    void end(bool aborted);
+    inline void publish(uint64_t num_bytes)
+    {
+        bytes_sent.store(num_bytes, std::memory_order_relaxed);
+    }
+};
+
+// The shared memory segment holding the transfer progress. If it cannot be
+// created the progress is kept in process memory
+class ProgressSegment
+{
+public:
+    ProgressSegment() = default;
+    ~ProgressSegment() { close(); }
+
+    bool open(const char *path);
+    void close();
+    TransferProgress *progress() { return _progress ? _progress : &_local; }
+
+private:
+    TransferProgress *_progress = nullptr;
+    TransferProgress _local = {};
+};
+
+// Shows the transfer progress on the console
+class ProgressReporter
+{
+public:
+    ProgressReporter() = default;
+    ~ProgressReporter() { stop(); }
+
+    void start(const TransferProgress *progress);
+    void stop();
+    void end_line();
+
+private:
+    const TransferProgress *_progress = nullptr;
+    std::mutex _mutex;
+    std::condition_variable _notifier;
+    bool _quit = false;
+    bool _line_shown = false;
+    std::thread _thread;
+
+    void _run();
+    void _show();
+};
+
+#endif  // _PROGRESS_H
@@ -0,0 +1,88 @@
+/**
+ *-----------------------------------------------------------------------------
+ * Copyright (c) 2021-2024 Melbourne Instruments, Australia
+ *-----------------------------------------------------------------------------
+ * @file  protocol.h
+ * @brief Serial configuration protocols of the supported FPGA families.
+ *
+ * The protocol (bit order, config pin timing, completion pins and trailing
+ * clocks) is a compile-time trait, selected with FPGA_PROTOCOL in CMake, so
+ * every family shares the same kernels, backends and instrumentation at no
+ * runtime cost. The config pins keep their Intel names in gpio.h, and are
+ * wired to the equivalent pins of the other families:
+ *
+ *   Intel passive serial   Xilinx slave serial   Lattice slave serial
+ *   nCONFIG                PROGRAM_B             PROGRAMN
+ *   nSTATUS                INIT_B                INITN
+ *   CONF_DONE              DONE                  DONE
+ *   DCLK/DATA0             CCLK/DIN              CCLK/SI
+ *
+ * All three reset the FPGA while the config pin is low, signal readiness
+ * and errors on the status pin, and sample the data on the rising clock
+ * edge (SPI mode 0). Selecting FPGA2 with nCE is a board function, and is
+ * the same for every protocol.
+ *-----------------------------------------------------------------------------
+ */
+#ifndef _PROTOCOL_H
+#define _PROTOCOL_H
+
+#include <sys/types.h>
+
+// Intel (Altera) passive serial
+struct IntelPassiveSerial
+{
+    static constexpr char NAME[]             = "intel-ps";
+    static constexpr char CONFIG_PIN[]       = "nCONFIG";
+    static constexpr char STATUS_PIN[]       = "nSTATUS";
+    static constexpr char DONE_PIN[]         = "CONF_DONE";
+    static constexpr bool MSB_FIRST          = false;
+    static constexpr uint CONFIG_WAIT_US     = 1000;    // Config pin high to the first clock
+    static constexpr uint NUM_TRAILING_DCLKS = 10;      // At least 2 after CONF_DONE, 10 to be safe
+    static constexpr uint MIN_CLOCK_PULSE_NS = 4;       // tCH/tCL of DCLK
+};
+
+// Xilinx slave serial
+struct XilinxSlaveSerial
+{
+    static constexpr char NAME[]             = "xilinx-ss";
+    static constexpr char CONFIG_PIN[]       = "PROGRAM_B";
+    static constexpr char STATUS_PIN[]       = "INIT_B";
+    static constexpr char DONE_PIN[]         = "DONE";
+    static constexpr bool MSB_FIRST          = true;
+    static constexpr uint CONFIG_WAIT_US     = 5000;    // Covers the INIT_B rise when it is not read
+    static constexpr uint NUM_TRAILING_DCLKS = 64;      // Clocks the startup sequence after DONE
+    static constexpr uint MIN_CLOCK_PULSE_NS = 5;       // CCLK high/low time at 100MHz
+};
+
+// Lattice slave serial
+struct LatticeSlaveSerial
+{
+    static constexpr char NAME[]             = "lattice-ss";
+    static constexpr char CONFIG_PIN[]       = "PROGRAMN";
+    static constexpr char STATUS_PIN[]       = "INITN";
+    static constexpr char DONE_PIN[]         = "DONE";
+    static constexpr bool MSB_FIRST          = true;
+    static constexpr uint CONFIG_WAIT_US     = 5000;    // Covers the INITN rise when it is not read
+    static constexpr uint NUM_TRAILING_DCLKS = 128;     // Clocks the wake-up sequence after DONE
+    static constexpr uint MIN_CLOCK_PULSE_NS = 8;       // CCLK high/low time at 66MHz, rounded up
+};
+
+// The protocol of this build
+#if FPGA_CONFIG_PROTOCOL == 1
+using ConfigProtocol = XilinxSlaveSerial;
+#elif FPGA_CONFIG_PROTOCOL == 2
+using ConfigProtocol = LatticeSlaveSerial;
+#else
+using ConfigProtocol = IntelPassiveSerial;
+#endif
+
+//----------------------------------------------------------------------------
+// protocol_bit_shift
+// The shift of the nth bit of a byte to be sent.
+//----------------------------------------------------------------------------
+constexpr uint protocol_bit_shift(uint n)
+{
+    return ConfigProtocol::MSB_FIRST ? (7 - n) : n;
+}
+
+#endif  // _PROTOCOL_H
@@ -0,0 +1,35 @@
+/**
+ *-----------------------------------------------------------------------------
+ * Copyright (c) 2021-2024 Melbourne Instruments, Australia
+ *-----------------------------------------------------------------------------
+ * @file  resource_usage.cpp
+ * @brief Page faults, context switches and peak RSS of each phase.
+ *-----------------------------------------------------------------------------
+ */
+#include <sys/resource.h>
+#include "resource_usage.h"
+
+//----------------------------------------------------------------------------
+// sample_usage
+// The counters of the calling thread, or the whole process.
+//----------------------------------------------------------------------------
+ResourceUsage sample_usage(bool thread)
+{
+    struct rusage usage = {};
+    ::getrusage((thread ? RUSAGE_THREAD : RUSAGE_SELF), &usage);
+    return { static_cast<uint32_t>(usage.ru_maxrss), static_cast<uint32_t>(usage.ru_majflt),
+             static_cast<uint32_t>(usage.ru_minflt), static_cast<uint32_t>(usage.ru_nvcsw),
+             static_cast<uint32_t>(usage.ru_nivcsw) };
+}
+
+//----------------------------------------------------------------------------
+// usage_since
+// Must be called on the thread (or for the process) the start was sampled
+// on.
+//----------------------------------------------------------------------------
+ResourceUsage usage_since(const ResourceUsage &start, bool thread)
+{
+    ResourceUsage end = sample_usage(thread);
+    return { end.max_rss_kb, (end.major_faults - start.major_faults), (end.minor_faults - start.minor_faults),
+             (end.vol_switches - start.vol_switches), (end.invol_switches - start.invol_switches) };
+}
@@ -0,0 +1,33 @@
+/**
+ *-----------------------------------------------------------------------------
+ * Copyright (c) 2021-2024 Melbourne Instruments, Australia
+ *-----------------------------------------------------------------------------
+ * @file  resource_usage.h
+ * @brief Page faults, context switches and peak RSS of each phase.
+ *
+ * Each phase is sampled with getrusage just before and after it, for the
+ * thread that runs it (RUSAGE_THREAD), so e.g. the faults of the loader
+ * thread do not show up in the transfer. The peak RSS is always that of
+ * the process, at the end of the phase.
+ *-----------------------------------------------------------------------------
+ */
+#ifndef _RESOURCE_USAGE_H
+#define _RESOURCE_USAGE_H
+
+#include <cstdint>
+
+// Resource usage of a phase, as laid out in the history file
+struct ResourceUsage
+{
+    uint32_t max_rss_kb;
+    uint32_t major_faults;
+    uint32_t minor_faults;
+    uint32_t vol_switches;
+    uint32_t invol_switches;
+};
+
+// Functions
+ResourceUsage sample_usage(bool thread);
+ResourceUsage usage_since(const ResourceUsage &start, bool thread);
+
+#endif  // _RESOURCE_USAGE_H
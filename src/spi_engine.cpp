@@ -0,0 +1,318 @@
+/**
+ *-----------------------------------------------------------------------------
+ * Copyright (c) 2021-2024 Melbourne Instruments, Australia
+ *-----------------------------------------------------------------------------
+ * @file  spi_engine.cpp
+ * @brief Passive serial transfer using the SPI peripheral.
+ *-----------------------------------------------------------------------------
+ */
+#include <cstring>
+#include <fstream>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <linux/spi/spidev.h>
+#if defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+#include "gpio.h"
+#include "spi_engine.h"
+#include "protocol.h"
+
+// Constants
+constexpr char SPIDEV_BUFSIZ_PATH[]   = "/sys/module/spidev/parameters/bufsiz";
+constexpr uint SPIDEV_DEFAULT_BUFSIZ  = 4096;
+constexpr uint SPI_NUM_TRAILING_BYTES = (ConfigProtocol::NUM_TRAILING_DCLKS + 7) / 8;
+
+// Submits messages to the SPI device from a worker thread, so that the next
+// chunk can be prepared while the current one is being sent
+class SpiSubmitter
+{
+public:
+    SpiSubmitter(SpiDevice &device) : _device(device), _thread(&SpiSubmitter::_run, this) {}
+    ~SpiSubmitter()
+    {
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _quit = true;
+        }
+        _notifier.notify_all();
+        _thread.join();
+    }
+
+    void submit(const uint8_t *buf, uint len)
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _buf = buf;
+        _len = len;
+        _busy = true;
+        _notifier.notify_all();
+    }
+
+    bool wait()
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        _notifier.wait(lock, [this]{ return !_busy; });
+        return _ok;
+    }
+
+private:
+    SpiDevice &_device;
+    std::mutex _mutex;
+    std::condition_variable _notifier;
+    const uint8_t *_buf = nullptr;
+    uint _len = 0;
+    bool _busy = false;
+    bool _ok = true;
+    bool _quit = false;
+    std::thread _thread;
+
+    void _run()
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        while (true)
+        {
+            _notifier.wait(lock, [this]{ return _busy || _quit; });
+            if (_quit)
+            {
+                break;
+            }
+
+            // Split the message into transfers and send it
+            SpiTransfer transfers[SPI_MAX_TRANSFERS];
+            uint num_transfers = 0;
+            for (uint pos=0; pos<_len; pos+=SPI_TRANSFER_LEN)
+            {
+                transfers[num_transfers++] = { (_buf + pos), std::min(SPI_TRANSFER_LEN, (_len - pos)) };
+            }
+            lock.unlock();
+            bool ok = _device.submit(transfers, num_transfers);
+            lock.lock();
+            _ok &= ok;
+            _busy = false;
+            _notifier.notify_all();
+        }
+    }
+};
+
+//----------------------------------------------------------------------------
+// SpidevDevice::open
+//----------------------------------------------------------------------------
+bool SpidevDevice::open(const char *dev_name, uint speed_hz)
+{
+    uint8_t mode = SPI_MODE_0 | SPI_NO_CS;
+    uint8_t bits = 8;
+
+    // Open the device and set it to mode 0, 8-bit, no chip select
+    _fd = ::open(dev_name, O_RDWR);
+    if (_fd < 0)
+    {
+        return false;
+    }
+    if ((::ioctl(_fd, SPI_IOC_WR_MODE, &mode) < 0) ||
+        (::ioctl(_fd, SPI_IOC_WR_BITS_PER_WORD, &bits) < 0) ||
+        (::ioctl(_fd, SPI_IOC_WR_MAX_SPEED_HZ, &speed_hz) < 0))
+    {
+        close();
+        return false;
+    }
+    _speed_hz = speed_hz;
+
+    // spidev limits the total size of a message to its bufsiz parameter, which
+    // can be raised on the kernel command line to allow larger messages
+    std::ifstream bufsiz_file(SPIDEV_BUFSIZ_PATH);
+    if (!(bufsiz_file >> _bufsiz) || (_bufsiz < SPI_TRANSFER_LEN))
+    {
+        _bufsiz = SPIDEV_DEFAULT_BUFSIZ;
+    }
+    _bufsiz = std::min(_bufsiz, (SPI_MAX_TRANSFERS * SPI_TRANSFER_LEN));
+    return true;
+}
+
+//----------------------------------------------------------------------------
+// SpidevDevice::close
+//----------------------------------------------------------------------------
+void SpidevDevice::close()
+{
+    if (_fd >= 0)
+    {
+        ::close(_fd);
+        _fd = -1;
+    }
+}
+
+//----------------------------------------------------------------------------
+// SpidevDevice::submit
+//----------------------------------------------------------------------------
+bool SpidevDevice::submit(const SpiTransfer *transfers, uint num_transfers)
+{
+    struct spi_ioc_transfer xfers[SPI_MAX_TRANSFERS];
+
+    std::memset(xfers, 0, sizeof(xfers));
+    for (uint i=0; i<num_transfers; i++)
+    {
+        xfers[i].tx_buf = reinterpret_cast<uintptr_t>(transfers[i].tx);
+        xfers[i].len = transfers[i].len;
+        xfers[i].speed_hz = _speed_hz;
+        xfers[i].bits_per_word = 8;
+    }
+    return ::ioctl(_fd, SPI_IOC_MESSAGE(num_transfers), xfers) >= 0;
+}
+
+//----------------------------------------------------------------------------
+// SpiRecordDevice::submit
+//----------------------------------------------------------------------------
+bool SpiRecordDevice::submit(const SpiTransfer *transfers, uint num_transfers)
+{
+    uint total = 0;
+
+    for (uint i=0; i<num_transfers; i++)
+    {
+        _bytes.insert(_bytes.end(), transfers[i].tx, (transfers[i].tx + transfers[i].len));
+        total += transfers[i].len;
+    }
+    _num_messages++;
+    return (num_transfers <= SPI_MAX_TRANSFERS) && (total <= _max_message_size);
+}
+
+//----------------------------------------------------------------------------
+// SpiEngine::transfer
+// The image is sent one message at a time. While a message is being sent
+// the next chunk is translated into the other buffer. A couple of zero
+// bytes are appended to provide the trailing DCLKs.
+//----------------------------------------------------------------------------
+bool SpiEngine::transfer(const uint8_t *data, uint size, const std::atomic<bool> &exit_flag)
+{
+    uint chunk_size = _device.max_message_size() - SPI_NUM_TRAILING_BYTES;
+    std::vector<uint8_t> buffers[2];
+    SpiSubmitter submitter(_device);
+    uint pos = 0;
+    uint sent = 0;
+    uint cur = 0;
+
+    buffers[0].resize(chunk_size + SPI_NUM_TRAILING_BYTES);
+    buffers[1].resize(chunk_size + SPI_NUM_TRAILING_BYTES);
+    while (!exit_flag)
+    {
+        // Prepare the next chunk, appending the trailing DCLKs to the last one
+        uint len = std::min(chunk_size, (size - pos));
+        spi_translate(buffers[cur].data(), (data + pos), len);
+        pos += len;
+        if (pos == size)
+        {
+            std::memset((buffers[cur].data() + len), 0, SPI_NUM_TRAILING_BYTES);
+            len += SPI_NUM_TRAILING_BYTES;
+        }
+
+        // Wait for the previous chunk to be sent, and submit this one
+        if (!submitter.wait())
+        {
+            return false;
+        }
+        if (_progress)
+        {
+            _progress->publish(sent);
+        }
+        submitter.submit(buffers[cur].data(), len);
+        sent = pos;
+        if (pos == size)
+        {
+            break;
+        }
+        cur ^= 1;
+    }
+    return submitter.wait() && !exit_flag;
+}
+
+//----------------------------------------------------------------------------
+// SpiEngine::transfer_stream
+// Sends a stream from spi_stream() (e.g. mapped from the stream cache)
+// straight from the caller's memory, so there is nothing to prepare
+// between messages.
+//----------------------------------------------------------------------------
+bool SpiEngine::transfer_stream(const uint8_t *stream, uint size, const std::atomic<bool> &exit_flag)
+{
+    uint chunk_size = _device.max_message_size();
+    SpiSubmitter submitter(_device);
+    uint pos = 0;
+
+    while (!exit_flag && (pos < size))
+    {
+        uint len = std::min(chunk_size, (size - pos));
+        if (!submitter.wait())
+        {
+            return false;
+        }
+        if (_progress)
+        {
+            _progress->publish(pos);
+        }
+        submitter.submit((stream + pos), len);
+        pos += len;
+    }
+    return submitter.wait() && !exit_flag;
+}
+
+//----------------------------------------------------------------------------
+// spi_stream
+// Returns the bytes the SPI kernel sends for an image: the translated
+// image followed by the trailing DCLK bytes.
+//----------------------------------------------------------------------------
+std::vector<uint8_t> spi_stream(const uint8_t *data, uint size)
+{
+    std::vector<uint8_t> stream(size + SPI_NUM_TRAILING_BYTES, 0);
+    spi_translate(stream.data(), data, size);
+    return stream;
+}
+
+//----------------------------------------------------------------------------
+// spi_translate
+// Puts the bytes in the MSB first order the SPI controller shifts out.
+//----------------------------------------------------------------------------
+void spi_translate(uint8_t *dst, const uint8_t *src, uint size)
+{
+    if constexpr (ConfigProtocol::MSB_FIRST)
+    {
+        std::memcpy(dst, src, size);
+    }
+    else
+    {
+        bit_reverse(dst, src, size);
+    }
+}
+
+//----------------------------------------------------------------------------
+// bit_reverse
+// Reverses the bit order of each byte, 16 bytes at a time using NEON when
+// available, otherwise 8 bytes at a time with shifts and masks.
+//----------------------------------------------------------------------------
+void bit_reverse(uint8_t *dst, const uint8_t *src, uint size)
+{
+    uint i = 0;
+
+#if defined(__aarch64__)
+    for (; (i + 16) <= size; i += 16)
+    {
+        vst1q_u8((dst + i), vrbitq_u8(vld1q_u8(src + i)));
+    }
+#endif
+    for (; (i + 8) <= size; i += 8)
+    {
+        uint64_t x;
+        std::memcpy(&x, (src + i), sizeof(x));
+        x = ((x >> 1) & 0x5555555555555555ULL) | ((x & 0x5555555555555555ULL) << 1);
+        x = ((x >> 2) & 0x3333333333333333ULL) | ((x & 0x3333333333333333ULL) << 2);
+        x = ((x >> 4) & 0x0F0F0F0F0F0F0F0FULL) | ((x & 0x0F0F0F0F0F0F0F0FULL) << 4);
+        std::memcpy((dst + i), &x, sizeof(x));
+    }
+    for (; i < size; i++)
+    {
+        uint8_t b = src[i];
+        b = ((b >> 1) & 0x55) | ((b & 0x55) << 1);
+        b = ((b >> 2) & 0x33) | ((b & 0x33) << 2);
+        dst[i] = (b >> 4) | (b << 4);
+    }
+}
@@ -0,0 +1,101 @@
+/**
+ *-----------------------------------------------------------------------------
+ * Copyright (c) 2021-2024 Melbourne Instruments, Australia
+ *-----------------------------------------------------------------------------
+ * @file  spi_engine.h
+ * @brief Passive serial transfer using the SPI peripheral.
+ *
+ * Passive serial is SPI mode 0, so on boards that route DCLK/DATA0 to
+ * SCLK/MOSI the SPI controller can do the shifting. The BCM2711 SPI
+ * controller only shifts MSB first, so for LSB first protocols the image is
+ * bit-reversed a chunk at a time while the previous chunk is being sent.
+ *-----------------------------------------------------------------------------
+ */
+#ifndef _SPI_ENGINE_H
+#define _SPI_ENGINE_H
+
+#include <cstdint>
+#include <vector>
+#include <atomic>
+#include <sys/types.h>
+#include "progress.h"
+
+// Constants
+constexpr char SPI_DEV_NAME[]         = "/dev/spidev0.0";
+constexpr uint SPI_SPEED_HZ           = 20000000;
+constexpr uint SPI_TRANSFER_LEN       = 4096;
+constexpr uint SPI_MAX_TRANSFERS      = 64;
+
+// A single SPI transfer within a message
+struct SpiTransfer
+{
+    const uint8_t *tx;
+    uint len;
+};
+
+// SPI device abstraction, so the engine can drive spidev or a stand-in
+class SpiDevice
+{
+public:
+    virtual ~SpiDevice() = default;
+    virtual uint max_message_size() = 0;
+    virtual bool submit(const SpiTransfer *transfers, uint num_transfers) = 0;
+};
+
+// spidev device
+class SpidevDevice : public SpiDevice
+{
+public:
+    SpidevDevice() = default;
+    ~SpidevDevice() { close(); }
+
+    bool open(const char *dev_name, uint speed_hz);
+    void close();
+    uint max_message_size() override { return _bufsiz; }
+    bool submit(const SpiTransfer *transfers, uint num_transfers) override;
+
+private:
+    int _fd = -1;
+    uint _speed_hz = 0;
+    uint _bufsiz = 0;
+};
+
+// Stand-in SPI device that records the bytes sent
+class SpiRecordDevice : public SpiDevice
+{
+public:
+    SpiRecordDevice(uint max_message_size) : _max_message_size(max_message_size) {}
+
+    uint max_message_size() override { return _max_message_size; }
+    bool submit(const SpiTransfer *transfers, uint num_transfers) override;
+
+    const std::vector<uint8_t> &bytes() const { return _bytes; }
+    uint num_messages() const { return _num_messages; }
+
+private:
+    uint _max_message_size;
+    std::vector<uint8_t> _bytes;
+    uint _num_messages = 0;
+};
+
+// Clocks an image out through an SPI device, double-buffered
+class SpiEngine
+{
+public:
+    SpiEngine(SpiDevice &device) : _device(device) {}
+
+    void set_progress(TransferProgress *progress) { _progress = progress; }
+    bool transfer(const uint8_t *data, uint size, const std::atomic<bool> &exit_flag);
+    bool transfer_stream(const uint8_t *stream, uint size, const std::atomic<bool> &exit_flag);
+
+private:
+    SpiDevice &_device;
+    TransferProgress *_progress = nullptr;
+};
+
+// Functions
+void bit_reverse(uint8_t *dst, const uint8_t *src, uint size);
+void spi_translate(uint8_t *dst, const uint8_t *src, uint size);
+std::vector<uint8_t> spi_stream(const uint8_t *data, uint size);
+
+#endif  // _SPI_ENGINE_H
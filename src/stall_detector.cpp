@@ -0,0 +1,77 @@
+/**
+ *-----------------------------------------------------------------------------
+ * Copyright (c) 2021-2024 Melbourne Instruments, Australia
+ *-----------------------------------------------------------------------------
+ * @file  stall_detector.cpp
+ * @brief Transfer loop stall detector.
+ *-----------------------------------------------------------------------------
+ */
+#include <vector>
+#include <algorithm>
+#include "stall_detector.h"
+
+//----------------------------------------------------------------------------
+// stats
+// The expected chunk time is taken as the median gap, which is robust to
+// the stalls themselves and to a short final chunk.
+//----------------------------------------------------------------------------
+StallStats StallDetector::stats() const
+{
+    StallStats stats;
+    std::vector<uint64_t> gaps;
+
+    // Get the gaps between samples, and build the histogram
+    stats.num_samples = _num_samples;
+    for (uint i=1; i<_num_samples; i++)
+    {
+        uint64_t gap = _samples[i] - _samples[i - 1];
+        uint64_t gap_us = gap / 1000;
+        uint bucket = 0;
+        while ((gap_us >>= 1) && (bucket < (STALL_HISTOGRAM_BUCKETS - 1)))
+        {
+            bucket++;
+        }
+        stats.histogram[bucket]++;
+        gaps.push_back(gap);
+    }
+    if (gaps.empty())
+    {
+        return stats;
+    }
+
+    // Find the median gap, and flag any gaps far above it as stalls
+    std::vector<uint64_t> sorted = gaps;
+    std::nth_element(sorted.begin(), (sorted.begin() + (sorted.size() / 2)), sorted.end());
+    stats.median_gap_ns = sorted[sorted.size() / 2];
+    for (uint64_t gap : gaps)
+    {
+        if (gap > (stats.median_gap_ns * STALL_FACTOR))
+        {
+            uint64_t stall = gap - stats.median_gap_ns;
+            stats.num_stalls++;
+            stats.total_stall_ns += stall;
+            stats.worst_stall_ns = std::max(stats.worst_stall_ns, stall);
+        }
+    }
+    return stats;
+}
+
+//----------------------------------------------------------------------------
+// stalls
+// Returns each stall, taken as the part of the gap over the median gap.
+//----------------------------------------------------------------------------
+std::vector<Stall> StallDetector::stalls() const
+{
+    std::vector<Stall> stalls;
+    StallStats s = stats();
+
+    for (uint i=1; (i<_num_samples) && s.num_stalls; i++)
+    {
+        uint64_t gap = _samples[i] - _samples[i - 1];
+        if (gap > (s.median_gap_ns * STALL_FACTOR))
+        {
+            stalls.push_back({(_samples[i - 1] + s.median_gap_ns), (gap - s.median_gap_ns)});
+        }
+    }
+    return stalls;
+}
@@ -0,0 +1,84 @@
+/**
+ *-----------------------------------------------------------------------------
+ * Copyright (c) 2021-2024 Melbourne Instruments, Australia
+ *-----------------------------------------------------------------------------
+ * @file  stall_detector.h
+ * @brief Transfer loop stall detector.
+ *
+ * The transfer kernel calls sample() once per chunk, which just stores a
+ * timestamp. After the transfer the gaps between samples are put into a
+ * log2 histogram, and any gap well above the median chunk time is counted
+ * as a stall (preemption, interrupt, page fault). Building without
+ * STALL_DETECTOR replaces the detector with a sampler that does nothing.
+ *-----------------------------------------------------------------------------
+ */
+#ifndef _STALL_DETECTOR_H
+#define _STALL_DETECTOR_H
+
+#include <cstdint>
+#include <ctime>
+#include <vector>
+#include <sys/types.h>
+
+#ifndef FPGA_CONFIG_STALL_DETECTOR
+#define FPGA_CONFIG_STALL_DETECTOR 0
+#endif
+
+// Constants
+constexpr uint STALL_MAX_SAMPLES       = 4096;
+constexpr uint STALL_FACTOR            = 4;
+constexpr uint STALL_HISTOGRAM_BUCKETS = 16;
+
+// Stall statistics for a transfer. Histogram bucket n counts the gaps of
+// [2^n, 2^(n+1)) microseconds, with the first and last buckets open ended
+struct StallStats
+{
+    uint num_samples = 0;
+    uint64_t median_gap_ns = 0;
+    uint num_stalls = 0;
+    uint64_t total_stall_ns = 0;
+    uint64_t worst_stall_ns = 0;
+    uint histogram[STALL_HISTOGRAM_BUCKETS] = {};
+};
+
+// A stall, on the CLOCK_MONOTONIC timeline
+struct Stall
+{
+    uint64_t start_ns;
+    uint64_t duration_ns;
+};
+
+// Stall detector
+class StallDetector
+{
+public:
+    void start()
+    {
+        _num_samples = 0;
+        sample();
+    }
+
+    void reset()
+    {
+        _num_samples = 0;
+    }
+
+    inline void sample()
+    {
+        if (_num_samples < STALL_MAX_SAMPLES)
+        {
+            struct timespec ts;
+            ::clock_gettime(CLOCK_MONOTONIC, &ts);
+            _samples[_num_samples++] = (static_cast<uint64_t>(ts.tv_sec) * 1000000000) + ts.tv_nsec;
+        }
+    }
+
+    StallStats stats() const;
+    std::vector<Stall> stalls() const;
+
+private:
+    uint64_t _samples[STALL_MAX_SAMPLES];
+    uint _num_samples = 0;
+};
+
+#endif  // _STALL_DETECTOR_H
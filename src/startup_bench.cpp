@@ -0,0 +1,189 @@
+/**
+ *-----------------------------------------------------------------------------
+ * Copyright (c) 2021-2024 Melbourne Instruments, Australia
+ *-----------------------------------------------------------------------------
+ * @file  startup_bench.cpp
+ * @brief Startup latency benchmark of the FPGA Config app.
+ *
+ * Runs fpga_config a number of times with a trace file, and measures the
+ * time from exec to the start of the FPGA1 transfer (the first DCLK edge)
+ * and to readiness, from the CLOCK_MONOTONIC timestamps in the trace. Any
+ * arguments after the app path are passed on to it, e.g. the kernel. The
+ * app must not be run with --monitor, as each run has to exit.
+ *-----------------------------------------------------------------------------
+ */
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <algorithm>
+#include <vector>
+#include <string>
+#include <cstring>
+#include <cstdlib>
+#include <spawn.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "common.h"
+#include "trace.h"
+
+// Constants
+constexpr uint DEFAULT_NUM_RUNS          = 10;
+constexpr char DEFAULT_TRACE_FILE_PATH[] = "/tmp/fpga_startup_bench.json";
+
+// Local functions
+bool _run_app(const std::vector<std::string> &args, const std::string &trace_file, double &first_edge_us, double &ready_us);
+bool _event_ts(const std::string &trace, const char *name, double &ts_us);
+void _print_stats(const char *name, std::vector<double> values);
+void _print_usage();
+
+//----------------------------------------------------------------------------
+// main
+//----------------------------------------------------------------------------
+int main(int argc, char *argv[])
+{
+    std::vector<double> first_edge_us;
+    std::vector<double> ready_us;
+    std::string trace_file = DEFAULT_TRACE_FILE_PATH;
+    uint num_runs = DEFAULT_NUM_RUNS;
+    int opt;
+
+    // Parse the command line arguments, stopping at the app path
+    while ((opt = ::getopt(argc, argv, "+n:t:h")) != -1)
+    {
+        switch (opt)
+        {
+            case 'n':
+                num_runs = std::strtoul(optarg, nullptr, 10);
+                break;
+
+            case 't':
+                trace_file = optarg;
+                break;
+
+            default:
+                _print_usage();
+                return 1;
+        }
+    }
+    if ((optind == argc) || (num_runs == 0))
+    {
+        _print_usage();
+        return 1;
+    }
+    std::vector<std::string> args(argv + optind, argv + argc);
+
+    // Run the app, keeping the latencies of the runs that configured
+    for (uint i=0; i<num_runs; i++)
+    {
+        double first_edge;
+        double ready;
+        if (!_run_app(args, trace_file, first_edge, ready))
+        {
+            MSG("Run " << (i + 1) << " did not configure the FPGAs");
+            continue;
+        }
+        first_edge_us.push_back(first_edge);
+        ready_us.push_back(ready);
+    }
+    if (ready_us.empty())
+    {
+        MSG("No run configured the FPGAs");
+        return 1;
+    }
+    MSG(ready_us.size() << " of " << num_runs << " runs configured the FPGAs, times in us:");
+    MSG("                     min   median      p90      max");
+    _print_stats("exec to first edge", first_edge_us);
+    _print_stats("exec to ready", ready_us);
+    return 0;
+}
+
+//----------------------------------------------------------------------------
+// _run_app
+// The exec time is taken just before the app is spawned, so it includes
+// the fork, exec and dynamic linking.
+//----------------------------------------------------------------------------
+bool _run_app(const std::vector<std::string> &args, const std::string &trace_file, double &first_edge_us, double &ready_us)
+{
+    std::vector<std::string> app_args = args;
+    std::vector<char *> argv;
+    pid_t pid;
+    int status;
+
+    // Spawn the app with the trace file and wait for it
+    app_args.insert(app_args.end(), {"--trace-file", trace_file});
+    for (std::string &arg : app_args)
+    {
+        argv.push_back(arg.data());
+    }
+    argv.push_back(nullptr);
+    std::remove(trace_file.c_str());
+    double exec_us = TraceRecorder::now_ns() / 1000.0;
+    if (::posix_spawn(&pid, argv[0], nullptr, nullptr, argv.data(), environ) != 0)
+    {
+        MSG("Could not run " << argv[0]);
+        return false;
+    }
+    if ((::waitpid(pid, &status, 0) != pid) || !WIFEXITED(status) || (WEXITSTATUS(status) != 0))
+    {
+        return false;
+    }
+
+    // Get the transfer start and ready times from the trace
+    std::ifstream file(trace_file);
+    std::stringstream trace;
+    double first_edge_ts;
+    double ready_ts;
+    trace << file.rdbuf();
+    if (!_event_ts(trace.str(), "transfer", first_edge_ts) || !_event_ts(trace.str(), "ready", ready_ts))
+    {
+        return false;
+    }
+    first_edge_us = first_edge_ts - exec_us;
+    ready_us = ready_ts - exec_us;
+    return true;
+}
+
+//----------------------------------------------------------------------------
+// _event_ts
+// Returns the timestamp of the first event with the name, in microseconds.
+//----------------------------------------------------------------------------
+bool _event_ts(const std::string &trace, const char *name, double &ts_us)
+{
+    std::string key = std::string("{\"name\":\"") + name + "\"";
+    auto event = trace.find(key);
+    if (event == std::string::npos)
+    {
+        return false;
+    }
+    auto ts = trace.find("\"ts\":", event);
+    if (ts == std::string::npos)
+    {
+        return false;
+    }
+    ts_us = std::strtod((trace.c_str() + ts + std::strlen("\"ts\":")), nullptr);
+    return true;
+}
+
+//----------------------------------------------------------------------------
+// _print_stats
+//----------------------------------------------------------------------------
+void _print_stats(const char *name, std::vector<double> values)
+{
+    std::sort(values.begin(), values.end());
+    auto percentile = [&values](uint p) { return values[((values.size() - 1) * p) / 100]; };
+    MSG(std::left << std::setw(18) << name << std::right << std::fixed << std::setprecision(0) <<
+        std::setw(9) << values.front() << std::setw(9) << percentile(50) << std::setw(9) << percentile(90) <<
+        std::setw(9) << values.back());
+}
+
+//----------------------------------------------------------------------------
+// _print_usage
+//----------------------------------------------------------------------------
+void _print_usage()
+{
+    MSG("Usage: fpga_startup_bench [options] <fpga_config> [fpga_config options]");
+    MSG("  -n <runs>   Number of runs (default " << DEFAULT_NUM_RUNS << ")");
+    MSG("  -t <file>   Trace file written by each run (default " << DEFAULT_TRACE_FILE_PATH << ")");
+    MSG("  -h          Show this help");
+}
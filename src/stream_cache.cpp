@@ -0,0 +1,221 @@
+/**
+ *-----------------------------------------------------------------------------
+ * Copyright (c) 2021-2024 Melbourne Instruments, Australia
+ *-----------------------------------------------------------------------------
+ * @file  stream_cache.cpp
+ * @brief On-device cache of translated transfer streams.
+ *-----------------------------------------------------------------------------
+ */
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "hash.h"
+#include "stream_cache.h"
+
+// Constants
+constexpr char STREAM_CACHE_SUFFIX[] = ".stream";
+
+// Local functions
+uint64_t _header_checksum(StreamCacheHeader header);
+
+//----------------------------------------------------------------------------
+// set_dir
+// An empty directory disables the cache.
+//----------------------------------------------------------------------------
+void StreamCache::set_dir(const std::string &dir, uint64_t max_bytes)
+{
+    _dir = dir;
+    _max_bytes = max_bytes;
+}
+
+//----------------------------------------------------------------------------
+// map
+// Returns the cached stream, mapped and populated so that replaying it does
+// not page fault, or nullptr if there is no valid entry. The stream is
+// checked against its hash once it is mapped, as it is sent to the FPGA
+// as is. It stays mapped until the cache is closed, and is reused if
+// mapped again.
+//----------------------------------------------------------------------------
+const uint8_t *StreamCache::map(uint64_t image_hash, uint64_t profile_hash, uint &size)
+{
+    StreamCacheHeader header;
+    struct stat st;
+
+    if (_dir.empty())
+    {
+        return nullptr;
+    }
+    for (const Mapping &m : _mappings)
+    {
+        if ((m.image_hash == image_hash) && (m.profile_hash == profile_hash))
+        {
+            size = m.len - sizeof(header);
+            return static_cast<const uint8_t *>(m.addr) + sizeof(header);
+        }
+    }
+
+    // Open the entry and check its header
+    std::string path = _entry_path(image_hash, profile_hash);
+    int fd = ::open(path.c_str(), (O_RDONLY|O_CLOEXEC));
+    if (fd < 0)
+    {
+        return nullptr;
+    }
+    if ((::pread(fd, &header, sizeof(header), 0) != sizeof(header)) || (::fstat(fd, &st) != 0) ||
+        (header.magic != STREAM_CACHE_MAGIC) || (header.version != STREAM_CACHE_VERSION) ||
+        (header.checksum != _header_checksum(header)) || (header.image_hash != image_hash) ||
+        (header.profile_hash != profile_hash) ||
+        (static_cast<uint64_t>(st.st_size) != (sizeof(header) + header.stream_size)))
+    {
+        // The entry is stale or damaged, so delete it
+        ::close(fd);
+        ::unlink(path.c_str());
+        return nullptr;
+    }
+
+    // Map it and check the stream, and mark it as used for the LRU eviction
+    size_t len = st.st_size;
+    void *addr = ::mmap(nullptr, len, PROT_READ, (MAP_SHARED|MAP_POPULATE), fd, 0);
+    ::close(fd);
+    if (addr == MAP_FAILED)
+    {
+        return nullptr;
+    }
+    if (hash_bytes((static_cast<const uint8_t *>(addr) + sizeof(header)), header.stream_size) != header.stream_hash)
+    {
+        ::munmap(addr, len);
+        ::unlink(path.c_str());
+        return nullptr;
+    }
+    ::utimensat(AT_FDCWD, path.c_str(), nullptr, 0);
+    _mappings.push_back({image_hash, profile_hash, addr, len});
+    size = header.stream_size;
+    return static_cast<const uint8_t *>(addr) + sizeof(header);
+}
+
+//----------------------------------------------------------------------------
+// store
+// The entry is written to a temporary file and renamed into place, so a
+// partial entry is never seen.
+//----------------------------------------------------------------------------
+bool StreamCache::store(uint64_t image_hash, uint64_t profile_hash, const uint8_t *stream, uint size)
+{
+    if (_dir.empty() || ((sizeof(StreamCacheHeader) + size) > _max_bytes))
+    {
+        return false;
+    }
+
+    // Write and sync the temporary file
+    StreamCacheHeader header = { STREAM_CACHE_MAGIC, STREAM_CACHE_VERSION, image_hash, profile_hash, size,
+                                 hash_bytes(stream, size), {}, 0 };
+    header.checksum = _header_checksum(header);
+    std::string path = _entry_path(image_hash, profile_hash);
+    std::string tmp_path = path + ".tmp";
+    ::mkdir(_dir.c_str(), 0755);
+    int fd = ::open(tmp_path.c_str(), (O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC), 0644);
+    if (fd < 0)
+    {
+        return false;
+    }
+    bool ok = (::write(fd, &header, sizeof(header)) == sizeof(header)) &&
+              (::write(fd, stream, size) == static_cast<ssize_t>(size)) && (::fsync(fd) == 0);
+    ::close(fd);
+
+    // Rename it into place, and keep the cache within its size limit
+    if (!ok || (::rename(tmp_path.c_str(), path.c_str()) != 0))
+    {
+        ::unlink(tmp_path.c_str());
+        return false;
+    }
+    _evict(path);
+    return true;
+}
+
+//----------------------------------------------------------------------------
+// close
+//----------------------------------------------------------------------------
+void StreamCache::close()
+{
+    for (const Mapping &m : _mappings)
+    {
+        ::munmap(m.addr, m.len);
+    }
+    _mappings.clear();
+}
+
+//----------------------------------------------------------------------------
+// _entry_path
+//----------------------------------------------------------------------------
+std::string StreamCache::_entry_path(uint64_t image_hash, uint64_t profile_hash) const
+{
+    char name[64];
+    std::snprintf(name, sizeof(name), "%016llx-%016llx%s", static_cast<unsigned long long>(image_hash),
+                  static_cast<unsigned long long>(profile_hash), STREAM_CACHE_SUFFIX);
+    return _dir + name;
+}
+
+//----------------------------------------------------------------------------
+// _evict
+// Deletes the least recently used entries until the cache fits its limit.
+//----------------------------------------------------------------------------
+void StreamCache::_evict(const std::string &keep_path)
+{
+    struct Entry
+    {
+        std::string path;
+        struct timespec mtime;
+        uint64_t size;
+    };
+    std::vector<Entry> entries;
+    uint64_t total = 0;
+
+    // Get the entries and the total size
+    DIR *dir = ::opendir(_dir.c_str());
+    if (!dir)
+    {
+        return;
+    }
+    while (struct dirent *d = ::readdir(dir))
+    {
+        std::string name = d->d_name;
+        struct stat st;
+        if ((name.size() > std::strlen(STREAM_CACHE_SUFFIX)) &&
+            (name.compare((name.size() - std::strlen(STREAM_CACHE_SUFFIX)), std::string::npos, STREAM_CACHE_SUFFIX) == 0) &&
+            (::stat((_dir + name).c_str(), &st) == 0))
+        {
+            entries.push_back({(_dir + name), st.st_mtim, static_cast<uint64_t>(st.st_size)});
+            total += st.st_size;
+        }
+    }
+    ::closedir(dir);
+
+    // Delete the oldest first
+    std::sort(entries.begin(), entries.end(), [](const Entry &a, const Entry &b) {
+        return (a.mtime.tv_sec < b.mtime.tv_sec) || ((a.mtime.tv_sec == b.mtime.tv_sec) && (a.mtime.tv_nsec < b.mtime.tv_nsec));
+    });
+    for (const Entry &e : entries)
+    {
+        if (total <= _max_bytes)
+        {
+            break;
+        }
+        if ((e.path != keep_path) && (::unlink(e.path.c_str()) == 0))
+        {
+            total -= e.size;
+        }
+    }
+}
+
+//----------------------------------------------------------------------------
+// _header_checksum
+//----------------------------------------------------------------------------
+uint64_t _header_checksum(StreamCacheHeader header)
+{
+    header.checksum = 0;
+    return hash_bytes(&header, sizeof(header));
+}
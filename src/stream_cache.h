@@ -0,0 +1,77 @@
+/**
+ *-----------------------------------------------------------------------------
+ * Copyright (c) 2021-2024 Melbourne Instruments, Australia
+ *-----------------------------------------------------------------------------
+ * @file  stream_cache.h
+ * @brief On-device cache of translated transfer streams.
+ *
+ * A translated stream (the exact bytes a kernel sends for an image) only
+ * depends on the image, the kernel profile and the translator version, so
+ * it is kept in a cache directory after the first run and mapped on later
+ * runs instead of being translated again. Each entry is one file named by
+ * the image and profile hashes, with a checksummed header that also holds
+ * a hash of the stream. An entry whose header does not match (e.g. a new
+ * translator version), or whose stream does not match its hash, is deleted
+ * when it is looked up, and entries for images no longer used age out: the least
+ * recently used entries are evicted to keep the cache within its size
+ * limit.
+ *-----------------------------------------------------------------------------
+ */
+#ifndef _STREAM_CACHE_H
+#define _STREAM_CACHE_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <sys/types.h>
+
+// Constants
+constexpr char DEFAULT_CACHE_DIR[]          = "/var/cache/fpga_config/";
+constexpr uint32_t STREAM_CACHE_MAGIC       = 0x43535046;    // "FPSC"
+constexpr uint32_t STREAM_CACHE_VERSION     = 2;
+constexpr uint64_t STREAM_CACHE_MAX_BYTES   = (64 * 1024 * 1024);
+
+// The header of a cache entry, followed by the stream
+struct StreamCacheHeader
+{
+    uint32_t magic;
+    uint32_t version;
+    uint64_t image_hash;
+    uint64_t profile_hash;
+    uint64_t stream_size;
+    uint64_t stream_hash;
+    uint64_t reserved[2];
+    uint64_t checksum;
+};
+static_assert(sizeof(StreamCacheHeader) == 64, "The stream cache header must be 64 bytes");
+
+// Stream cache
+class StreamCache
+{
+public:
+    StreamCache() = default;
+    ~StreamCache() { close(); }
+
+    void set_dir(const std::string &dir, uint64_t max_bytes=STREAM_CACHE_MAX_BYTES);
+    const uint8_t *map(uint64_t image_hash, uint64_t profile_hash, uint &size);
+    bool store(uint64_t image_hash, uint64_t profile_hash, const uint8_t *stream, uint size);
+    void close();
+
+private:
+    struct Mapping
+    {
+        uint64_t image_hash;
+        uint64_t profile_hash;
+        void *addr;
+        size_t len;
+    };
+
+    std::string _dir;
+    uint64_t _max_bytes = 0;
+    std::vector<Mapping> _mappings;
+
+    std::string _entry_path(uint64_t image_hash, uint64_t profile_hash) const;
+    void _evict(const std::string &keep_path);
+};
+
+#endif  // _STREAM_CACHE_H
@@ -0,0 +1,143 @@
+/**
+ *-----------------------------------------------------------------------------
+ * Copyright (c) 2021-2024 Melbourne Instruments, Australia
+ *-----------------------------------------------------------------------------
+ * @file  trace.cpp
+ * @brief Chrome trace export of the configuration timeline.
+ *-----------------------------------------------------------------------------
+ */
+#include <fstream>
+#include <iomanip>
+#include <ctime>
+#include <cstdio>
+#include <unistd.h>
+#include "trace.h"
+
+// Constants
+const char *track_names[] = { "", "loader", "clocker", "verifier", "watcher", "control" };
+
+// Local functions
+std::string _json_string(const std::string &str);
+
+//----------------------------------------------------------------------------
+// now_ns
+//----------------------------------------------------------------------------
+uint64_t TraceRecorder::now_ns()
+{
+    struct timespec ts;
+    ::clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (static_cast<uint64_t>(ts.tv_sec) * 1000000000) + ts.tv_nsec;
+}
+
+//----------------------------------------------------------------------------
+// slice
+//----------------------------------------------------------------------------
+void TraceRecorder::slice(TraceTrack track, const char *name, uint64_t start_ns, uint64_t end_ns, const std::string &args)
+{
+    if (_enabled)
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _events.push_back({track, name, start_ns, (end_ns - start_ns), false, args});
+    }
+}
+
+//----------------------------------------------------------------------------
+// instant
+//----------------------------------------------------------------------------
+void TraceRecorder::instant(TraceTrack track, const char *name, const std::string &args)
+{
+    if (_enabled)
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _events.push_back({track, name, now_ns(), 0, true, args});
+    }
+}
+
+//----------------------------------------------------------------------------
+// write
+// Writes the track names as metadata events, then the events.
+//----------------------------------------------------------------------------
+bool TraceRecorder::write(const std::string &path) const
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    std::string tmp_path = path + ".tmp";
+    std::ofstream file(tmp_path, (std::ios::out|std::ios::trunc));
+    int pid = ::getpid();
+
+    if (!file.is_open())
+    {
+        return false;
+    }
+    file << std::fixed << std::setprecision(3);
+    file << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n";
+    file << "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":" << pid << ",\"tid\":0,\"args\":{\"name\":\"fpga_config\"}}";
+    for (uint i=1; i<(sizeof(track_names) / sizeof(track_names[0])); i++)
+    {
+        file << ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":" << pid << ",\"tid\":" << i <<
+                ",\"args\":{\"name\":\"" << track_names[i] << "\"}}";
+        file << ",\n{\"name\":\"thread_sort_index\",\"ph\":\"M\",\"pid\":" << pid << ",\"tid\":" << i <<
+                ",\"args\":{\"sort_index\":" << i << "}}";
+    }
+    for (const TraceEvent &e : _events)
+    {
+        file << ",\n{\"name\":" << _json_string(e.name) << ",\"cat\":\"fpga_config\",\"ph\":\"" << (e.instant ? "i" : "X") <<
+                "\",\"ts\":" << (e.start_ns / 1000.0);
+        if (e.instant)
+        {
+            file << ",\"s\":\"t\"";
+        }
+        else
+        {
+            file << ",\"dur\":" << (e.duration_ns / 1000.0);
+        }
+        file << ",\"pid\":" << pid << ",\"tid\":" << static_cast<uint>(e.track) << ",\"args\":{" << e.args << "}}";
+    }
+    file << "\n]}\n";
+    file.close();
+    return file && (std::rename(tmp_path.c_str(), path.c_str()) == 0);
+}
+
+//----------------------------------------------------------------------------
+// trace_arg
+// Returns a "name":value pair for the args of an event. Separate pairs
+// with a comma.
+//----------------------------------------------------------------------------
+std::string trace_arg(const char *name, const std::string &value)
+{
+    return _json_string(name) + ":" + _json_string(value);
+}
+
+//----------------------------------------------------------------------------
+// trace_arg
+//----------------------------------------------------------------------------
+std::string trace_arg(const char *name, uint64_t value)
+{
+    return _json_string(name) + ":" + std::to_string(value);
+}
+
+//----------------------------------------------------------------------------
+// _json_string
+//----------------------------------------------------------------------------
+std::string _json_string(const std::string &str)
+{
+    std::string json = "\"";
+    for (char c : str)
+    {
+        if ((c == '"') || (c == '\\'))
+        {
+            json += '\\';
+            json += c;
+        }
+        else if (static_cast<unsigned char>(c) < 0x20)
+        {
+            char buf[8];
+            std::snprintf(buf, sizeof(buf), "\\u%04x", c);
+            json += buf;
+        }
+        else
+        {
+            json += c;
+        }
+    }
+    return json + "\"";
+}
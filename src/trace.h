@@ -0,0 +1,91 @@
+/**
+ *-----------------------------------------------------------------------------
+ * Copyright (c) 2021-2024 Melbourne Instruments, Australia
+ *-----------------------------------------------------------------------------
+ * @file  trace.h
+ * @brief Chrome trace export of the configuration timeline.
+ *
+ * Phases, I/O completions and stalls are recorded as slices and instants on
+ * a track per stage (loader, clocker, verifier, watcher, control), and
+ * written as Chrome trace JSON that Perfetto and chrome://tracing can load.
+ * Timestamps are CLOCK_MONOTONIC, i.e. time since boot, so the trace lines
+ * up with a boot chart. Recording is off unless enabled, and then costs a
+ * clock read and a vector append per event, outside the bit loop.
+ *-----------------------------------------------------------------------------
+ */
+#ifndef _TRACE_H
+#define _TRACE_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <mutex>
+
+// Trace tracks
+enum class TraceTrack : uint
+{
+    LOADER = 1,
+    CLOCKER,
+    VERIFIER,
+    WATCHER,
+    CONTROL
+};
+
+// A trace event, a slice if it has a duration, otherwise an instant
+struct TraceEvent
+{
+    TraceTrack track;
+    const char *name;
+    uint64_t start_ns;
+    uint64_t duration_ns;
+    bool instant;
+    std::string args;
+};
+
+// Trace recorder
+class TraceRecorder
+{
+public:
+    TraceRecorder() = default;
+
+    void enable() { _enabled = true; }
+    bool enabled() const { return _enabled; }
+    static uint64_t now_ns();
+    void slice(TraceTrack track, const char *name, uint64_t start_ns, uint64_t end_ns, const std::string &args="");
+    void instant(TraceTrack track, const char *name, const std::string &args="");
+    bool write(const std::string &path) const;
+
+private:
+    bool _enabled = false;
+    mutable std::mutex _mutex;
+    std::vector<TraceEvent> _events;
+};
+
+// Records a slice from construction to destruction
+class TraceSlice
+{
+public:
+    TraceSlice(TraceRecorder &recorder, TraceTrack track, const char *name) :
+        _recorder(recorder), _track(track), _name(name), _start_ns(recorder.enabled() ? TraceRecorder::now_ns() : 0) {}
+    ~TraceSlice()
+    {
+        if (_recorder.enabled())
+        {
+            _recorder.slice(_track, _name, _start_ns, TraceRecorder::now_ns(), args);
+        }
+    }
+
+    std::string args;
+
+private:
+    TraceRecorder &_recorder;
+    TraceTrack _track;
+    const char *_name;
+    uint64_t _start_ns;
+};
+
+// Functions
+std::string trace_arg(const char *name, const std::string &value);
+std::string trace_arg(const char *name, uint64_t value);
+
+#endif  // _TRACE_H
@@ -0,0 +1,270 @@
+/**
+ *-----------------------------------------------------------------------------
+ * Copyright (c) 2021-2024 Melbourne Instruments, Australia
+ *-----------------------------------------------------------------------------
+ * @file  transfer.h
+ * @brief Passive serial transfer kernels.
+ *
+ * The CPU kernel loops over the bits of each byte. The table kernel instead
+ * dispatches each byte through a table of 256 straight-line handlers, one
+ * per byte value, generated at compile time, each issuing the exact stores
+ * for its byte with no bit loop. The DCLK edges are issued as in the CPU
+ * kernel, so they follow the ordering policy. It trades the loop overhead
+ * for an indirect branch per byte and a much larger I-cache footprint.
+ *-----------------------------------------------------------------------------
+ */
+#ifndef _TRANSFER_H
+#define _TRANSFER_H
+
+#include <cstdint>
+#include <algorithm>
+#include <atomic>
+#include <array>
+#include <utility>
+#include "gpio.h"
+#include "protocol.h"
+
+// Constants. The exit flag is checked once per chunk, so the chunk size sets
+// the abort latency of the CPU kernel (~0.3ms on a Pi 4)
+constexpr uint TRANSFER_CHUNK_SIZE = 1024;
+
+// Sampler that does nothing
+struct NullSampler
+{
+    inline void sample([[maybe_unused]] uint num_bytes_sent) {}
+};
+
+//----------------------------------------------------------------------------
+// _set_dclk_writes
+//----------------------------------------------------------------------------
+template <class Gpio, size_t... Writes>
+inline void _set_dclk_writes(Gpio &gpio, std::index_sequence<Writes...>)
+{
+    ((static_cast<void>(Writes), gpio.set(DCLK_GPIO_BANK, DCLK_GPIO_MASK)), ...);
+}
+
+//----------------------------------------------------------------------------
+// _clr_dclk_writes
+//----------------------------------------------------------------------------
+template <class Gpio, size_t... Writes>
+inline void _clr_dclk_writes(Gpio &gpio, std::index_sequence<Writes...>)
+{
+    ((static_cast<void>(Writes), gpio.clr(DCLK_GPIO_BANK, DCLK_GPIO_MASK)), ...);
+}
+
+//----------------------------------------------------------------------------
+// set_dclk_pin
+// The rising edge, ordered after the DATA0 store by the edge point. The
+// writes are repeated by a volatile loop unless the ordering policy unrolls
+// them (see mmio.h).
+//----------------------------------------------------------------------------
+template <class Gpio>
+inline void set_dclk_pin(Gpio &gpio)
+{
+    gpio.edge();
+    if constexpr (Gpio::Policy::UNROLLED_DCLK_WRITES)
+    {
+        _set_dclk_writes(gpio, std::make_index_sequence<NUM_CONSECUTIVE_GPIO_WRITES>());
+    }
+    else
+    {
+        for (uint volatile i=0; i<NUM_CONSECUTIVE_GPIO_WRITES; i++)
+            gpio.set(DCLK_GPIO_BANK, DCLK_GPIO_MASK);
+    }
+}
+
+//----------------------------------------------------------------------------
+// clr_dclk_pin
+// The falling edge, ordered after the high level.
+//----------------------------------------------------------------------------
+template <class Gpio>
+inline void clr_dclk_pin(Gpio &gpio)
+{
+    gpio.edge();
+    if constexpr (Gpio::Policy::UNROLLED_DCLK_WRITES)
+    {
+        _clr_dclk_writes(gpio, std::make_index_sequence<NUM_CONSECUTIVE_GPIO_WRITES>());
+    }
+    else
+    {
+        for (uint volatile i=0; i<NUM_CONSECUTIVE_GPIO_WRITES; i++)
+            gpio.clr(DCLK_GPIO_BANK, DCLK_GPIO_MASK);
+    }
+}
+
+//----------------------------------------------------------------------------
+// clock_trailing_dclks
+// We need to keep clocking DCLK once the FPGA has accepted the data and set
+// CONF_DONE high, for as many DCLKs as the protocol needs.
+//----------------------------------------------------------------------------
+template <class Gpio>
+inline void clock_trailing_dclks(Gpio &gpio)
+{
+    int dclk_count = ConfigProtocol::NUM_TRAILING_DCLKS;
+    while (dclk_count--)
+    {
+        // Set the DCLK rising edge
+        set_dclk_pin(gpio);
+
+        // Set the DCLK falling edge
+        clr_dclk_pin(gpio);
+    }
+}
+
+//----------------------------------------------------------------------------
+// transfer_data
+// Clocks the passed data out on DATA0/DCLK using the CPU. The GPIO backend
+// is a template parameter so the same kernel can drive the hardware or be
+// traced for verification. The exit flag is checked and the sampler called
+// with the number of bytes sent once per chunk, keeping both out of the per
+// byte loop.
+//----------------------------------------------------------------------------
+template <class Gpio, class Sampler>
+void transfer_data(Gpio &gpio, const uint8_t *data, uint size, const std::atomic<bool> &exit_flag, Sampler &sampler)
+{
+    const uint8_t *data_start = data;
+    const uint8_t *data_end = data + size;
+
+    // Do until all file data has been processed, or the program exited
+    while (data < data_end)
+    {
+        if (exit_flag.load(std::memory_order_relaxed))
+        {
+            return;
+        }
+        const uint8_t *chunk_end = std::min((data + TRANSFER_CHUNK_SIZE), data_end);
+        while (data < chunk_end)
+        {
+            uint8_t byte = *data++;
+
+            // Send each bit in the byte, in the bit order of the protocol
+            for (int i=0; i<8; i++)
+            {
+                // Get the bit and either set/clear the GPIO pin
+                uint8_t bit = (byte >> protocol_bit_shift(i)) & 0x01;
+                if (bit)
+                {
+                    gpio.set(DATA0_GPIO_BANK, DATA0_GPIO_MASK);
+                }
+                else
+                {
+                    gpio.clr(DATA0_GPIO_BANK, DATA0_GPIO_MASK);
+                }
+
+                // Set the DCLK rising edge
+                set_dclk_pin(gpio);
+
+                // Set the DCLK falling edge
+                clr_dclk_pin(gpio);
+            }
+        }
+        sampler.sample(data - data_start);
+    }
+
+    // Keep clocking DCLK until the FPGA enters user mode
+    clock_trailing_dclks(gpio);
+}
+
+//----------------------------------------------------------------------------
+// transfer_data
+//----------------------------------------------------------------------------
+template <class Gpio>
+void transfer_data(Gpio &gpio, const uint8_t *data, uint size, const std::atomic<bool> &exit_flag)
+{
+    NullSampler sampler;
+    transfer_data(gpio, data, size, exit_flag, sampler);
+}
+
+// Handler that clocks out one byte value
+template <class Gpio>
+using ByteHandler = void (*)(Gpio &gpio);
+
+//----------------------------------------------------------------------------
+// _send_bit
+//----------------------------------------------------------------------------
+template <class Gpio, bool Bit>
+inline void _send_bit(Gpio &gpio)
+{
+    if constexpr (Bit)
+    {
+        gpio.set(DATA0_GPIO_BANK, DATA0_GPIO_MASK);
+    }
+    else
+    {
+        gpio.clr(DATA0_GPIO_BANK, DATA0_GPIO_MASK);
+    }
+    set_dclk_pin(gpio);
+    clr_dclk_pin(gpio);
+}
+
+//----------------------------------------------------------------------------
+// _send_byte
+// The straight-line handler of a byte value, in the bit order of the
+// protocol.
+//----------------------------------------------------------------------------
+template <class Gpio, uint Byte, size_t... Bits>
+void _send_byte(Gpio &gpio, std::index_sequence<Bits...>)
+{
+    (_send_bit<Gpio, (((Byte >> protocol_bit_shift(Bits)) & 0x01) != 0)>(gpio), ...);
+}
+
+template <class Gpio, uint Byte>
+void _send_byte(Gpio &gpio)
+{
+    _send_byte<Gpio, Byte>(gpio, std::make_index_sequence<8>());
+}
+
+//----------------------------------------------------------------------------
+// _make_byte_handlers
+//----------------------------------------------------------------------------
+template <class Gpio, size_t... Bytes>
+constexpr std::array<ByteHandler<Gpio>, 256> _make_byte_handlers(std::index_sequence<Bytes...>)
+{
+    return {{ &_send_byte<Gpio, Bytes>... }};
+}
+
+// The handler table of a GPIO backend
+template <class Gpio>
+inline constexpr std::array<ByteHandler<Gpio>, 256> byte_handlers = _make_byte_handlers<Gpio>(std::make_index_sequence<256>());
+
+//----------------------------------------------------------------------------
+// transfer_data_table
+// Clocks the passed data out like transfer_data, dispatching each byte to
+// its handler. The chunking, exit flag and sampler are the same.
+//----------------------------------------------------------------------------
+template <class Gpio, class Sampler>
+void transfer_data_table(Gpio &gpio, const uint8_t *data, uint size, const std::atomic<bool> &exit_flag, Sampler &sampler)
+{
+    const ByteHandler<Gpio> *handlers = byte_handlers<Gpio>.data();
+    const uint8_t *data_start = data;
+    const uint8_t *data_end = data + size;
+
+    while (data < data_end)
+    {
+        if (exit_flag.load(std::memory_order_relaxed))
+        {
+            return;
+        }
+        const uint8_t *chunk_end = std::min((data + TRANSFER_CHUNK_SIZE), data_end);
+        while (data < chunk_end)
+        {
+            handlers[*data++](gpio);
+        }
+        sampler.sample(data - data_start);
+    }
+
+    // Keep clocking DCLK until the FPGA enters user mode
+    clock_trailing_dclks(gpio);
+}
+
+//----------------------------------------------------------------------------
+// transfer_data_table
+//----------------------------------------------------------------------------
+template <class Gpio>
+void transfer_data_table(Gpio &gpio, const uint8_t *data, uint size, const std::atomic<bool> &exit_flag)
+{
+    NullSampler sampler;
+    transfer_data_table(gpio, data, size, exit_flag, sampler);
+}
+
+#endif  // _TRANSFER_H
@@ -0,0 +1,339 @@
+/**
+ *-----------------------------------------------------------------------------
+ * Copyright (c) 2021-2024 Melbourne Instruments, Australia
+ *-----------------------------------------------------------------------------
+ * @file  verify.cpp
+ * @brief Golden-trace differential verification of the transfer kernels.
+ *-----------------------------------------------------------------------------
+ */
+#include <iostream>
+#include <cstring>
+#include <fstream>
+#include <algorithm>
+#include <dirent.h>
+#include "common.h"
+#include "verify.h"
+#include "gpio.h"
+#include "waveform.h"
+#include "transfer.h"
+#include "dma_engine.h"
+#include "spi_engine.h"
+#include "protocol.h"
+
+// Constants
+constexpr char RBF_FILE_EXTENSION[] = ".rbf";
+
+// Output of a kernel run through its simulated backend
+struct KernelOutput
+{
+    bool has_writes = false;
+    bool has_edges = false;
+    std::vector<GpioRegWrite> writes;
+    std::vector<uint> edges;
+    Waveform waveform;
+};
+
+// A kernel under verification
+struct VerifyKernel
+{
+    const char *name;
+    bool (*run)(const uint8_t *data, uint size, KernelOutput &output);
+};
+
+// Local functions
+bool _run_cpu_kernel(const uint8_t *data, uint size, KernelOutput &output);
+bool _run_dma_kernel(const uint8_t *data, uint size, KernelOutput &output);
+bool _run_spi_kernel(const uint8_t *data, uint size, KernelOutput &output);
+bool _run_spi_stream_kernel(const uint8_t *data, uint size, KernelOutput &output);
+bool _run_table_kernel(const uint8_t *data, uint size, KernelOutput &output);
+bool _verify_kernel(const VerifyKernel &kernel, const VerifyImage &image, const KernelOutput &reference);
+bool _verify_ordering(const char *name, const KernelOutput &output);
+void _add_synthetic_image(const std::string &name, std::vector<uint8_t> data, std::vector<VerifyImage> &corpus);
+
+// The reference kernel, and the kernels verified against it
+const VerifyKernel reference_kernel = { "cpu", _run_cpu_kernel };
+const VerifyKernel verify_kernel_list[] = {
+    { "dma", _run_dma_kernel },
+    { "spi", _run_spi_kernel },
+    { "spi-stream", _run_spi_stream_kernel },
+    { "table", _run_table_kernel },
+};
+
+//----------------------------------------------------------------------------
+// add_synthetic_images
+// Adds images that exercise edge cases: empty and single byte images, every
+// byte value, constant runs, and sizes either side of the SPI message and
+// DMA ring block boundaries.
+//----------------------------------------------------------------------------
+void add_synthetic_images(std::vector<VerifyImage> &corpus)
+{
+    std::vector<uint8_t> ramp(256);
+    std::vector<uint8_t> alternating(4096);
+    std::vector<uint8_t> random(65537);
+    std::vector<uint8_t> rbf(20000, 0xFF);
+    uint32_t seed = 0x12345678;
+
+    // Generate the patterns
+    for (uint i=0; i<ramp.size(); i++)
+    {
+        ramp[i] = i;
+    }
+    for (uint i=0; i<alternating.size(); i++)
+    {
+        alternating[i] = (i & 0x01) ? 0xAA : 0x55;
+    }
+    for (uint8_t &b : random)
+    {
+        seed ^= seed << 13;
+        seed ^= seed >> 17;
+        seed ^= seed << 5;
+        b = seed;
+    }
+    std::copy((random.begin() + 32), (random.begin() + (rbf.size() - 16)), (rbf.begin() + 32));
+
+    // Add them to the corpus
+    _add_synthetic_image("empty", {}, corpus);
+    _add_synthetic_image("byte-00", {0x00}, corpus);
+    _add_synthetic_image("byte-ff", {0xFF}, corpus);
+    _add_synthetic_image("byte-01", {0x01}, corpus);
+    _add_synthetic_image("byte-80", {0x80}, corpus);
+    _add_synthetic_image("ramp-256", ramp, corpus);
+    _add_synthetic_image("alternating-4096", alternating, corpus);
+    _add_synthetic_image("zeros-4094", std::vector<uint8_t>(4094, 0x00), corpus);
+    _add_synthetic_image("zeros-4095", std::vector<uint8_t>(4095, 0x00), corpus);
+    _add_synthetic_image("ones-8190", std::vector<uint8_t>(8190, 0xFF), corpus);
+    _add_synthetic_image("random-65537", random, corpus);
+    _add_synthetic_image("rbf-like-20000", rbf, corpus);
+}
+
+//----------------------------------------------------------------------------
+// add_image_file
+//----------------------------------------------------------------------------
+bool add_image_file(const std::string &path, std::vector<VerifyImage> &corpus)
+{
+    std::ifstream file(path, (std::ios::in|std::ios::binary));
+    if (!file.is_open())
+    {
+        return false;
+    }
+    corpus.push_back({path, std::vector<uint8_t>(std::istreambuf_iterator<char>(file), {})});
+    return true;
+}
+
+//----------------------------------------------------------------------------
+// add_image_dir
+// Adds every RBF file in the directory, in name order.
+//----------------------------------------------------------------------------
+void add_image_dir(const std::string &dir, std::vector<VerifyImage> &corpus)
+{
+    std::vector<std::string> filenames;
+    DIR *d = ::opendir(dir.c_str());
+    if (!d)
+    {
+        return;
+    }
+    struct dirent *entry;
+    while ((entry = ::readdir(d)) != nullptr)
+    {
+        std::string filename = entry->d_name;
+        if ((filename.size() > std::strlen(RBF_FILE_EXTENSION)) &&
+            (filename.compare((filename.size() - std::strlen(RBF_FILE_EXTENSION)), std::string::npos, RBF_FILE_EXTENSION) == 0))
+        {
+            filenames.push_back(filename);
+        }
+    }
+    ::closedir(d);
+    std::sort(filenames.begin(), filenames.end());
+    for (const std::string &filename : filenames)
+    {
+        add_image_file((dir + filename), corpus);
+    }
+}
+
+//----------------------------------------------------------------------------
+// verify_kernels
+//----------------------------------------------------------------------------
+bool verify_kernels(const std::vector<VerifyImage> &corpus)
+{
+    uint num_failed = 0;
+
+    for (const VerifyImage &image : corpus)
+    {
+        KernelOutput reference;
+
+        // Run the reference kernel and check its bit order, then check each
+        // kernel against it
+        _run_cpu_kernel(image.data.data(), image.data.size(), reference);
+        MSG(image.name << ": " << image.data.size() << " bytes, " << reference.waveform.bits.size() << " DCLKs, " <<
+            reference.writes.size() << " " << reference_kernel.name << " kernel writes");
+        Waveform expected = bytes_to_waveform(image.data.data(), image.data.size(), ConfigProtocol::MSB_FIRST);
+        if (!waveforms_match(expected, reference.waveform, (image.data.size() * 8)))
+        {
+            MSG("    " << reference_kernel.name << ": FAIL, not in the " << ConfigProtocol::NAME << " bit order");
+            num_failed++;
+        }
+        else if (!_verify_ordering(reference_kernel.name, reference))
+        {
+            num_failed++;
+        }
+        for (const VerifyKernel &kernel : verify_kernel_list)
+        {
+            if (!_verify_kernel(kernel, image, reference))
+            {
+                num_failed++;
+            }
+        }
+    }
+    MSG("\n" << corpus.size() << " images, " << (sizeof(verify_kernel_list) / sizeof(VerifyKernel)) <<
+        " kernels verified against the " << reference_kernel.name << " kernel (" << ConfigProtocol::NAME << " protocol, " <<
+        GpioOrdering::NAME << " ordering), " <<
+        num_failed << " failures");
+    return num_failed == 0;
+}
+
+//----------------------------------------------------------------------------
+// _verify_kernel
+//----------------------------------------------------------------------------
+bool _verify_kernel(const VerifyKernel &kernel, const VerifyImage &image, const KernelOutput &reference)
+{
+    KernelOutput output;
+
+    if (!kernel.run(image.data.data(), image.data.size(), output))
+    {
+        MSG("    " << kernel.name << ": ERROR, simulated backend failed");
+        return false;
+    }
+    if (output.has_writes && (output.writes != reference.writes))
+    {
+        auto diff = std::mismatch(reference.writes.begin(), reference.writes.end(),
+                                  output.writes.begin(), output.writes.end());
+        MSG("    " << kernel.name << ": FAIL, register write " << (diff.first - reference.writes.begin()) <<
+            " differs (" << output.writes.size() << " writes)");
+        return false;
+    }
+    if (!waveforms_match(reference.waveform, output.waveform, (image.data.size() * 8)))
+    {
+        auto diff = std::mismatch(reference.waveform.bits.begin(), reference.waveform.bits.end(),
+                                  output.waveform.bits.begin(), output.waveform.bits.end());
+        MSG("    " << kernel.name << ": FAIL, waveform differs at DCLK " << (diff.first - reference.waveform.bits.begin()) <<
+            " (" << output.waveform.bits.size() << " DCLKs)");
+        return false;
+    }
+    if (!_verify_ordering(kernel.name, output))
+    {
+        return false;
+    }
+    MSG("    " << kernel.name << ": PASS");
+    return true;
+}
+
+//----------------------------------------------------------------------------
+// _verify_ordering
+// Checks a kernel that issues edge points has one before every DCLK edge.
+//----------------------------------------------------------------------------
+bool _verify_ordering(const char *name, const KernelOutput &output)
+{
+    uint write;
+    if (output.has_edges && !dclk_edges_ordered(output.writes, output.edges, write))
+    {
+        MSG("    " << name << ": FAIL, DCLK edge at register write " << write << " is not ordered");
+        return false;
+    }
+    return true;
+}
+
+//----------------------------------------------------------------------------
+// _run_cpu_kernel
+//----------------------------------------------------------------------------
+bool _run_cpu_kernel(const uint8_t *data, uint size, KernelOutput &output)
+{
+    TraceGpio gpio;
+    std::atomic<bool> no_exit(false);
+
+    transfer_data(gpio, data, size, no_exit);
+    output.has_writes = true;
+    output.has_edges = true;
+    output.writes = std::move(gpio.writes);
+    output.edges = std::move(gpio.edges);
+    output.waveform = trace_to_waveform(output.writes);
+    return true;
+}
+
+//----------------------------------------------------------------------------
+// _run_dma_kernel
+//----------------------------------------------------------------------------
+bool _run_dma_kernel(const uint8_t *data, uint size, KernelOutput &output)
+{
+    DmaModel dma_model;
+    std::atomic<bool> no_exit(false);
+
+    if (!dma_model.transfer(data, size, no_exit))
+    {
+        return false;
+    }
+    output.has_writes = true;
+    output.writes = dma_model.writes();
+    output.waveform = trace_to_waveform(output.writes);
+    return true;
+}
+
+//----------------------------------------------------------------------------
+// _run_spi_kernel
+//----------------------------------------------------------------------------
+bool _run_spi_kernel(const uint8_t *data, uint size, KernelOutput &output)
+{
+    SpiRecordDevice spi_record(SPI_TRANSFER_LEN);
+    SpiEngine spi_engine(spi_record);
+    std::atomic<bool> no_exit(false);
+
+    if (!spi_engine.transfer(data, size, no_exit))
+    {
+        return false;
+    }
+    output.waveform = bytes_to_waveform(spi_record.bytes().data(), spi_record.bytes().size(), true);
+    return true;
+}
+
+//----------------------------------------------------------------------------
+// _run_spi_stream_kernel
+// The SPI kernel replaying a translated stream, as from the stream cache.
+//----------------------------------------------------------------------------
+bool _run_spi_stream_kernel(const uint8_t *data, uint size, KernelOutput &output)
+{
+    SpiRecordDevice spi_record(SPI_TRANSFER_LEN);
+    SpiEngine spi_engine(spi_record);
+    std::atomic<bool> no_exit(false);
+    std::vector<uint8_t> stream = spi_stream(data, size);
+
+    if (!spi_engine.transfer_stream(stream.data(), stream.size(), no_exit))
+    {
+        return false;
+    }
+    output.waveform = bytes_to_waveform(spi_record.bytes().data(), spi_record.bytes().size(), true);
+    return true;
+}
+
+//----------------------------------------------------------------------------
+// _run_table_kernel
+//----------------------------------------------------------------------------
+bool _run_table_kernel(const uint8_t *data, uint size, KernelOutput &output)
+{
+    TraceGpio gpio;
+    std::atomic<bool> no_exit(false);
+
+    transfer_data_table(gpio, data, size, no_exit);
+    output.has_writes = true;
+    output.has_edges = true;
+    output.writes = std::move(gpio.writes);
+    output.edges = std::move(gpio.edges);
+    output.waveform = trace_to_waveform(output.writes);
+    return true;
+}
+
+//----------------------------------------------------------------------------
+// _add_synthetic_image
+//----------------------------------------------------------------------------
+void _add_synthetic_image(const std::string &name, std::vector<uint8_t> data, std::vector<VerifyImage> &corpus)
+{
+    corpus.push_back({("synthetic/" + name), std::move(data)});
+}
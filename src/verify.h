@@ -0,0 +1,35 @@
+/**
+ *-----------------------------------------------------------------------------
+ * Copyright (c) 2021-2024 Melbourne Instruments, Australia
+ *-----------------------------------------------------------------------------
+ * @file  verify.h
+ * @brief Golden-trace differential verification of the transfer kernels.
+ *
+ * Every kernel is run on a corpus of real and synthetic images through its
+ * simulated backend, its output reduced to the logical DCLK/DATA0 waveform,
+ * and the waveform checked against that of the reference CPU kernel.
+ * Kernels that write the GPIO registers must also match the reference
+ * register trace write for write.
+ *-----------------------------------------------------------------------------
+ */
+#ifndef _VERIFY_H
+#define _VERIFY_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// An image in the verification corpus
+struct VerifyImage
+{
+    std::string name;
+    std::vector<uint8_t> data;
+};
+
+// Functions
+void add_synthetic_images(std::vector<VerifyImage> &corpus);
+bool add_image_file(const std::string &path, std::vector<VerifyImage> &corpus);
+void add_image_dir(const std::string &dir, std::vector<VerifyImage> &corpus);
+bool verify_kernels(const std::vector<VerifyImage> &corpus);
+
+#endif  // _VERIFY_H
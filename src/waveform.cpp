@@ -0,0 +1,113 @@
+/**
+ *-----------------------------------------------------------------------------
+ * Copyright (c) 2021-2024 Melbourne Instruments, Australia
+ *-----------------------------------------------------------------------------
+ * @file  waveform.cpp
+ * @brief Logical DCLK/DATA0 waveform, as seen by the FPGA.
+ *-----------------------------------------------------------------------------
+ */
+#include <algorithm>
+#include "waveform.h"
+
+//----------------------------------------------------------------------------
+// trace_to_waveform
+// Replays the GPIO register writes of both banks, starting with DCLK and
+// DATA0 low, and samples DATA0 on each DCLK rising edge.
+//----------------------------------------------------------------------------
+Waveform trace_to_waveform(const std::vector<GpioRegWrite> &writes)
+{
+    Waveform waveform;
+    uint64_t level = 0;
+
+    for (const GpioRegWrite &w : writes)
+    {
+        uint64_t prev_level = level;
+        for (uint i=0; i<GPIO_NUM_BANKS; i++)
+        {
+            if (w.offset == gpio_set_offset(i))
+            {
+                level |= static_cast<uint64_t>(w.value) << (i * GPIO_BANK_SIZE);
+            }
+            else if (w.offset == gpio_clr_offset(i))
+            {
+                level &= ~(static_cast<uint64_t>(w.value) << (i * GPIO_BANK_SIZE));
+            }
+        }
+        if (((level >> DCLK_GPIO_PIN) & 0x01) && !((prev_level >> DCLK_GPIO_PIN) & 0x01))
+        {
+            waveform.bits.push_back((level >> DATA0_GPIO_PIN) & 0x01);
+        }
+    }
+    return waveform;
+}
+
+//----------------------------------------------------------------------------
+// bytes_to_waveform
+// Returns the waveform of a byte stream shifted out by a serial peripheral.
+//----------------------------------------------------------------------------
+Waveform bytes_to_waveform(const uint8_t *data, uint size, bool msb_first)
+{
+    Waveform waveform;
+
+    waveform.bits.reserve(size * 8);
+    for (uint i=0; i<size; i++)
+    {
+        for (uint j=0; j<8; j++)
+        {
+            waveform.bits.push_back((data[i] >> (msb_first ? (7 - j) : j)) & 0x01);
+        }
+    }
+    return waveform;
+}
+
+//----------------------------------------------------------------------------
+// waveforms_match
+// The data bits must be identical. The level of DATA0 during the trailing
+// DCLKs is don't care, but there must be at least as many of them.
+//----------------------------------------------------------------------------
+bool waveforms_match(const Waveform &reference, const Waveform &waveform, uint num_data_bits)
+{
+    if ((reference.bits.size() < num_data_bits) || (waveform.bits.size() < reference.bits.size()))
+    {
+        return false;
+    }
+    return std::equal(reference.bits.begin(), reference.bits.begin() + num_data_bits, waveform.bits.begin());
+}
+
+//----------------------------------------------------------------------------
+// dclk_edges_ordered
+// Replays the writes like trace_to_waveform, and checks there is an edge
+// point (where the ordering policy orders the stores) before every write
+// that changes the DCLK level, so no edge can overtake the data or the
+// previous level. Returns the first write that is not, if any.
+//----------------------------------------------------------------------------
+bool dclk_edges_ordered(const std::vector<GpioRegWrite> &writes, const std::vector<uint> &edges, uint &unordered_write)
+{
+    auto edge = edges.begin();
+    bool dclk = false;
+
+    for (uint i=0; i<writes.size(); i++)
+    {
+        const GpioRegWrite &w = writes[i];
+        bool level = dclk;
+        if ((w.offset == gpio_set_offset(DCLK_GPIO_BANK)) && (w.value & DCLK_GPIO_MASK))
+        {
+            level = true;
+        }
+        else if ((w.offset == gpio_clr_offset(DCLK_GPIO_BANK)) && (w.value & DCLK_GPIO_MASK))
+        {
+            level = false;
+        }
+        while ((edge != edges.end()) && (*edge < i))
+        {
+            edge++;
+        }
+        if ((level != dclk) && ((edge == edges.end()) || (*edge != i)))
+        {
+            unordered_write = i;
+            return false;
+        }
+        dclk = level;
+    }
+    return true;
+}
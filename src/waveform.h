@@ -0,0 +1,28 @@
+/**
+ *-----------------------------------------------------------------------------
+ * Copyright (c) 2021-2024 Melbourne Instruments, Australia
+ *-----------------------------------------------------------------------------
+ * @file  waveform.h
+ * @brief Logical DCLK/DATA0 waveform, as seen by the FPGA.
+ *-----------------------------------------------------------------------------
+ */
+#ifndef _WAVEFORM_H
+#define _WAVEFORM_H
+
+#include <cstdint>
+#include <vector>
+#include "gpio.h"
+
+// The DATA0 level sampled on each DCLK rising edge
+struct Waveform
+{
+    std::vector<uint8_t> bits;
+};
+
+// Functions
+Waveform trace_to_waveform(const std::vector<GpioRegWrite> &writes);
+Waveform bytes_to_waveform(const uint8_t *data, uint size, bool msb_first);
+bool waveforms_match(const Waveform &reference, const Waveform &waveform, uint num_data_bits);
+bool dclk_edges_ordered(const std::vector<GpioRegWrite> &writes, const std::vector<uint> &edges, uint &unordered_write);
+
+#endif  // _WAVEFORM_H